@@ -0,0 +1,77 @@
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#include "alloc_stats.hpp"
+
+namespace
+{
+	std::atomic<uint64_t> alloc_count(0);
+	std::atomic<uint64_t> alloc_bytes(0);
+
+	void* counted_alloc(size_t size)
+	{
+		alloc_count.fetch_add(1, std::memory_order_relaxed);
+		alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+		return std::malloc(size != 0 ? size : 1);
+	}
+}
+
+namespace bench
+{
+	alloc_counts get_alloc_counts()
+	{
+		alloc_counts res;
+		res.count = alloc_count.load(std::memory_order_relaxed);
+		res.bytes = alloc_bytes.load(std::memory_order_relaxed);
+		return res;
+	}
+}
+
+void* operator new(size_t size)
+{
+	void* p = counted_alloc(size);
+	if(p == nullptr) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void* operator new[](size_t size)
+{
+	void* p = counted_alloc(size);
+	if(p == nullptr) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+	return counted_alloc(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+	return counted_alloc(size);
+}
+
+void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept
+{
+	std::free(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept
+{
+	std::free(p);
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstdint>
+
+namespace bench
+{
+	struct alloc_counts
+	{
+		alloc_counts() : count(0), bytes(0) {}
+		uint64_t count;
+		uint64_t bytes;
+	};
+
+	// Number and total size of the allocations made through operator new so far, on any
+	// thread. Linking alloc_stats.cpp replaces the global allocation functions.
+	alloc_counts get_alloc_counts();
+}
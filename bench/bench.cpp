@@ -0,0 +1,512 @@
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include "alloc_stats.hpp"
+#include "anim_range.hpp"
+#include "asserts.hpp"
+#include "builder_map.hpp"
+#include "corpus.hpp"
+#include "filesystem.hpp"
+#include "image_path.hpp"
+#include "json.hpp"
+#include "json_lazy.hpp"
+#include "profile_timer.hpp"
+#include "rule_index.hpp"
+#include "synthetic.hpp"
+#include "terrain_builder.hpp"
+#include "terrain_match.hpp"
+#include "terrain_parser.hpp"
+#include "terrain_pattern.hpp"
+#include "variant.hpp"
+#include "variant_utils.hpp"
+
+// Runs each stage of the terrain-graphics conversion over WML regenerated from the
+// shipped data and writes the timings as JSON. Then matches every tile type pattern
+// against each hex of a synthetic map, with the compiled patterns and from the strings,
+// reads the map of every rule into a grid and applies the rules to a large synthetic map.
+//
+//   --reps=N      timed repetitions of every stage (default 20)
+//   --warmup=N    untimed repetitions run first (default 2)
+//   --scale=N     copies of terrain-graphics in the scaled corpus (default 8)
+//   --threads=N   threads used by the conversion, rule index, JSON writer and terrain
+//                 builder (default 0, all cores)
+//   --data=DIR    directory holding terrain.cfg/terrain-graphics.cfg (default vs2013)
+//   --work=DIR    where the generated WML is written (default bench-data)
+//   --output=FILE write the results to FILE rather than stdout
+//   --expand-ranges  convert animation ranges frame by frame
+//   --map=WxH     size of the synthetic map for the matcher (default 128x128)
+//   --build-map=WxH  size of the synthetic map the rules are applied to (default 1000x1000)
+//   --build-reps=N   timed repetitions of applying the rules (default 3)
+//   --synthetic=SIZES     also convert generated terrain-graphics corpora which expand to
+//                         about each of these sizes, e.g. 64k,1m,16m,1g (default none)
+//   --synthetic-rules=N,...  the same, giving the number of rules rather than the size
+//   --synthetic-reps=N    timed repetitions for the synthetic corpora, with no warmup
+//                         (default 3)
+//   --synthetic-templates=N, --synthetic-depth=N, --synthetic-fanout=N,
+//   --synthetic-tiles=N, --synthetic-images=N, --synthetic-attributes=N,
+//   --synthetic-multi-line=F, --synthetic-merges=F, --synthetic-seed=N
+//                         the shape of the synthetic corpora, see synthetic_options
+//   --generate-only  write the corpora to the work directory and stop
+
+namespace
+{
+	struct stage_result
+	{
+		explicit stage_result(const std::string& n) : name(n), bytes(0), times(), allocations(), alloc_bytes() {}
+		std::string name;
+		// amount of input the stage processes, or for the writer the amount of output.
+		size_t bytes;
+		std::vector<double> times;
+		std::vector<uint64_t> allocations;
+		std::vector<uint64_t> alloc_bytes;
+	};
+
+	template<typename Fn>
+	void measure(stage_result& res, bool record, Fn fn)
+	{
+		const auto alloc_start = bench::get_alloc_counts();
+		profile::timer timer;
+		timer.start();
+		fn();
+		const double elapsed = timer.check();
+		const auto alloc_end = bench::get_alloc_counts();
+		if(record) {
+			res.times.emplace_back(elapsed);
+			res.allocations.emplace_back(alloc_end.count - alloc_start.count);
+			res.alloc_bytes.emplace_back(alloc_end.bytes - alloc_start.bytes);
+		}
+	}
+
+	// Nearest-rank percentile, p in (0, 100].
+	template<typename T>
+	T percentile(std::vector<T> values, double p)
+	{
+		ASSERT_LOG(!values.empty(), "No samples to take the percentile of.");
+		std::sort(values.begin(), values.end());
+		const size_t rank = static_cast<size_t>(std::ceil(p / 100.0 * values.size()));
+		return values[rank != 0 ? rank - 1 : 0];
+	}
+
+	variant summarise(const stage_result& res)
+	{
+		const double median = percentile(res.times, 50.0);
+		variant_builder vb;
+		vb.add("stage", res.name);
+		vb.add("bytes", static_cast<int64_t>(res.bytes));
+		vb.add("median_ms", median * 1000.0);
+		vb.add("p95_ms", percentile(res.times, 95.0) * 1000.0);
+		vb.add("min_ms", *std::min_element(res.times.cbegin(), res.times.cend()) * 1000.0);
+		vb.add("mb_per_s", median > 0 ? res.bytes / median / 1.0e6 : 0.0);
+		vb.add("allocations", static_cast<int64_t>(percentile(res.allocations, 50.0)));
+		vb.add("allocated_bytes", static_cast<int64_t>(percentile(res.alloc_bytes, 50.0)));
+		return vb.build();
+	}
+
+	variant run_corpus(const bench::corpus& c, const std::vector<terrain::terrain_code>& codes, int reps, int warmup, int threads)
+	{
+		stage_result read("read"), harvest("macro_harvest"), substitute("macro_substitute"), parse("read_wml2"), convert("convert"), index("rule_index"), write("write_json"), stream("write_node_json");
+		for(int rep = -warmup; rep != reps; ++rep) {
+			const bool record = rep >= 0;
+			std::string macros, contents, expanded;
+			node_tree_ptr root;
+			variant converted;
+
+			measure(read, record, [&]() {
+				macros = sys::read_file(c.macros_file);
+				contents = sys::read_file(c.main_file);
+			});
+			read.bytes = macros.size() + contents.size();
+
+			// the macro cache is global and rejects duplicate definitions. The name cache is
+			// cleared too so every repetition converts the names from scratch.
+			get_macro_cache().clear();
+			ipf::clear_name_cache();
+			measure(harvest, record, [&]() {
+				pre_process_wml(c.macros_file, macros);
+			});
+			harvest.bytes = macros.size();
+
+			measure(substitute, record, [&]() {
+				expanded = macro_substitute(contents);
+			});
+			substitute.bytes = contents.size();
+
+			measure(parse, record, [&]() {
+				root = read_wml2(expanded);
+			});
+			parse.bytes = expanded.size();
+
+			measure(convert, record, [&]() {
+				converted = convert_tree(root->root(), threads);
+			});
+			convert.bytes = expanded.size();
+
+			// only the terrain-graphics corpora have rules to index.
+			const variant& rules = converted["terrain_graphics"];
+			if(rules.is_list()) {
+				measure(index, record, [&]() {
+					std::vector<terrain::rule_patterns> patterns;
+					for(const auto& rule : rules.as_list()) {
+						patterns.emplace_back(terrain::get_rule_patterns(rule));
+					}
+					terrain::build_rule_index(codes, patterns, threads);
+				});
+				index.bytes = expanded.size();
+			}
+
+			std::ostringstream ss;
+			measure(write, record, [&]() {
+				json::write_parallel(ss, converted, true, 4, threads);
+			});
+			write.bytes = static_cast<size_t>(ss.tellp());
+
+			// convert and write_json in one, without building the variant tree.
+			std::ostringstream streamed;
+			measure(stream, record, [&]() {
+				write_node_json(streamed, root->root(), true, 4, threads);
+			});
+			stream.bytes = static_cast<size_t>(streamed.tellp());
+			ASSERT_LOG(streamed.str() == ss.str(), "write_node_json and write_json disagree on " << c.name);
+		}
+
+		std::vector<variant> stages;
+		for(const auto* s : { &read, &harvest, &substitute, &parse, &convert, &index, &write, &stream }) {
+			if(!s->times.empty()) {
+				stages.emplace_back(summarise(*s));
+			}
+		}
+		// from the last repetition's conversion.
+		const auto names = ipf::get_name_cache_stats();
+		variant_builder vb;
+		vb.add("name", c.name);
+		vb.add("repetitions", reps);
+		vb.add("stages", variant(&stages));
+		vb.add("name_cache_entries", static_cast<int64_t>(names.entries));
+		vb.add("name_cache_hit_rate", names.hit_rate());
+		return vb.build();
+	}
+
+	variant run_matcher(const json::lazy_value& terrain_types, const json::lazy_value& terrain_graphics, int width, int height, int reps, int warmup)
+	{
+		const auto types = bench::get_tile_types(terrain_graphics);
+		const auto map = bench::make_synthetic_map(bench::get_terrain_codes(terrain_types), width, height, 1);
+		std::vector<terrain::type_pattern> patterns;
+		for(const auto& t : types) {
+			patterns.emplace_back(terrain::compile_pattern(t));
+		}
+		std::vector<terrain::terrain_code> codes;
+		for(const auto& hex : map) {
+			codes.emplace_back(terrain::read_terrain_code(hex));
+		}
+
+		stage_result strings("match_strings"), compiled("match_compiled");
+		// bytes holds the number of pattern/hex pairs tested.
+		strings.bytes = compiled.bytes = types.size() * map.size();
+		size_t string_matches = 0, compiled_matches = 0;
+		for(int rep = -warmup; rep != reps; ++rep) {
+			const bool record = rep >= 0;
+			measure(strings, record, [&]() {
+				string_matches = 0;
+				for(const auto& t : types) {
+					for(const auto& hex : map) {
+						string_matches += bench::match_type_string(t, hex) ? 1 : 0;
+					}
+				}
+			});
+			measure(compiled, record, [&]() {
+				compiled_matches = 0;
+				for(const auto& p : patterns) {
+					for(const auto& hex : codes) {
+						compiled_matches += p.matches(hex) ? 1 : 0;
+					}
+				}
+			});
+			ASSERT_LOG(string_matches == compiled_matches, "Compiled patterns matched " << compiled_matches << " hexes, the strings " << string_matches);
+		}
+
+		std::vector<variant> stages;
+		for(const auto* s : { &strings, &compiled }) {
+			auto summary = summarise(*s);
+			const double median = percentile(s->times, 50.0);
+			summary.as_mutable_map()[variant("pairs_per_s")] = variant(median > 0 ? s->bytes / median : 0.0);
+			stages.emplace_back(summary);
+		}
+		variant_builder vb;
+		vb.add("width", width);
+		vb.add("height", height);
+		vb.add("patterns", static_cast<int64_t>(types.size()));
+		vb.add("matches", static_cast<int64_t>(compiled_matches));
+		vb.add("repetitions", reps);
+		vb.add("stages", variant(&stages));
+		return vb.build();
+	}
+
+	variant convert_corpus(const bench::corpus& c)
+	{
+		get_macro_cache().clear();
+		pre_process_wml(c.macros_file, sys::read_file(c.macros_file));
+		return convert_node(read_wml2(macro_substitute(sys::read_file(c.main_file)))->root());
+	}
+
+	variant run_terrain_builder(const bench::corpus& graphics, const json::lazy_value& terrain_types, int width, int height, int reps, int threads)
+	{
+		const terrain::terrain_builder builder(convert_corpus(graphics));
+		const std::string map_file = bench::make_synthetic_map_file(bench::get_terrain_codes(terrain_types), width, height, 1);
+
+		stage_result read("read_map"), build("build_terrain");
+		read.bytes = build.bytes = map_file.size();
+		terrain::hex_map map;
+		size_t images = 0;
+		for(int rep = -1; rep != reps; ++rep) {
+			const bool record = rep >= 0;
+			measure(read, record, [&]() {
+				map = terrain::read_map(map_file);
+			});
+			measure(build, record, [&]() {
+				images = 0;
+				for(const auto& hex : builder.build(map, threads)) {
+					images += hex.size();
+				}
+			});
+		}
+
+		std::vector<variant> stages;
+		for(const auto* s : { &read, &build }) {
+			auto summary = summarise(*s);
+			const double median = percentile(s->times, 50.0);
+			summary.as_mutable_map()[variant("hexes_per_s")] = variant(median > 0 ? map.codes.size() / median : 0.0);
+			stages.emplace_back(summary);
+		}
+		variant_builder vb;
+		vb.add("width", width);
+		vb.add("height", height);
+		vb.add("rules", static_cast<int64_t>(builder.num_rules()));
+		vb.add("flags", static_cast<int64_t>(builder.num_flags()));
+		vb.add("images", static_cast<int64_t>(images));
+		vb.add("repetitions", reps);
+		vb.add("stages", variant(&stages));
+		return vb.build();
+	}
+
+	variant run_builder_maps(const json::lazy_value& terrain_graphics, int reps, int warmup)
+	{
+		std::vector<std::string> maps;
+		const auto rules = terrain_graphics["terrain_graphics"];
+		for(int n = 0; n != rules.num_elements(); ++n) {
+			const auto map = rules[n]["map"];
+			if(!map.is_list()) {
+				continue;
+			}
+			std::string s;
+			for(int line = 0; line != map.num_elements(); ++line) {
+				s += map[line].as_string() + "\n";
+			}
+			maps.emplace_back(s);
+		}
+
+		stage_result read("read_builder_map");
+		for(const auto& m : maps) {
+			read.bytes += m.size();
+		}
+		size_t cells = 0;
+		for(int rep = -warmup; rep != reps; ++rep) {
+			measure(read, rep >= 0, [&]() {
+				cells = 0;
+				for(const auto& m : maps) {
+					cells += terrain::read_builder_map(m).cells.size();
+				}
+			});
+		}
+
+		std::vector<variant> stages;
+		auto summary = summarise(read);
+		const double median = percentile(read.times, 50.0);
+		summary.as_mutable_map()[variant("maps_per_s")] = variant(median > 0 ? maps.size() / median : 0.0);
+		stages.emplace_back(summary);
+		variant_builder vb;
+		vb.add("maps", static_cast<int64_t>(maps.size()));
+		vb.add("cells", static_cast<int64_t>(cells));
+		vb.add("repetitions", reps);
+		vb.add("stages", variant(&stages));
+		return vb.build();
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	int reps = 20;
+	int warmup = 2;
+	int scale = 8;
+	int threads = 0;
+	std::string data_dir = "vs2013";
+	std::string work_dir = "bench-data";
+	std::string output;
+	int map_width = 128;
+	int map_height = 128;
+	int build_width = 1000;
+	int build_height = 1000;
+	int build_reps = 3;
+	std::vector<std::string> synthetic_sizes;
+	std::vector<std::string> synthetic_rules;
+	int synthetic_reps = 3;
+	bench::synthetic_options synthetic;
+	bool generate_only = false;
+	for(int n = 1; n < argc; ++n) {
+		const std::string arg(argv[n]);
+		const auto eq = arg.find('=');
+		const std::string name = arg.substr(0, eq);
+		const std::string value = eq != std::string::npos ? arg.substr(eq + 1) : std::string();
+		try {
+			if(name == "--reps") {
+				reps = boost::lexical_cast<int>(value);
+			} else if(name == "--warmup") {
+				warmup = boost::lexical_cast<int>(value);
+			} else if(name == "--scale") {
+				scale = boost::lexical_cast<int>(value);
+			} else if(name == "--threads") {
+				threads = boost::lexical_cast<int>(value);
+			} else if(name == "--data") {
+				data_dir = value;
+			} else if(name == "--work") {
+				work_dir = value;
+			} else if(name == "--output") {
+				output = value;
+			} else if(name == "--expand-ranges") {
+				set_expand_ranges(true);
+			} else if(name == "--map" || name == "--build-map") {
+				const auto x = value.find('x');
+				ASSERT_LOG(x != std::string::npos, "Expected " << name << "=WxH: " << arg);
+				(name == "--map" ? map_width : build_width) = boost::lexical_cast<int>(value.substr(0, x));
+				(name == "--map" ? map_height : build_height) = boost::lexical_cast<int>(value.substr(x + 1));
+			} else if(name == "--build-reps") {
+				build_reps = boost::lexical_cast<int>(value);
+			} else if(name == "--synthetic" || name == "--synthetic-rules") {
+				for(const auto& str : split(value, ",", SplitFlags::NONE)) {
+					(name == "--synthetic" ? synthetic_sizes : synthetic_rules).emplace_back(str);
+				}
+			} else if(name == "--synthetic-reps") {
+				synthetic_reps = boost::lexical_cast<int>(value);
+			} else if(name == "--synthetic-templates") {
+				synthetic.templates = boost::lexical_cast<int>(value);
+			} else if(name == "--synthetic-depth") {
+				synthetic.macro_depth = boost::lexical_cast<int>(value);
+			} else if(name == "--synthetic-fanout") {
+				synthetic.macro_fanout = boost::lexical_cast<int>(value);
+			} else if(name == "--synthetic-tiles") {
+				synthetic.tiles = boost::lexical_cast<int>(value);
+			} else if(name == "--synthetic-images") {
+				synthetic.images = boost::lexical_cast<int>(value);
+			} else if(name == "--synthetic-attributes") {
+				synthetic.extra_attributes = boost::lexical_cast<int>(value);
+			} else if(name == "--synthetic-multi-line") {
+				synthetic.multi_line = boost::lexical_cast<double>(value);
+			} else if(name == "--synthetic-merges") {
+				synthetic.merges = boost::lexical_cast<double>(value);
+			} else if(name == "--synthetic-seed") {
+				synthetic.seed = boost::lexical_cast<unsigned>(value);
+			} else if(name == "--generate-only") {
+				generate_only = true;
+			} else {
+				ASSERT_LOG(false, "Unrecognised argument: " << arg);
+			}
+		} catch(boost::bad_lexical_cast&) {
+			ASSERT_LOG(false, "Expected a number: " << arg);
+		}
+	}
+	ASSERT_LOG(reps > 0 && warmup >= 0 && scale > 0, "--reps and --scale must be positive and --warmup not negative.");
+	ASSERT_LOG(map_width > 0 && map_height > 0 && build_width > 0 && build_height > 0 && build_reps > 0, "--map, --build-map and --build-reps must be positive.");
+	ASSERT_LOG(synthetic_reps > 0, "--synthetic-reps must be positive.");
+
+	boost::filesystem::create_directories(work_dir);
+	const auto terrain_types = json::parse_lazy_from_file(data_dir + "/terrain.cfg");
+	const auto terrain_graphics = json::parse_lazy_from_file(data_dir + "/terrain-graphics.cfg");
+	const std::vector<bench::corpus> corpora = {
+		bench::make_corpus("terrain", terrain_types->root(), work_dir, 1, false),
+		bench::make_corpus("terrain-graphics", terrain_graphics->root(), work_dir, 1, true),
+		bench::make_corpus("terrain-graphics-x" + boost::lexical_cast<std::string>(scale), terrain_graphics->root(), work_dir, scale, true),
+	};
+	std::vector<bench::corpus> synthetic_corpora;
+	for(const auto& size : synthetic_sizes) {
+		auto opts = synthetic;
+		opts.bytes = bench::parse_size(size);
+		synthetic_corpora.emplace_back(bench::make_synthetic_corpus("synthetic-" + size, opts, work_dir));
+	}
+	for(const auto& rules : synthetic_rules) {
+		auto opts = synthetic;
+		try {
+			opts.rules = boost::lexical_cast<size_t>(rules);
+		} catch(boost::bad_lexical_cast&) {
+			ASSERT_LOG(false, "Expected a number of rules: " << rules);
+		}
+		synthetic_corpora.emplace_back(bench::make_synthetic_corpus("synthetic-" + rules + "-rules", opts, work_dir));
+	}
+	if(generate_only) {
+		for(const auto& c : corpora) {
+			std::cerr << "wrote " << c.macros_file << " and " << c.main_file << std::endl;
+		}
+		for(const auto& c : synthetic_corpora) {
+			std::cerr << "wrote " << c.macros_file << " and " << c.main_file << std::endl;
+		}
+		return 0;
+	}
+
+	std::vector<terrain::terrain_code> codes;
+	for(const auto& code : bench::get_terrain_codes(terrain_types->root())) {
+		codes.emplace_back(terrain::read_terrain_code(code));
+	}
+	std::vector<variant> results;
+	for(const auto& c : corpora) {
+		std::cerr << "benchmarking " << c.name << std::endl;
+		results.emplace_back(run_corpus(c, codes, reps, warmup, threads));
+	}
+	for(const auto& c : synthetic_corpora) {
+		std::cerr << "benchmarking " << c.name << std::endl;
+		results.emplace_back(run_corpus(c, codes, synthetic_reps, 0, threads));
+	}
+	std::cerr << "benchmarking type patterns" << std::endl;
+	const variant matcher = run_matcher(terrain_types->root(), terrain_graphics->root(), map_width, map_height, reps, warmup);
+	std::cerr << "benchmarking builder maps" << std::endl;
+	const variant builder_maps = run_builder_maps(terrain_graphics->root(), reps, warmup);
+	std::cerr << "benchmarking terrain builder" << std::endl;
+	const variant terrain_builder = run_terrain_builder(corpora[1], terrain_types->root(), build_width, build_height, build_reps, threads);
+	variant_builder vb;
+	vb.add("warmup", warmup);
+	vb.add("threads", threads);
+	vb.add("expand_ranges", expand_ranges());
+	if(!synthetic_corpora.empty()) {
+		variant_builder shape;
+		shape.add("templates", synthetic.templates);
+		shape.add("macro_depth", synthetic.macro_depth);
+		shape.add("macro_fanout", synthetic.macro_fanout);
+		shape.add("tiles", synthetic.tiles);
+		shape.add("images", synthetic.images);
+		shape.add("extra_attributes", synthetic.extra_attributes);
+		shape.add("multi_line", synthetic.multi_line);
+		shape.add("merges", synthetic.merges);
+		shape.add("seed", static_cast<int64_t>(synthetic.seed));
+		shape.add("repetitions", synthetic_reps);
+		vb.add("synthetic", shape.build());
+	}
+	vb.add("corpora", variant(&results));
+	vb.add("matcher", matcher);
+	vb.add("builder_maps", builder_maps);
+	vb.add("terrain_builder", terrain_builder);
+	const variant res = vb.build();
+
+	if(output.empty()) {
+		res.write_json(std::cout, true, 4);
+		std::cout << std::endl;
+	} else {
+		sys::file_sink sink(output);
+		res.write_json(sink.stream(), true, 4);
+		sink.commit();
+	}
+	return 0;
+}
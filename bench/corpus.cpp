@@ -0,0 +1,226 @@
+#include <sstream>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+
+#include "corpus.hpp"
+#include "filesystem.hpp"
+#include "formatter.hpp"
+
+namespace bench
+{
+	namespace
+	{
+		// Image modification functions (CROP, MASK, O, ...) are the only upper case keys.
+		bool is_command(const std::string& key)
+		{
+			if(key.empty()) {
+				return false;
+			}
+			for(auto c : key) {
+				if(c < 'A' || c > 'Z') {
+					return false;
+				}
+			}
+			return true;
+		}
+
+		std::string scalar_string(const json::lazy_value& v)
+		{
+			if(v.is_string()) {
+				return v.as_string();
+			} else if(v.is_bool()) {
+				return v.as_bool() ? "yes" : "no";
+			}
+			return v.raw();
+		}
+
+		std::string join(const json::lazy_value& list, const std::string& sep)
+		{
+			std::string res;
+			for(int n = 0; n != list.num_elements(); ++n) {
+				if(n != 0) {
+					res += sep;
+				}
+				res += scalar_string(list[n]);
+			}
+			return res;
+		}
+
+		std::string command_string(const std::string& cmd, const json::lazy_value& v)
+		{
+			std::string res = "~" + cmd + "(";
+			if(v.has_key("param")) {
+				const auto param = v["param"];
+				res += param.is_list() ? join(param, ",") : scalar_string(param);
+			}
+			for(const auto& key : v.keys()) {
+				if(!is_command(key)) {
+					continue;
+				}
+				const auto sub = v[key];
+				if(sub.is_list()) {
+					for(int n = 0; n != sub.num_elements(); ++n) {
+						res += command_string(key, sub[n]);
+					}
+				} else {
+					res += command_string(key, sub);
+				}
+			}
+			return res + ")";
+		}
+
+		// Inverse of process_name_string().
+		std::string image_name(const json::lazy_value& v)
+		{
+			std::string res = v["name"].as_string();
+			const auto frames = v["animation-frames"];
+			if(frames.is_list() && frames.num_elements() != 0) {
+				boost::replace_first(res, "@A", "[" + frames[0].raw() + "~" + frames[frames.num_elements() - 1].raw() + "]");
+			}
+			res += ".png";
+			for(const auto& key : v.keys()) {
+				if(!is_command(key)) {
+					continue;
+				}
+				const auto cmd = v[key];
+				if(cmd.is_list()) {
+					for(int n = 0; n != cmd.num_elements(); ++n) {
+						res += command_string(key, cmd[n]);
+					}
+				} else {
+					res += command_string(key, cmd);
+				}
+			}
+			if(v.has_key("animation_timing")) {
+				res += ":" + v["animation_timing"].raw();
+			}
+			return res;
+		}
+
+		class wml_writer
+		{
+		public:
+			explicit wml_writer(std::ostream& os) : os_(os), type_param_(), type_arg_() {}
+			// The first tile type written is replaced by {param}, type_arg() returns the
+			// value it stands for.
+			void set_type_param(const std::string& param) { type_param_ = param; type_arg_.clear(); }
+			const std::string& type_arg() const { return type_arg_; }
+
+			void write_tag(const std::string& name, const json::lazy_value& v, int depth)
+			{
+				const std::string indent(depth, '\t');
+				os_ << indent << "[" << name << "]\n";
+				const bool is_image = (name == "image" || name == "variant") && v["name"].is_string();
+				std::vector<std::string> children;
+				for(const auto& key : v.keys()) {
+					const auto value = v[key];
+					if(is_image && (key == "name" || key == "animation-frames" || key == "animation_timing" || is_command(key))) {
+						if(key == "name") {
+							os_ << indent << "\t" << key << "=" << image_name(v) << "\n";
+						}
+						continue;
+					}
+					if((key == "x" || key == "y") && value.is_numeric() && v["x"].is_numeric() && v["y"].is_numeric()) {
+						// the converter splits x,y into two keys.
+						if(key == "x") {
+							os_ << indent << "\tx,y=" << value.raw() << "," << v["y"].raw() << "\n";
+						}
+						continue;
+					}
+					if(key == "type_match" || key == "map_grid") {
+						// compiled from type and map by the converter.
+						continue;
+					}
+					if(value.is_map() || (value.is_list() && value.num_elements() != 0 && value[0].is_map())) {
+						children.emplace_back(key);
+						continue;
+					}
+					std::string str;
+					if(value.is_list()) {
+						if(value.num_elements() == 0) {
+							continue;
+						}
+						if(key == "map") {
+							str = "\"" + join(value, "\n") + "\"";
+						} else if(key == "variations") {
+							str = join(value, ";");
+						} else {
+							str = join(value, ",");
+						}
+						if(key == "type" && name == "tile" && !type_param_.empty() && type_arg_.empty() && str.find_first_of(" \t") == std::string::npos) {
+							type_arg_ = str;
+							str = "{" + type_param_ + "}";
+						}
+					} else {
+						str = scalar_string(value);
+						if(value.is_string()) {
+							if(str.size() >= 2 && str.front() == '~' && str.back() == '~') {
+								str = "_ \"" + str.substr(1, str.size() - 2) + "\"";
+							} else if(str.find('\n') != std::string::npos) {
+								str = "\"" + str + "\"";
+							}
+						}
+					}
+					os_ << indent << "\t" << key << "=" << str << "\n";
+				}
+				for(const auto& key : children) {
+					const auto child = v[key];
+					if(child.is_map()) {
+						write_tag(key, child, depth + 1);
+					} else {
+						for(int n = 0; n != child.num_elements(); ++n) {
+							write_tag(key, child[n], depth + 1);
+						}
+					}
+				}
+				os_ << indent << "[/" << name << "]\n";
+			}
+		private:
+			std::ostream& os_;
+			std::string type_param_;
+			std::string type_arg_;
+		};
+	}
+
+	corpus make_corpus(const std::string& name, const json::lazy_value& root, const std::string& dir, int copies, bool use_macros)
+	{
+		corpus res;
+		res.name = name;
+		res.macros_file = dir + "/" + name + "-macros.cfg";
+		res.main_file = dir + "/" + name + ".cfg";
+
+		std::ostringstream macros;
+		std::ostringstream main;
+		wml_writer main_writer(main);
+		for(int copy = 0; copy != copies; ++copy) {
+			for(const auto& key : root.keys()) {
+				const auto tags = root[key];
+				const int count = tags.is_list() ? tags.num_elements() : 1;
+				for(int n = 0; n != count; ++n) {
+					const auto tag = tags.is_list() ? tags[n] : tags;
+					if(!use_macros) {
+						main_writer.write_tag(key, tag, 0);
+						continue;
+					}
+					const std::string macro = formatter() << "BENCH_" << boost::to_upper_copy(key) << "_" << copy << "_" << n;
+					std::ostringstream body;
+					wml_writer writer(body);
+					writer.set_type_param("TYPE");
+					writer.write_tag(key, tag, 0);
+					const std::string& arg = writer.type_arg();
+					macros << "#define " << macro << (arg.empty() ? "" : " TYPE") << "\n" << body.str() << "#enddef\n\n";
+					main << "{" << macro << (arg.empty() ? "" : " " + arg) << "}\n";
+				}
+			}
+		}
+		// through file_sink rather than sys::write_file(), which won't take an absolute --work.
+		sys::file_sink macros_sink(res.macros_file);
+		macros_sink.write(macros.str());
+		macros_sink.commit();
+		sys::file_sink main_sink(res.main_file);
+		main_sink.write(main.str());
+		main_sink.commit();
+		return res;
+	}
+}
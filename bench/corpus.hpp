@@ -0,0 +1,25 @@
+#pragma once
+
+#include <string>
+
+#include "json_lazy.hpp"
+
+namespace bench
+{
+	// WML input for the benchmark: one file holding macro definitions and one which
+	// expands them, as terrain-graphics/ and terrain-graphics.cfg are laid out.
+	struct corpus
+	{
+		corpus() : name(), macros_file(), main_file() {}
+		std::string name;
+		std::string macros_file;
+		std::string main_file;
+	};
+
+	// Turns converted JSON (the terrain.cfg/terrain-graphics.cfg we ship in vs2013/) back
+	// into WML and writes it to dir. The image name decoding is reversed, so the result
+	// goes through the same conversions as the source data. Every top-level tag is
+	// written copies times; with use_macros each one becomes a macro, taking the type of
+	// its first tile as an argument, and the main file is just the macro calls.
+	corpus make_corpus(const std::string& name, const json::lazy_value& root, const std::string& dir, int copies, bool use_macros);
+}
@@ -0,0 +1,271 @@
+#include <algorithm>
+#include <cctype>
+#include <random>
+#include <sstream>
+#include <vector>
+
+#include <boost/lexical_cast.hpp>
+
+#include "asserts.hpp"
+#include "filesystem.hpp"
+#include "formatter.hpp"
+#include "synthetic.hpp"
+
+namespace bench
+{
+	namespace
+	{
+		const char* const terrain_types[] = { "Gg", "Gs", "Gd", "Ww", "Wo", "Wwf", "Md", "Hh", "Ss", "Re", "Rr", "Ch", "Uu", "Xu", "Aa", "Dd" };
+		const char* const overlays[] = { "^Fp", "^Fds", "^Vh", "^Uf", "^Bw|" };
+		const char* const flags[] = { "base", "transition", "overlay", "village", "forest", "embellishment" };
+		const char* const images[] = { "grass/green", "water/ocean", "mountains/basic", "hills/regular", "forest/pine", "village/human", "cave/floor", "sand/desert" };
+
+		template<typename T, size_t N>
+		int count_of(const T (&)[N])
+		{
+			return static_cast<int>(N);
+		}
+
+		// mt19937 is fully specified, unlike the standard distributions, so the corpus is the
+		// same everywhere for a seed.
+		class rule_generator
+		{
+		public:
+			explicit rule_generator(const synthetic_options& opts) : opts_(opts), rng_(opts.seed) {}
+
+			int below(int n) { return static_cast<int>(rng_() % static_cast<unsigned>(n)); }
+			bool chance(double p) { return rng_() < p * 4294967296.0; }
+
+			std::string type()
+			{
+				const std::string base = terrain_types[below(count_of(terrain_types))];
+				switch(below(5)) {
+				case 0:		return base + overlays[below(count_of(overlays))];
+				case 1:		return std::string("*") + overlays[below(count_of(overlays))];
+				case 2:		return "!," + base + "," + terrain_types[below(count_of(terrain_types))];
+				default:	return base;
+				}
+			}
+
+			// a type which can be passed as a macro argument.
+			std::string type_arg()
+			{
+				const std::string base = terrain_types[below(count_of(terrain_types))];
+				return below(3) == 0 ? base + overlays[below(count_of(overlays))] : base;
+			}
+
+			int layer() { return (below(21) - 10) * 100; }
+
+			std::string flag(bool rotated)
+			{
+				std::string res = flags[below(count_of(flags))];
+				return rotated ? res + "-@R" + boost::lexical_cast<std::string>(below(6)) : res;
+			}
+
+			std::string image_name(bool rotated, bool variations)
+			{
+				std::ostringstream ss;
+				ss << images[below(count_of(images))];
+				const bool animated = below(4) == 0;
+				if(rotated) {
+					ss << "-@R0";
+				}
+				if(variations) {
+					ss << "@V";
+				}
+				if(animated) {
+					ss << "-A[1~" << 2 + below(15) << "]";
+				}
+				ss << ".png";
+				if(below(3) == 0) {
+					ss << "~CROP(" << below(4) * 36 << "," << below(4) * 36 << ",72,72)";
+				}
+				if(rotated && below(2) == 0) {
+					ss << "~MASK(masks/edge-@R0.png)~O(0.5)";
+				}
+				if(animated) {
+					ss << ":" << 50 + below(10) * 10;
+				}
+				return ss.str();
+			}
+
+			void write_extra_attributes(std::ostream& os, const std::string& indent)
+			{
+				for(int n = 0; n != opts_.extra_attributes; ++n) {
+					os << indent << "synthetic_" << n << "=";
+					switch(below(4)) {
+					case 0:		os << below(100000); break;
+					case 1:		os << "value " << below(1000) << ", with spaces"; break;
+					case 2:		os << "\"quoted " << below(1000) << "\""; break;
+					default:	os << flags[below(count_of(flags))] << "," << flags[below(count_of(flags))]; break;
+					}
+					os << "\n";
+				}
+			}
+
+			void write_image(std::ostream& os, const std::string& indent, bool rotated)
+			{
+				const bool variations = below(3) == 0;
+				os << indent << "[image]\n";
+				os << indent << "\tlayer={LAYER}\n";
+				os << indent << "\tname=" << image_name(rotated, variations) << "\n";
+				if(variations) {
+					os << indent << "\tvariations=;2;3;4\n";
+				}
+				os << indent << "\t" << (below(2) == 0 ? "base" : "center") << "=" << 54 + below(4) * 9 << "," << 72 + below(4) * 18 << "\n";
+				write_extra_attributes(os, indent + "\t");
+				os << indent << "[/image]\n";
+			}
+
+			// One [terrain_graphics] tag, plus perhaps a merge into it, as the body of a
+			// macro taking TYPE and LAYER.
+			std::string rule(int index)
+			{
+				std::ostringstream os;
+				const bool rotated = below(4) == 0;
+				const bool multi_line = chance(opts_.multi_line);
+				const int ntiles = 1 + below(opts_.tiles);
+				os << "[terrain_graphics]\n";
+				if(multi_line) {
+					// tiles by position in a map, alternating even and odd lines.
+					os << "\tmap=\"";
+					for(int t = 0; t != ntiles; ++t) {
+						const int line = t / 2;
+						if(t % 2 == 0) {
+							os << (line != 0 ? "\n" : "") << (line % 2 == 1 ? ", " : "");
+						} else {
+							os << " , ";
+						}
+						os << t + 1;
+					}
+					os << "\"\n";
+					os << "\tdescription=_ \"Synthetic rule " << index << "\nspread over two lines\"\n";
+				}
+				if(below(2) == 0) {
+					os << "\tprobability=" << 10 + below(10) * 10 << "\n";
+				}
+				if(rotated) {
+					os << "\trotations=n,ne,se,s,sw,nw\n";
+				}
+				write_extra_attributes(os, "\t");
+				for(int t = 0; t != ntiles; ++t) {
+					os << "\t[tile]\n";
+					if(multi_line) {
+						os << "\t\tpos=" << t + 1 << "\n";
+					} else {
+						os << "\t\tx,y=" << t % 2 << "," << t / 2 << "\n";
+					}
+					os << "\t\ttype=" << (t == 0 ? "{TYPE}" : type()) << "\n";
+					os << "\t\t" << (t == 0 ? "set_no_flag" : "has_flag") << "=" << flag(rotated) << "\n";
+					write_extra_attributes(os, "\t\t");
+					if(below(3) == 0) {
+						write_image(os, "\t\t", rotated);
+					}
+					os << "\t[/tile]\n";
+					if(chance(opts_.merges)) {
+						os << "\t[+tile]\n\t\tno_flag=" << flag(rotated) << "\n\t[/tile]\n";
+					}
+				}
+				const int nimages = below(opts_.images + 1);
+				for(int n = 0; n != nimages; ++n) {
+					write_image(os, "\t", rotated);
+				}
+				os << "[/terrain_graphics]\n";
+				if(chance(opts_.merges)) {
+					os << "[+terrain_graphics]\n\tsynthetic_merged=" << index << "\n[/terrain_graphics]\n";
+				}
+				return os.str();
+			}
+		private:
+			const synthetic_options& opts_;
+			std::mt19937 rng_;
+		};
+
+		std::string rule_macro(int n)
+		{
+			return formatter() << "SYNTHETIC_RULE_" << n;
+		}
+
+		std::string level_macro(int level, int n)
+		{
+			if(level == 0) {
+				return rule_macro(n);
+			}
+			return formatter() << "SYNTHETIC_L" << level << "_" << n;
+		}
+	}
+
+	corpus make_synthetic_corpus(const std::string& name, const synthetic_options& opts, const std::string& dir)
+	{
+		ASSERT_LOG(opts.templates > 0 && opts.macro_depth >= 0 && opts.macro_fanout > 0 && opts.tiles > 0 && opts.images >= 0 && opts.extra_attributes >= 0,
+			"Synthetic corpus " << name << " needs at least one template, tile and macro call.");
+		corpus res;
+		res.name = name;
+		res.macros_file = dir + "/" + name + "-macros.cfg";
+		res.main_file = dir + "/" + name + ".cfg";
+
+		rule_generator gen(opts);
+		std::vector<std::string> bodies;
+		size_t template_bytes = 0;
+		for(int n = 0; n != opts.templates; ++n) {
+			bodies.emplace_back(gen.rule(n));
+			template_bytes += bodies.back().size();
+		}
+		const size_t rules = opts.rules != 0 ? opts.rules : std::max<size_t>(1, opts.bytes / std::max<size_t>(1, template_bytes / opts.templates));
+		// no more macros than rules, so small corpora stay small.
+		const int templates = static_cast<int>(std::min<size_t>(opts.templates, rules));
+
+		std::ostringstream macros;
+		for(int n = 0; n != templates; ++n) {
+			macros << "#define " << rule_macro(n) << " TYPE LAYER\n" << bodies[n] << "#enddef\n\n";
+		}
+		for(int level = 1; level <= opts.macro_depth; ++level) {
+			for(int n = 0; n != templates; ++n) {
+				macros << "#define " << level_macro(level, n) << " TYPE LAYER\n";
+				for(int call = 0; call != opts.macro_fanout; ++call) {
+					macros << "{" << level_macro(level - 1, (n * opts.macro_fanout + call) % templates) << " {TYPE} {LAYER}}\n";
+				}
+				macros << "#enddef\n\n";
+			}
+		}
+		sys::file_sink macros_sink(res.macros_file);
+		macros_sink.write(macros.str());
+		macros_sink.commit();
+
+		size_t per_call = 1;
+		for(int level = 0; level != opts.macro_depth; ++level) {
+			per_call *= opts.macro_fanout;
+		}
+		sys::file_sink sink(res.main_file);
+		auto& os = sink.stream();
+		os << "# " << rules << " synthetic rules\n";
+		for(size_t n = 0; n != rules / per_call; ++n) {
+			os << "{" << level_macro(opts.macro_depth, gen.below(templates)) << " " << gen.type_arg() << " " << gen.layer() << "}\n";
+		}
+		// the rest call the rules directly.
+		for(size_t n = 0; n != rules % per_call; ++n) {
+			os << "{" << rule_macro(gen.below(templates)) << " " << gen.type_arg() << " " << gen.layer() << "}\n";
+		}
+		sink.commit();
+		return res;
+	}
+
+	size_t parse_size(const std::string& s)
+	{
+		ASSERT_LOG(!s.empty(), "Expected a size.");
+		size_t scale = 1;
+		switch(std::tolower(static_cast<unsigned char>(s.back()))) {
+		case 'k':	scale = size_t(1) << 10; break;
+		case 'm':	scale = size_t(1) << 20; break;
+		case 'g':	scale = size_t(1) << 30; break;
+		default:	break;
+		}
+		const std::string digits = scale == 1 ? s : s.substr(0, s.size() - 1);
+		try {
+			return boost::lexical_cast<size_t>(digits) * scale;
+		} catch(boost::bad_lexical_cast&) {
+			ASSERT_LOG(false, "Expected a size like 64k, 16m or 2g: " << s);
+		}
+		return 0;
+	}
+}
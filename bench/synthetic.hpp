@@ -0,0 +1,44 @@
+#pragma once
+
+#include <string>
+
+#include "corpus.hpp"
+
+namespace bench
+{
+	// The shape of a synthetic terrain-graphics corpus.
+	struct synthetic_options
+	{
+		synthetic_options() : bytes(1 << 20), rules(0), templates(256), macro_depth(2), macro_fanout(4), tiles(3), images(2), extra_attributes(2), multi_line(0.2), merges(0.2), seed(1) {}
+		// roughly how much WML the macros expand to, used when rules is 0.
+		size_t bytes;
+		// [terrain_graphics] tags in the expanded WML.
+		size_t rules;
+		// distinct rules, each a macro taking the type of its first tile and a layer.
+		int templates;
+		// levels of macros above the rules, each calling macro_fanout macros of the level
+		// below, so a call at the top expands to macro_fanout^macro_depth rules. With 0
+		// the main file calls the rule macros directly.
+		int macro_depth;
+		int macro_fanout;
+		// most [tile]s and [image]s in a rule.
+		int tiles;
+		int images;
+		// attributes per tag that aren't in the attribute schema, copied as strings.
+		int extra_attributes;
+		// fraction of rules with a map and a translatable string that span several lines.
+		double multi_line;
+		// fraction of rules and tiles followed by a [+tag] merging more attributes in.
+		double merges;
+		unsigned seed;
+	};
+
+	// Writes a corpus laid out like make_corpus() does, with rules generated from opts
+	// rather than read from the shipped data, so the input can range from a few rules to
+	// gigabytes. The main file is written as it's generated. The same options always give
+	// the same files.
+	corpus make_synthetic_corpus(const std::string& name, const synthetic_options& opts, const std::string& dir);
+
+	// "64k", "16m", "2g" or a plain number of bytes.
+	size_t parse_size(const std::string& s);
+}
@@ -0,0 +1,140 @@
+#include <algorithm>
+#include <random>
+#include <set>
+#include <sstream>
+
+#include "terrain_match.hpp"
+
+namespace bench
+{
+	namespace
+	{
+		// Matches one layer, a '*' matches the rest of it.
+		bool match_layer(const std::string& pattern, size_t pbegin, size_t pend, const std::string& code, size_t cbegin, size_t cend)
+		{
+			for(; pbegin != pend; ++pbegin, ++cbegin) {
+				if(pattern[pbegin] == '*') {
+					return true;
+				}
+				if(cbegin == cend || pattern[pbegin] != code[cbegin]) {
+					return false;
+				}
+			}
+			return cbegin == cend;
+		}
+
+		bool match_item(const std::string& pattern, const std::string& code)
+		{
+			if(pattern == "*") {
+				return true;
+			}
+			const auto pcaret = pattern.find('^');
+			const auto ccaret = code.find('^');
+			const size_t pbase = pcaret != std::string::npos ? pcaret : pattern.size();
+			const size_t cbase = ccaret != std::string::npos ? ccaret : code.size();
+			if(!match_layer(pattern, 0, pbase, code, 0, cbase)) {
+				return false;
+			}
+			if(pcaret == std::string::npos) {
+				return ccaret == std::string::npos;
+			}
+			if(ccaret == std::string::npos) {
+				// only a bare '*' overlay matches a code without one.
+				return pattern.size() == pcaret + 2 && pattern[pcaret + 1] == '*';
+			}
+			return match_layer(pattern, pcaret + 1, pattern.size(), code, ccaret + 1, code.size());
+		}
+	}
+
+	std::vector<std::string> get_terrain_codes(const json::lazy_value& terrain_types)
+	{
+		std::vector<std::string> res;
+		const auto types = terrain_types["terrain_type"];
+		for(int n = 0; n != types.num_elements(); ++n) {
+			res.emplace_back(types[n]["string"].as_string());
+		}
+		return res;
+	}
+
+	std::vector<std::vector<std::string>> get_tile_types(const json::lazy_value& terrain_graphics)
+	{
+		std::set<std::vector<std::string>> res;
+		const auto rules = terrain_graphics["terrain_graphics"];
+		for(int n = 0; n != rules.num_elements(); ++n) {
+			const auto tiles = rules[n]["tile"];
+			const int count = tiles.is_list() ? tiles.num_elements() : (tiles.is_map() ? 1 : 0);
+			for(int m = 0; m != count; ++m) {
+				const auto type = (tiles.is_list() ? tiles[m] : tiles)["type"];
+				if(!type.is_list()) {
+					continue;
+				}
+				std::vector<std::string> types;
+				for(int t = 0; t != type.num_elements(); ++t) {
+					types.emplace_back(type[t].as_string());
+				}
+				res.insert(types);
+			}
+		}
+		return std::vector<std::vector<std::string>>(res.begin(), res.end());
+	}
+
+	std::vector<std::string> make_synthetic_map(const std::vector<std::string>& codes, int width, int height, unsigned seed)
+	{
+		std::mt19937 gen(seed);
+		std::uniform_int_distribution<size_t> pick(0, codes.size() - 1);
+		std::vector<std::string> res;
+		res.reserve(static_cast<size_t>(width) * height);
+		for(int n = 0; n != width * height; ++n) {
+			res.emplace_back(codes[pick(gen)]);
+		}
+		return res;
+	}
+
+	std::string make_synthetic_map_file(const std::vector<std::string>& codes, int width, int height, unsigned seed)
+	{
+		const int region_size = 12;
+		std::vector<std::string> bases, overlays;
+		for(const auto& code : codes) {
+			if(code.find('^') == std::string::npos) {
+				bases.emplace_back(code);
+			} else if(code[0] == '^') {
+				overlays.emplace_back(code);
+			}
+		}
+		std::mt19937 gen(seed);
+		std::uniform_int_distribution<size_t> pick_base(0, bases.size() - 1);
+		std::uniform_int_distribution<size_t> pick_overlay(0, overlays.empty() ? 0 : overlays.size() - 1);
+		std::uniform_int_distribution<int> percent(0, 99);
+		const int rx = (width + region_size - 1) / region_size;
+		const int ry = (height + region_size - 1) / region_size;
+		std::vector<size_t> regions(rx * ry);
+		for(auto& r : regions) {
+			r = pick_base(gen);
+		}
+		std::ostringstream ss;
+		for(int y = 0; y != height; ++y) {
+			for(int x = 0; x != width; ++x) {
+				const int roll = percent(gen);
+				ss << (x != 0 ? ", " : "") << bases[roll < 10 ? pick_base(gen) : regions[(y / region_size) * rx + x / region_size]];
+				if(!overlays.empty() && roll >= 92) {
+					ss << overlays[pick_overlay(gen)];
+				}
+			}
+			ss << "\n";
+		}
+		return ss.str();
+	}
+
+	bool match_type_string(const std::vector<std::string>& types, const std::string& code)
+	{
+		bool result = true;
+		for(const auto& type : types) {
+			if(type == "!") {
+				result = !result;
+			} else if(match_item(type, code)) {
+				return result;
+			}
+		}
+		return !result;
+	}
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "json_lazy.hpp"
+
+namespace bench
+{
+	// The string of every [terrain_type] in terrain.cfg.
+	std::vector<std::string> get_terrain_codes(const json::lazy_value& terrain_types);
+	// Every distinct type list of a [tile] in terrain-graphics.cfg.
+	std::vector<std::vector<std::string>> get_tile_types(const json::lazy_value& terrain_graphics);
+
+	// A width x height map, row by row, with each hex a code picked at random from codes.
+	// The same seed gives the same map.
+	std::vector<std::string> make_synthetic_map(const std::vector<std::string>& codes, int width, int height, unsigned seed);
+	// A width x height .map made of square regions of one base terrain, with some hexes
+	// of other terrain scattered about and some overlays, from codes.
+	std::string make_synthetic_map_file(const std::vector<std::string>& codes, int width, int height, unsigned seed);
+
+	// Matches code against a type list by reading the wildcard, negation and layer syntax
+	// as it goes, the way consumers had to before the converter compiled the patterns.
+	// Used as the baseline for terrain::type_pattern.
+	bool match_type_string(const std::vector<std::string>& types, const std::string& code);
+}
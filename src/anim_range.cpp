@@ -0,0 +1,89 @@
+#include <atomic>
+#include <iomanip>
+#include <sstream>
+
+#include <boost/lexical_cast.hpp>
+
+#include "anim_range.hpp"
+#include "asserts.hpp"
+#include "image_path.hpp"
+#include "terrain_parser.hpp"
+#include "unit_test.hpp"
+
+namespace
+{
+	std::atomic<bool> expand_ranges_flag(false);
+}
+
+anim_range::anim_range(const std::string& b, const std::string& range)
+	: base(b),
+	  start(0),
+	  end(0),
+	  pad(0)
+{
+	auto strs = split(range, "~", SplitFlags::NONE);
+	ASSERT_LOG(strs.size() == 2, "animation range malformed: " << range);
+	try {
+		start = boost::lexical_cast<int>(strs[0]);
+		end = boost::lexical_cast<int>(strs[1]);
+	} catch(boost::bad_lexical_cast&) {
+		ASSERT_LOG(false, "Unable to parse string into integers: " << range);
+	}
+	if(strs[0].size() > 1 && strs[0][0] == '0') {
+		pad = static_cast<int>(strs[0].size());
+	}
+}
+
+std::string anim_range::frame(int n) const
+{
+	std::ostringstream ss;
+	ss << base << std::setw(pad) << std::setfill('0') << number(n);
+	return ss.str();
+}
+
+variant range_to_variant(const anim_range& r)
+{
+	std::map<variant, variant> res;
+	if(!r.base.empty()) {
+		res[variant("base")] = variant(r.base);
+	}
+	res[variant("start")] = variant(r.start);
+	res[variant("end")] = variant(r.end);
+	res[variant("pad")] = variant(r.pad);
+	return variant(&res);
+}
+
+bool expand_ranges()
+{
+	return expand_ranges_flag.load(std::memory_order_relaxed);
+}
+
+void set_expand_ranges(bool expand)
+{
+	if(expand_ranges_flag.exchange(expand) != expand) {
+		// cached names were decoded with the other setting.
+		ipf::clear_name_cache();
+	}
+}
+
+UNIT_TEST(anim_range_round_trip)
+{
+	for(const char* text : { "01~17", "1~17", "10~3", "007~009" }) {
+		const anim_range r("water", text);
+		const variant v = range_to_variant(r);
+		CHECK_EQ(v["base"].as_string(), "water");
+		// written back as WML the range is the text it was read from.
+		std::ostringstream ss;
+		ss << std::setw(v["pad"].as_int32()) << std::setfill('0') << v["start"].as_int32()
+			<< "~" << std::setw(v["pad"].as_int32()) << std::setfill('0') << v["end"].as_int32();
+		CHECK_EQ(ss.str(), text);
+	}
+	const anim_range r("water", "01~03");
+	CHECK_EQ(r.size(), 3);
+	CHECK_EQ(r.frame(0), "water01");
+	CHECK_EQ(r.frame(2), "water03");
+	const anim_range down("", "10~8");
+	CHECK_EQ(down.size(), 3);
+	CHECK_EQ(down.frame(2), "8");
+	CHECK(range_to_variant(down)["base"].is_null(), "an empty base is left out");
+}
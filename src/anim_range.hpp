@@ -0,0 +1,36 @@
+#pragma once
+
+#include <string>
+
+#include "variant.hpp"
+
+// A range of animation frames as written in WML, i.e. "water[01~17]". The frames are
+// start to end inclusive (end may be less than start, counting down), each number is
+// zero-padded to pad digits and appended to base.
+struct anim_range
+{
+	anim_range() : base(), start(0), end(0), pad(0) {}
+	// range is the text between the brackets. pad is taken from the first number, so
+	// "01~17" pads to 2 digits and "1~17" isn't padded.
+	anim_range(const std::string& base, const std::string& range);
+
+	int size() const { return (end >= start ? end - start : start - end) + 1; }
+	int number(int n) const { return end >= start ? start + n : start - n; }
+	// base followed by the padded frame number.
+	std::string frame(int n) const;
+
+	std::string base;
+	int start;
+	int end;
+	int pad;
+};
+
+// The compact form written to the JSON, {"base": "water", "start": 1, "end": 17, "pad": 2}.
+// base is left out when empty.
+variant range_to_variant(const anim_range& r);
+
+// Ranges are written in the compact form unless expansion is turned on, then they're
+// written as a list with every frame. Set this before converting anything, it clears the
+// image name cache.
+bool expand_ranges();
+void set_expand_ranges(bool expand);
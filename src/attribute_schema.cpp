@@ -0,0 +1,115 @@
+#include <cstdint>
+#include <vector>
+
+#include "asserts.hpp"
+#include "attribute_schema.hpp"
+#include "terrain_parser.hpp"
+#include "unit_test.hpp"
+#include "variant.hpp"
+
+const attribute_rule attribute_schema[] = {
+	{ "center", attribute_kind::int_list, nullptr },
+	{ "base", attribute_kind::int_list, nullptr },
+	{ "layer", attribute_kind::integer, nullptr },
+	{ "pos", attribute_kind::integer, nullptr },
+	{ "rotations", attribute_kind::string_list, nullptr },
+	{ "set_no_flag", attribute_kind::flag_list, nullptr },
+	{ "set_flag", attribute_kind::flag_list, nullptr },
+	{ "no_flag", attribute_kind::flag_list, nullptr },
+	{ "has_flag", attribute_kind::flag_list, nullptr },
+	{ "variations", attribute_kind::variations, nullptr },
+	{ "x,y", attribute_kind::point, nullptr },
+	{ "x", attribute_kind::integer, nullptr },
+	{ "y", attribute_kind::integer, nullptr },
+	{ "mod_x", attribute_kind::integer, nullptr },
+	{ "mod_y", attribute_kind::integer, nullptr },
+	{ "probability", attribute_kind::integer, "100" },
+	{ "map", attribute_kind::map_grid, nullptr },
+	{ "type", attribute_kind::terrain_types, nullptr },
+	{ "name", attribute_kind::image_name, nullptr },
+};
+
+const size_t attribute_schema_size = sizeof(attribute_schema) / sizeof(attribute_schema[0]);
+
+namespace
+{
+	const uint32_t max_seed = 1 << 16;
+
+	uint32_t hash_name(const char* s, size_t len, uint32_t seed)
+	{
+		// FNV-1a
+		uint32_t h = 2166136261u ^ seed;
+		for(size_t n = 0; n != len; ++n) {
+			h = (h ^ static_cast<uint8_t>(s[n])) * 16777619u;
+		}
+		return h ^ (h >> 15);
+	}
+
+	// Slots hold the index of a schema entry, or -1. The seed is the first that puts
+	// every name in a slot of its own.
+	struct schema_hash
+	{
+		schema_hash() : seed(0), mask(0), slots()
+		{
+			size_t nslots = 1;
+			while(nslots < attribute_schema_size * 2) {
+				nslots *= 2;
+			}
+			mask = static_cast<uint32_t>(nslots - 1);
+			for(; seed != max_seed; ++seed) {
+				slots.assign(nslots, -1);
+				size_t n = 0;
+				for(; n != attribute_schema_size; ++n) {
+					const std::string name = attribute_schema[n].name;
+					int& slot = slots[hash_name(name.data(), name.size(), seed) & mask];
+					if(slot != -1) {
+						break;
+					}
+					slot = static_cast<int>(n);
+				}
+				if(n == attribute_schema_size) {
+					return;
+				}
+			}
+			ASSERT_LOG(false, "Couldn't build a perfect hash of the attribute schema.");
+		}
+		uint32_t seed;
+		uint32_t mask;
+		std::vector<int> slots;
+	};
+}
+
+const attribute_rule* find_attribute_rule(const std::string& name)
+{
+	static const schema_hash hash;
+	const int n = hash.slots[hash_name(name.data(), name.size(), hash.seed) & hash.mask];
+	return n != -1 && name == attribute_schema[n].name ? &attribute_schema[n] : nullptr;
+}
+
+attribute_kind get_attribute_kind(const std::string& name)
+{
+	const attribute_rule* rule = find_attribute_rule(name);
+	return rule != nullptr ? rule->kind : attribute_kind::string;
+}
+
+UNIT_TEST(attribute_schema_lookup)
+{
+	for(size_t n = 0; n != attribute_schema_size; ++n) {
+		const std::string name = attribute_schema[n].name;
+		CHECK(find_attribute_rule(name) == &attribute_schema[n], name << " doesn't find its own entry");
+		CHECK(get_attribute_kind(name) == attribute_schema[n].kind, name);
+		// near misses aren't in the schema.
+		for(const std::string& other : { name + "_", name.substr(1), "_" + name }) {
+			CHECK(find_attribute_rule(other) == nullptr, other << " shouldn't be found");
+		}
+	}
+	for(const char* name : { "", "description", "X", "Name", "probability ", "map_grid", "type_match" }) {
+		CHECK(find_attribute_rule(name) == nullptr && get_attribute_kind(name) == attribute_kind::string, "'" << name << "' shouldn't be found");
+	}
+	CHECK(std::string(find_attribute_rule("probability")->default_value) == "100", "");
+
+	// separate x= and y= are numbers, as from x,y=.
+	const variant tile = convert_node(read_wml2("[tile]\nx=0\ny=2\n[/tile]\n[image]\nx,y=3,4\n[/image]\n")->root());
+	CHECK(tile["tile"]["x"] == variant(0) && tile["tile"]["y"] == variant(2), tile.write_json(false));
+	CHECK(tile["image"]["x"] == variant(3) && tile["image"]["y"] == variant(4), tile.write_json(false));
+}
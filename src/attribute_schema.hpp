@@ -0,0 +1,45 @@
+#pragma once
+
+#include <string>
+
+// How convert_attributes() turns the value of each WML attribute into JSON. Attributes
+// not in the schema are copied as strings.
+enum class attribute_kind
+{
+	string,
+	// "3" -> 3
+	integer,
+	// "10,20" -> [10, 20]
+	int_list,
+	// "a,b" -> ["a", "b"]
+	string_list,
+	// as string_list, with animation ranges expanded or compacted. Left out when empty.
+	flag_list,
+	// ';' separated, empty entries kept. Left out when there's just one empty entry.
+	variations,
+	// "x,y" -> separate x and y integers.
+	point,
+	// the map lines as a list, plus the grid read from them as map_grid.
+	map_grid,
+	// string_list, plus the compiled pattern as type_match for a [tile].
+	terrain_types,
+	// an image path decoded into one key per part.
+	image_name,
+};
+
+struct attribute_rule
+{
+	const char* name;
+	attribute_kind kind;
+	// what WML takes the attribute to be when it's left out, if not 0 or empty.
+	const char* default_value;
+};
+
+// The schema: every attribute with a conversion of its own.
+extern const attribute_rule attribute_schema[];
+extern const size_t attribute_schema_size;
+
+// The schema entry for the attribute called name, or nullptr, found through a perfect hash
+// of the schema names built on first use, so it's one hash and one compare.
+const attribute_rule* find_attribute_rule(const std::string& name);
+attribute_kind get_attribute_kind(const std::string& name);
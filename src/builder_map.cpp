@@ -0,0 +1,148 @@
+#include <algorithm>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include "asserts.hpp"
+#include "builder_map.hpp"
+#include "unit_test.hpp"
+
+namespace terrain
+{
+	namespace
+	{
+		struct map_cell
+		{
+			int x;
+			int y;
+			int value;
+		};
+	}
+
+	builder_map read_builder_map(const std::string& s)
+	{
+		std::vector<std::vector<std::string>> lines;
+		std::vector<std::string> strs;
+		boost::split(strs, s, boost::is_any_of("\r\n"));
+		for(const auto& str : strs) {
+			// blank lines are skipped, like the newlines around the map.
+			if(boost::trim_copy(str).empty()) {
+				continue;
+			}
+			std::vector<std::string> cells;
+			boost::split(cells, str, boost::is_any_of(","));
+			for(auto& cell : cells) {
+				boost::trim(cell);
+			}
+			lines.emplace_back(cells);
+		}
+
+		builder_map res;
+		if(lines.empty()) {
+			return res;
+		}
+		std::vector<map_cell> found;
+		const int first_line = lines[0][0].empty() ? 1 : 0;
+		for(int n = 0; n != static_cast<int>(lines.size()); ++n) {
+			const int lineno = n + first_line;
+			const bool odd = lineno % 2 == 1;
+			const int y = lineno / 2;
+			const auto& cells = lines[n];
+			for(int col = odd ? 1 : 0; col < static_cast<int>(cells.size()); ++col) {
+				const std::string& cell = cells[col];
+				const int x = odd ? col * 2 - 1 : col * 2;
+				if(cell.empty() || cell == ".") {
+					continue;
+				}
+				map_cell mc = { x, y, map_cell_any };
+				if(cell != "*") {
+					try {
+						mc.value = boost::lexical_cast<int>(cell);
+					} catch(boost::bad_lexical_cast&) {
+						ASSERT_LOG(false, "Invalid cell '" << cell << "' in terrain graphics map: " << s);
+					}
+					ASSERT_LOG(mc.value > 0, "Invalid pos " << mc.value << " in terrain graphics map: " << s);
+				}
+				found.emplace_back(mc);
+				res.width = std::max(res.width, x + 1);
+				res.height = std::max(res.height, y + 1);
+			}
+		}
+
+		res.cells.assign(res.width * res.height, map_cell_none);
+		for(const auto& mc : found) {
+			res.cells[res.offset(mc.x, mc.y)] = mc.value;
+			if(mc.value != map_cell_any) {
+				res.pos.emplace_back(mc.value, res.offset(mc.x, mc.y));
+			}
+		}
+		std::sort(res.pos.begin(), res.pos.end());
+		if(!res.pos.empty()) {
+			res.anchor = res.pos.front().second;
+		}
+		return res;
+	}
+
+	variant builder_map_to_variant(const builder_map& m)
+	{
+		std::vector<variant> cells, pos;
+		for(auto c : m.cells) {
+			cells.emplace_back(c);
+		}
+		for(const auto& p : m.pos) {
+			pos.emplace_back(p.first);
+			pos.emplace_back(p.second);
+		}
+		std::map<variant, variant> res;
+		res[variant("width")] = variant(m.width);
+		res[variant("height")] = variant(m.height);
+		res[variant("cells")] = variant(&cells);
+		res[variant("pos")] = variant(&pos);
+		res[variant("anchor")] = variant(m.anchor);
+		return variant(&res);
+	}
+
+	builder_map builder_map_from_variant(const variant& v)
+	{
+		builder_map res;
+		res.width = v["width"].as_int32();
+		res.height = v["height"].as_int32();
+		for(const auto& c : v["cells"].as_list()) {
+			res.cells.emplace_back(c.as_int32());
+		}
+		const auto& pos = v["pos"].as_list();
+		ASSERT_LOG(res.cells.size() == static_cast<size_t>(res.width * res.height) && pos.size() % 2 == 0, "Malformed terrain graphics map: " << v.write_json());
+		for(size_t n = 0; n != pos.size(); n += 2) {
+			res.pos.emplace_back(pos[n].as_int32(), pos[n + 1].as_int32());
+		}
+		res.anchor = v["anchor"].as_int32();
+		return res;
+	}
+}
+
+UNIT_TEST(read_builder_map_odd_and_even_lines)
+{
+	// the example in builder_map.hpp, starting on the odd columns.
+	auto m = terrain::read_builder_map(",  2\n3,   1\n,  4");
+	CHECK_EQ(m.width, 3);
+	CHECK_EQ(m.height, 2);
+	CHECK_EQ(m.cells[m.offset(1, 0)], 2);
+	CHECK_EQ(m.cells[m.offset(0, 1)], 3);
+	CHECK_EQ(m.cells[m.offset(2, 1)], 1);
+	CHECK_EQ(m.cells[m.offset(1, 1)], 4);
+	CHECK_EQ(m.anchor, m.offset(2, 1));
+
+	// starting on the even columns, with '.' and '*'.
+	m = terrain::read_builder_map("2, ., 1\n, *, 3");
+	CHECK_EQ(m.width, 5);
+	CHECK_EQ(m.height, 1);
+	CHECK_EQ(m.cells[m.offset(0, 0)], 2);
+	CHECK_EQ(m.cells[m.offset(1, 0)], terrain::map_cell_any);
+	CHECK_EQ(m.cells[m.offset(2, 0)], terrain::map_cell_none);
+	CHECK_EQ(m.cells[m.offset(3, 0)], 3);
+	CHECK_EQ(m.cells[m.offset(4, 0)], 1);
+	CHECK_EQ(m.anchor, m.offset(4, 0));
+
+	const auto back = terrain::builder_map_from_variant(terrain::builder_map_to_variant(m));
+	CHECK(back.cells == m.cells && back.pos == m.pos && back.anchor == m.anchor, "the map changed going through JSON");
+}
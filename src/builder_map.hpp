@@ -0,0 +1,49 @@
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "variant.hpp"
+
+// The map= attribute of a [terrain_graphics] rule, read as Wesnoth's read_builder_map()
+// and parse_mapstring() do. Lines alternate between the even and odd columns of the hex
+// grid; if the first line starts with an empty cell it holds the odd columns, and the
+// empty first cell of each odd line is skipped. A cell is '.' for no tile, '*' for any
+// terrain or the pos of a [tile].
+//
+//   map="
+//   ,  2
+//   3,   1
+//   ,  4"
+//
+// puts pos 2 at (1,0), 3 at (0,1), 1 at (2,1) and 4 at (1,1).
+namespace terrain
+{
+	// Values in builder_map::cells other than a pos.
+	const int map_cell_none = -1;
+	const int map_cell_any = 0;
+
+	struct builder_map
+	{
+		builder_map() : width(0), height(0), cells(), pos(), anchor(-1) {}
+		// cell offset of the hex at x,y.
+		int offset(int x, int y) const { return y * width + x; }
+		int width;
+		int height;
+		// width * height cells, row by row.
+		std::vector<int> cells;
+		// pos and cell offset of every numbered cell, ordered by pos then offset.
+		std::vector<std::pair<int, int>> pos;
+		// offset of the first cell with the lowest pos, which the rule is placed by, or -1
+		// if there are no numbered cells.
+		int anchor;
+	};
+
+	builder_map read_builder_map(const std::string& s);
+
+	// Written next to map as
+	//   {"width": 3, "height": 3, "cells": [...], "pos": [pos, offset, ...], "anchor": 4}
+	variant builder_map_to_variant(const builder_map& m);
+	builder_map builder_map_from_variant(const variant& v);
+}
@@ -9,10 +9,24 @@
 #include <sstream>
 #include <fstream>
 #include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 #include <boost/filesystem.hpp>
 
+#ifdef _MSC_VER
+#include <io.h>
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #include "asserts.hpp"
 #include "filesystem.hpp"
+#include "unit_test.hpp"
 
 namespace sys
 {
@@ -46,9 +60,81 @@ namespace sys
 		path p(name);
 		ASSERT_LOG(exists(p), "Couldn't read file: " << name);
 		std::ifstream file(p.native(), std::ios_base::binary);
-		std::stringstream ss;
-		ss << file.rdbuf();
-		return ss.str();
+		// Size the result up front and read straight into it, rather than going via a stringstream.
+		file.seekg(0, std::ios_base::end);
+		const std::streamoff size = file.tellg();
+		file.seekg(0, std::ios_base::beg);
+		std::string res(static_cast<size_t>(std::max<std::streamoff>(size, 0)), '\0');
+		if(!res.empty()) {
+			file.read(&res[0], size);
+		}
+		return res;
+	}
+
+	mapped_file::mapped_file(const std::string& name)
+		: data_(""),
+		  size_(0),
+		  is_mapped_(false),
+		  buffer_()
+	{
+		path p(name);
+		ASSERT_LOG(exists(p), "Couldn't read file: " << name);
+#ifndef _MSC_VER
+		const int fd = open(p.native().c_str(), O_RDONLY);
+		ASSERT_LOG(fd >= 0, "Couldn't open file: " << name);
+		struct stat st;
+		const int stat_res = fstat(fd, &st);
+		if(stat_res != 0) {
+			close(fd);
+		}
+		ASSERT_LOG(stat_res == 0, "Couldn't stat file: " << name);
+		if(st.st_size > 0) {
+			void* addr = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+			if(addr == MAP_FAILED) {
+				close(fd);
+			}
+			ASSERT_LOG(addr != MAP_FAILED, "Couldn't map file: " << name);
+			madvise(addr, static_cast<size_t>(st.st_size), MADV_SEQUENTIAL);
+			madvise(addr, static_cast<size_t>(st.st_size), MADV_WILLNEED);
+			data_ = static_cast<const char*>(addr);
+			size_ = static_cast<size_t>(st.st_size);
+			is_mapped_ = true;
+		}
+		close(fd);
+#else
+		std::ifstream file(p.native(), std::ios_base::binary);
+		file.seekg(0, std::ios_base::end);
+		buffer_.resize(static_cast<size_t>(std::max<std::streamoff>(file.tellg(), 0)));
+		file.seekg(0, std::ios_base::beg);
+		if(!buffer_.empty()) {
+			file.read(&buffer_[0], buffer_.size());
+			data_ = &buffer_[0];
+			size_ = buffer_.size();
+		}
+#endif
+	}
+
+	mapped_file::mapped_file(mapped_file&& mf)
+		: data_(mf.data_),
+		  size_(mf.size_),
+		  is_mapped_(mf.is_mapped_),
+		  buffer_(std::move(mf.buffer_))
+	{
+		if(!is_mapped_ && !buffer_.empty()) {
+			data_ = &buffer_[0];
+		}
+		mf.data_ = "";
+		mf.size_ = 0;
+		mf.is_mapped_ = false;
+	}
+
+	mapped_file::~mapped_file()
+	{
+#ifndef _MSC_VER
+		if(is_mapped_) {
+			munmap(const_cast<char*>(data_), size_);
+		}
+#endif
 	}
 
 	void write_file(const std::string& name, const std::string& data)
@@ -57,14 +143,124 @@ namespace sys
 		ASSERT_LOG(p.is_absolute() == false, "Won't write absolute paths: " << name);
 		ASSERT_LOG(p.has_filename(), "No filename found in write_file path: " << name);		
 
+		// Write the file.
+		file_sink file(name);
+		file.write(data);
+		file.commit();
+	}
+
+	file_sink::file_sink(const std::string& name, bool sync, size_t buffer_size)
+		: name_(name),
+		  temp_name_(),
+		  sync_(sync),
+		  file_(nullptr),
+		  storage_(),
+		  buffer_(nullptr),
+		  buffer_size_((std::max<size_t>(buffer_size, 1) + 4095) / 4096 * 4096),
+		  stream_(this)
+	{
+		path p(name);
+		ASSERT_LOG(p.has_filename(), "No filename found in file_sink path: " << name);
 		// Create any needed directories
 		if(p.has_parent_path()) {
-			create_directories(p);
+			create_directories(p.parent_path());
 		}
+#ifdef _MSC_VER
+		const int pid = _getpid();
+#else
+		const int pid = static_cast<int>(getpid());
+#endif
+		std::ostringstream ss;
+		ss << name << ".tmp" << pid;
+		temp_name_ = ss.str();
+		file_ = std::fopen(temp_name_.c_str(), "wb");
+		ASSERT_LOG(file_ != nullptr, "Couldn't open file for writing: " << temp_name_);
+		// We do our own buffering, in page aligned blocks.
+		std::setvbuf(file_, nullptr, _IONBF, 0);
+		const size_t alignment = 4096;
+		storage_.resize(buffer_size_ + alignment);
+		buffer_ = &storage_[0] + (alignment - reinterpret_cast<uintptr_t>(&storage_[0]) % alignment) % alignment;
+		setp(buffer_, buffer_ + buffer_size_);
+	}
 
-		// Write the file.
-		std::ofstream file(name, std::ios_base::binary);
-		file << data;
+	file_sink::~file_sink()
+	{
+		if(file_ != nullptr) {
+			std::fclose(file_);
+			std::remove(temp_name_.c_str());
+		}
+	}
+
+	void file_sink::write(const char* data, size_t size)
+	{
+		xsputn(data, static_cast<std::streamsize>(size));
+	}
+
+	void file_sink::flush_buffer()
+	{
+		const size_t n = static_cast<size_t>(pptr() - pbase());
+		if(n != 0) {
+			const size_t written = std::fwrite(pbase(), 1, n, file_);
+			ASSERT_LOG(written == n, "Error writing to file: " << temp_name_);
+		}
+		setp(buffer_, buffer_ + buffer_size_);
+	}
+
+	file_sink::int_type file_sink::overflow(int_type c)
+	{
+		flush_buffer();
+		if(!traits_type::eq_int_type(c, traits_type::eof())) {
+			*pptr() = traits_type::to_char_type(c);
+			pbump(1);
+		}
+		return traits_type::not_eof(c);
+	}
+
+	std::streamsize file_sink::xsputn(const char* s, std::streamsize n)
+	{
+		std::streamsize written = 0;
+		while(written != n) {
+			if(epptr() == pptr()) {
+				flush_buffer();
+			}
+			const std::streamsize chunk = std::min<std::streamsize>(n - written, epptr() - pptr());
+			std::copy(s + written, s + written + chunk, pptr());
+			pbump(static_cast<int>(chunk));
+			written += chunk;
+		}
+		return n;
+	}
+
+	// Nothing written is visible before commit(), so a flush of the stream part way
+	// through is ignored rather than writing out a partial block.
+	int file_sink::sync()
+	{
+		return 0;
+	}
+
+	void file_sink::commit()
+	{
+		ASSERT_LOG(file_ != nullptr, "file_sink::commit() called twice: " << name_);
+		stream_.flush();
+		flush_buffer();
+		if(sync_) {
+#ifdef _MSC_VER
+			_commit(_fileno(file_));
+#elif defined(__APPLE__)
+			fsync(fileno(file_));
+#else
+			fdatasync(fileno(file_));
+#endif
+		}
+		const int close_res = std::fclose(file_);
+		file_ = nullptr;
+		ASSERT_LOG(close_res == 0, "Error closing file: " << temp_name_);
+#ifdef _MSC_VER
+		// rename() won't replace an existing file here.
+		std::remove(name_.c_str());
+#endif
+		const int rename_res = std::rename(temp_name_.c_str(), name_.c_str());
+		ASSERT_LOG(rename_res == 0, "Unable to rename " << temp_name_ << " to " << name_);
 	}
 
 	std::string wstring_to_string(const std::wstring& ws)
@@ -94,4 +290,188 @@ namespace sys
 			std::cerr << "WARNING: path " << p.generic_string() << " doesn't exit" << std::endl;
 		}
 	}
+
+	namespace
+	{
+		std::string path_to_string(const path& p)
+		{
+#ifdef _MSC_VER
+			return wstring_to_string(p.generic_wstring());
+#else
+			// native paths are already utf-8 here, so skip the round trip through wide strings.
+			return p.generic_string();
+#endif
+		}
+
+		// Directories waiting to be walked, shared between the worker threads. A directory
+		// is only finished once it has been listed, so pending_ counts both queued and
+		// in-progress directories and the walk is over when it reaches zero.
+		class directory_queue
+		{
+		public:
+			directory_queue() : pending_(0) {}
+			void push(const path& p) {
+				std::lock_guard<std::mutex> lock(mutex_);
+				dirs_.emplace_back(p);
+				++pending_;
+				cv_.notify_one();
+			}
+			bool pop(path& p) {
+				std::unique_lock<std::mutex> lock(mutex_);
+				cv_.wait(lock, [this]() { return !dirs_.empty() || pending_ == 0; });
+				if(dirs_.empty()) {
+					return false;
+				}
+				p = dirs_.back();
+				dirs_.pop_back();
+				return true;
+			}
+			void done() {
+				std::lock_guard<std::mutex> lock(mutex_);
+				if(--pending_ == 0) {
+					cv_.notify_all();
+				}
+			}
+		private:
+			std::mutex mutex_;
+			std::condition_variable cv_;
+			std::vector<path> dirs_;
+			int pending_;
+		};
+	}
+
+	void get_unique_files_parallel(const std::string& name, file_info_map& fim, int threads)
+	{
+		path p(name);
+		if(!exists(p)) {
+			std::cerr << "WARNING: path " << p.generic_string() << " doesn't exit" << std::endl;
+			return;
+		}
+		ASSERT_LOG(is_directory(p) || is_other(p), "get_unique_files_parallel() not directory: " << name);
+		if(threads <= 0) {
+			threads = std::max<int>(1, std::thread::hardware_concurrency());
+		}
+
+		typedef std::pair<std::string, file_info> entry;
+		directory_queue queue;
+		std::vector<std::vector<entry>> results(threads);
+		queue.push(p);
+
+		auto worker = [&queue](std::vector<entry>& res) {
+			path dir;
+			while(queue.pop(dir)) {
+				boost::system::error_code ec;
+				for(auto it = directory_iterator(dir, ec); !ec && it != directory_iterator(); it.increment(ec)) {
+					// like recursive_directory_iterator, don't follow symlinks to directories.
+					if(is_directory(it->symlink_status(ec))) {
+						queue.push(it->path());
+					} else if(is_regular_file(it->status(ec))) {
+						const uintmax_t sz = file_size(it->path(), ec);
+						res.emplace_back(path_to_string(it->path().filename()), file_info(path_to_string(it->path()), ec ? 0 : sz));
+					}
+				}
+				queue.done();
+			}
+		};
+
+		std::vector<std::thread> pool;
+		for(int n = 1; n < threads; ++n) {
+			pool.emplace_back(worker, std::ref(results[n]));
+		}
+		worker(results[0]);
+		for(auto& t : pool) {
+			t.join();
+		}
+
+		std::vector<entry> all;
+		for(auto& res : results) {
+			all.insert(all.end(), res.begin(), res.end());
+		}
+		std::sort(all.begin(), all.end(), [](const entry& a, const entry& b) { return a.second.path < b.second.path; });
+		for(auto& e : all) {
+			fim[e.first] = e.second;
+		}
+	}
+}
+
+UNIT_TEST(mapped_file_and_parallel_walk)
+{
+	namespace fs = boost::filesystem;
+	const fs::path dir = fs::temp_directory_path() / fs::unique_path("filesystem_test_%%%%-%%%%-%%%%");
+	const auto put = [&dir](const std::string& name, const std::string& data) {
+		const fs::path p = dir / name;
+		fs::create_directories(p.parent_path());
+		std::ofstream(p.string(), std::ios_base::binary) << data;
+	};
+	std::string big;
+	for(int n = 0; n != 100000; ++n) {
+		big += static_cast<char>('a' + n % 26);
+	}
+	put("top.cfg", big);
+	put("empty.cfg", "");
+	for(int n = 0; n != 20; ++n) {
+		put("sub" + std::to_string(n % 4) + "/deeper/f" + std::to_string(n) + ".cfg", std::string(n, 'x'));
+	}
+	// the same name twice, the greater path wins.
+	put("a/dup.cfg", "1");
+	put("b/dup.cfg", "22");
+
+	{
+		sys::mapped_file mf((dir / "top.cfg").string());
+		CHECK_EQ(mf.size(), big.size());
+		CHECK(std::equal(mf.begin(), mf.end(), big.begin()), "mapped contents differ");
+		sys::mapped_file moved(std::move(mf));
+		CHECK(mf.empty() && moved.str() == big, "the move didn't hand over the mapping");
+		CHECK(sys::mapped_file((dir / "empty.cfg").string()).empty(), "");
+	}
+
+	sys::file_path_map serial;
+	sys::get_unique_files(dir.string(), serial);
+	sys::file_info_map one, four;
+	sys::get_unique_files_parallel(dir.string(), one, 1);
+	sys::get_unique_files_parallel(dir.string(), four, 4);
+	CHECK_EQ(one.size(), serial.size());
+	CHECK_EQ(four.size(), one.size());
+	for(const auto& f : one) {
+		CHECK(serial.count(f.first) != 0, f.first << " wasn't found by get_unique_files()");
+		CHECK(four[f.first].path == f.second.path && four[f.first].size == f.second.size, f.first << " differs with 4 threads");
+		CHECK_EQ(f.second.size, fs::file_size(f.second.path));
+	}
+	CHECK_EQ(one["dup.cfg"].size, 2);
+	CHECK_EQ(one["top.cfg"].size, big.size());
+	fs::remove_all(dir);
+}
+
+UNIT_TEST(file_sink_commit_and_abort)
+{
+	namespace fs = boost::filesystem;
+	const fs::path dir = fs::temp_directory_path() / fs::unique_path("file_sink_test_%%%%-%%%%-%%%%");
+	fs::create_directories(dir);
+	const std::string name = (dir / "out.txt").string();
+	std::string data;
+	for(int n = 0; n != 10000; ++n) {
+		data += static_cast<char>('a' + n % 26);
+	}
+	{
+		// several blocks, with a flush part way through.
+		sys::file_sink sink(name, false, 4096);
+		sink.write(data.substr(0, 5000));
+		sink.stream() << std::flush;
+		sink.stream() << data.substr(5000);
+		CHECK(!sys::file_exists(name), "nothing should be visible before commit()");
+		sink.commit();
+	}
+	CHECK(sys::read_file(name) == data, "committed data differs");
+	{
+		// destroyed without commit(), so the first version stays.
+		sys::file_sink sink(name);
+		sink.write("replacement");
+	}
+	CHECK(sys::read_file(name) == data, "an uncommitted sink replaced the file");
+	int files = 0;
+	for(fs::directory_iterator it(dir); it != fs::directory_iterator(); ++it) {
+		++files;
+	}
+	CHECK_EQ(files, 1);
+	fs::remove_all(dir);
 }
@@ -1,13 +1,96 @@
 #pragma once
 
+#include <cstdint>
+#include <cstdio>
 #include <map>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <vector>
 
 namespace sys
 {
 	typedef std::map<std::string, std::string> file_path_map;
 
+	struct file_info
+	{
+		file_info() : path(), size(0) {}
+		file_info(const std::string& p, uintmax_t sz) : path(p), size(sz) {}
+		std::string path;
+		uintmax_t size;
+	};
+	typedef std::map<std::string, file_info> file_info_map;
+
+	// Read-only view of the contents of a file. On POSIX systems the file is memory-mapped
+	// and the kernel is told we'll be reading it sequentially, elsewhere the contents are
+	// read into a buffer owned by the object.
+	class mapped_file
+	{
+	public:
+		explicit mapped_file(const std::string& name);
+		mapped_file(mapped_file&& mf);
+		~mapped_file();
+		const char* data() const { return data_; }
+		size_t size() const { return size_; }
+		bool empty() const { return size_ == 0; }
+		const char* begin() const { return data_; }
+		const char* end() const { return data_ + size_; }
+		std::string str() const { return std::string(data_, size_); }
+	private:
+		mapped_file(const mapped_file&);
+		void operator=(const mapped_file&);
+
+		const char* data_;
+		size_t size_;
+		bool is_mapped_;
+		std::vector<char> buffer_;
+	};
+
+	// Buffered output file. Data is written to a temporary file next to the destination
+	// in whole blocks of buffer_size, rounded up to a multiple of 4096, with flushes of
+	// the stream ignored so every write but the last is a full block at a block aligned
+	// offset. The temporary file only replaces the destination when commit() is
+	// called, so a crash part way through never leaves a truncated file behind. If the
+	// sink is destroyed without being committed the temporary file is removed. stream()
+	// can be handed to anything that writes to a std::ostream (i.e. variant::write_json)
+	// and writes directly into the sink's buffer.
+	class file_sink : private std::streambuf
+	{
+	public:
+		explicit file_sink(const std::string& name, bool sync=false, size_t buffer_size=1 << 20);
+		~file_sink();
+		std::ostream& stream() { return stream_; }
+		void write(const char* data, size_t size);
+		void write(const std::string& s) { write(s.data(), s.size()); }
+		// Flushes the buffer, optionally syncs the data to disk and renames the temporary
+		// file over the destination.
+		void commit();
+	private:
+		file_sink(const file_sink&);
+		void operator=(const file_sink&);
+
+		int_type overflow(int_type c) override;
+		std::streamsize xsputn(const char* s, std::streamsize n) override;
+		int sync() override;
+		void flush_buffer();
+
+		std::string name_;
+		std::string temp_name_;
+		bool sync_;
+		std::FILE* file_;
+		std::vector<char> storage_;
+		char* buffer_;
+		size_t buffer_size_;
+		std::ostream stream_;
+	};
+
 	bool file_exists(const std::string& name);
 	std::string read_file(const std::string& name);
 	void write_file(const std::string& name, const std::string& data);
 	void get_unique_files(const std::string& path, file_path_map& fpm);
+	// Like get_unique_files() but sub-directories are walked by a pool of threads and the
+	// size of each file is recorded. Where several files share a name the one with the
+	// lexicographically greatest path wins, so the result doesn't depend on scheduling.
+	// threads == 0 means use std::thread::hardware_concurrency().
+	void get_unique_files_parallel(const std::string& path, file_info_map& fim, int threads=0);
 }
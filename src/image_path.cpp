@@ -0,0 +1,463 @@
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <boost/lexical_cast.hpp>
+
+#include "asserts.hpp"
+#include "image_path.hpp"
+#include "profiler.hpp"
+#include "terrain_parser.hpp"
+#include "unit_test.hpp"
+
+namespace ipf
+{
+	namespace
+	{
+		opcode get_opcode(const std::string& name)
+		{
+			if(name == "CROP") {
+				return opcode::CROP;
+			} else if(name == "MASK") {
+				return opcode::MASK;
+			} else if(name == "BLIT") {
+				return opcode::BLIT;
+			} else if(name == "O") {
+				return opcode::OPACITY;
+			}
+			return opcode::OTHER;
+		}
+
+		class parser
+		{
+		public:
+			explicit parser(const std::string& s) : orig_(s), s_(), pos_(0), text_()
+			{
+				// '/' becomes '-' and the first ".png" is dropped.
+				s_.reserve(s.size());
+				const auto png = s.find(".png");
+				for(size_t n = 0; n != s.size(); ++n) {
+					if(n == png) {
+						n += 3;
+						continue;
+					}
+					s_ += s[n] == '/' ? '-' : s[n];
+				}
+			}
+
+			image_path parse()
+			{
+				image_path res;
+				read_text(res, "~:(");
+				if(peek() == '(') {
+					res.functions.emplace_back(parse_function(res));
+				} else if(!text_.empty()) {
+					res.name = intern(text_);
+				}
+				while(peek() == '~') {
+					++pos_;
+					read_text(res, "~:(");
+					if(peek() == '(') {
+						res.functions.emplace_back(parse_function(res));
+					} else if(!text_.empty()) {
+						res.unnamed = intern(text_);
+					}
+				}
+				if(peek() == ':') {
+					const std::string timing = s_.substr(pos_ + 1);
+					pos_ = s_.size();
+					if(!timing.empty()) {
+						try {
+							res.timing = boost::lexical_cast<double>(timing);
+							res.has_timing = true;
+						} catch(boost::bad_lexical_cast&) {
+							ASSERT_LOG(false, "Bad number for animation timing: " << timing);
+						}
+					}
+				}
+				ASSERT_LOG(pos_ == s_.size(), "Unexpected '" << s_[pos_] << "' in image path: " << orig_);
+				return res;
+			}
+		private:
+			char peek() const { return pos_ < s_.size() ? s_[pos_] : '\0'; }
+
+			// Reads into text_ up to the next character in stops, or the end. An animation
+			// range is replaced by "@A" and recorded in ip.
+			void read_text(image_path& ip, const char* stops)
+			{
+				text_.clear();
+				for(; pos_ != s_.size(); ++pos_) {
+					const char c = s_[pos_];
+					if(std::strchr(stops, c) != nullptr) {
+						break;
+					}
+					if(c == ']') {
+						ASSERT_LOG(false, "Closing bracket found with no matching open bracket. " << orig_);
+					} else if(c == '[') {
+						const auto close = s_.find(']', pos_);
+						ASSERT_LOG(close != std::string::npos, "Missing closing bracket in image path: " << orig_);
+						read_frames(ip, s_.substr(pos_ + 1, close - pos_ - 1));
+						text_ += "@A";
+						pos_ = close;
+					} else {
+						text_ += c;
+					}
+				}
+			}
+
+			void read_frames(image_path& ip, const std::string& range)
+			{
+				ip.frames = anim_range("", range);
+				if(ip.frames.start > ip.frames.end) {
+					std::swap(ip.frames.start, ip.frames.end);
+				}
+				ip.has_frames = true;
+			}
+
+			// Called with pos_ on the opening parenthesis and the function name in text_,
+			// returns with pos_ just past the closing parenthesis.
+			function parse_function(image_path& ip)
+			{
+				ASSERT_LOG(!text_.empty(), "No command was identified: " << orig_);
+				function res;
+				res.op = get_opcode(text_);
+				res.name = intern(text_);
+				++pos_;
+				for(;;) {
+					read_text(ip, "~()");
+					const char c = peek();
+					if(c == '(') {
+						res.chain.emplace_back(parse_function(ip));
+					} else if(c == '~') {
+						++pos_;
+						// only the last argument is converted to the function's type.
+						if(!text_.empty()) {
+							argument arg;
+							arg.type = res.op == opcode::MASK || res.op == opcode::BLIT ? arg_type::PATH : arg_type::STRING;
+							arg.s = intern(text_);
+							res.args.emplace_back(arg);
+						}
+					} else if(c == ')') {
+						++pos_;
+						if(!text_.empty()) {
+							add_args(res, text_);
+						}
+						return res;
+					} else {
+						ASSERT_LOG(false, "Missing closing parenthesis in image path: " << orig_);
+					}
+				}
+			}
+
+			void add_args(function& fn, const std::string& text)
+			{
+				argument arg;
+				switch(fn.op) {
+				case opcode::CROP:
+					arg.type = arg_type::INTEGER;
+					try {
+						for(const auto& str : split(text, ",", SplitFlags::NONE)) {
+							arg.i = boost::lexical_cast<int>(str);
+							fn.args.emplace_back(arg);
+						}
+					} catch(boost::bad_lexical_cast&) {
+						ASSERT_LOG(false, "Unable to convert " << text << " to a number.");
+					}
+					break;
+				case opcode::OPACITY: {
+					arg.type = arg_type::FLOAT;
+					const size_t is_percent = text.find('%');
+					try {
+						arg.f = boost::lexical_cast<float>(is_percent != std::string::npos ? text.substr(0, is_percent) : text);
+					} catch(boost::bad_lexical_cast&) {
+						ASSERT_LOG(false, "Unable to convert " << text << " to a number.");
+					}
+					if(is_percent != std::string::npos) {
+						arg.f /= 100.f;
+					}
+					fn.args.emplace_back(arg);
+					break;
+				}
+				case opcode::MASK:
+				case opcode::BLIT:
+					arg.type = arg_type::PATH;
+					arg.s = intern(text);
+					fn.args.emplace_back(arg);
+					break;
+				default:
+					arg.s = intern(text);
+					fn.args.emplace_back(arg);
+					break;
+				}
+			}
+
+			const std::string& orig_;
+			std::string s_;
+			size_t pos_;
+			std::string text_;
+		};
+
+		variant to_variant(const argument& arg)
+		{
+			switch(arg.type) {
+			case arg_type::INTEGER:	return variant(arg.i);
+			case arg_type::FLOAT:	return variant(arg.f);
+			default: break;
+			}
+			return variant(*arg.s);
+		}
+
+		// Repeated keys become lists, as with variant_builder.
+		typedef std::map<variant, std::vector<variant>> multi_map;
+
+		void collapse(multi_map& mm, std::map<variant, variant>& res)
+		{
+			for(auto& p : mm) {
+				if(p.second.size() == 1) {
+					res[p.first] = p.second[0];
+				} else {
+					res[p.first] = variant(&p.second);
+				}
+			}
+		}
+
+		variant to_variant(const function& fn)
+		{
+			multi_map mm;
+			if(!fn.args.empty()) {
+				auto& params = mm[variant("param")];
+				for(const auto& arg : fn.args) {
+					params.emplace_back(to_variant(arg));
+				}
+			}
+			for(const auto& sub : fn.chain) {
+				mm[variant(*sub.name)].emplace_back(to_variant(sub));
+			}
+			std::map<variant, variant> res;
+			collapse(mm, res);
+			return variant(&res);
+		}
+
+		// The cache is split into shards, each with its own lock, so parallel converters
+		// rarely wait on each other.
+		const size_t name_cache_shards = 16;
+
+		struct name_cache_shard
+		{
+			std::mutex mutex;
+			std::unordered_map<std::string, decoded_name> names;
+		};
+
+		struct name_cache
+		{
+			name_cache() : hits(0), misses(0) {}
+			name_cache_shard shards[name_cache_shards];
+			std::atomic<uint64_t> hits;
+			std::atomic<uint64_t> misses;
+		};
+
+		name_cache& get_name_cache()
+		{
+			static name_cache res;
+			return res;
+		}
+	}
+
+	const decoded_key decoded_keys[] = {
+		{ "", variant::VARIANT_TYPE_STRING },
+		{ "animation_timing", variant::VARIANT_TYPE_FLOAT },
+		{ "name", variant::VARIANT_TYPE_STRING },
+	};
+
+	const size_t decoded_keys_size = sizeof(decoded_keys) / sizeof(decoded_keys[0]);
+
+	const std::string* intern(const std::string& s)
+	{
+		static std::mutex mutex;
+		static std::unordered_set<std::string> strings;
+		std::lock_guard<std::mutex> lock(mutex);
+		return &*strings.insert(s).first;
+	}
+
+	image_path parse(const std::string& s)
+	{
+		return parser(s).parse();
+	}
+
+	std::map<variant, variant> to_map(const image_path& ip)
+	{
+		std::map<variant, variant> res;
+		if(ip.name != nullptr) {
+			res[variant("name")] = variant(*ip.name);
+		}
+		if(ip.has_frames && expand_ranges()) {
+			std::vector<variant> frames;
+			for(int n = 0; n != ip.frames.size(); ++n) {
+				frames.emplace_back(ip.frames.number(n));
+			}
+			res[variant("animation-frames")] = variant(&frames);
+		} else if(ip.has_frames) {
+			res[variant("animation-frames")] = range_to_variant(ip.frames);
+		}
+		if(ip.unnamed != nullptr) {
+			res[variant("")] = variant(*ip.unnamed);
+		}
+		multi_map mm;
+		for(const auto& fn : ip.functions) {
+			mm[variant(*fn.name)].emplace_back(to_variant(fn));
+		}
+		collapse(mm, res);
+		if(ip.has_timing) {
+			res[variant("animation_timing")] = variant(ip.timing);
+		}
+		return res;
+	}
+
+	decoded_name decode_name(const std::string& s)
+	{
+		auto& cache = get_name_cache();
+		auto& shard = cache.shards[std::hash<std::string>()(s) % name_cache_shards];
+		{
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			auto it = shard.names.find(s);
+			if(it != shard.names.end()) {
+				cache.hits.fetch_add(1, std::memory_order_relaxed);
+				PROFILE_COUNTER("name cache hits", 1);
+				return it->second;
+			}
+		}
+		cache.misses.fetch_add(1, std::memory_order_relaxed);
+		PROFILE_COUNTER("name cache misses", 1);
+		// decode without holding the lock, if another thread beat us to it keep theirs.
+		decoded_name res = std::make_shared<const std::map<variant, variant>>(to_map(parse(s)));
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		return shard.names.emplace(s, res).first->second;
+	}
+
+	void clear_name_cache()
+	{
+		auto& cache = get_name_cache();
+		for(auto& shard : cache.shards) {
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			shard.names.clear();
+		}
+		cache.hits = 0;
+		cache.misses = 0;
+	}
+
+	name_cache_stats get_name_cache_stats()
+	{
+		auto& cache = get_name_cache();
+		name_cache_stats res;
+		res.hits = cache.hits.load(std::memory_order_relaxed);
+		res.misses = cache.misses.load(std::memory_order_relaxed);
+		for(auto& shard : cache.shards) {
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			res.entries += shard.names.size();
+		}
+		return res;
+	}
+}
+
+UNIT_TEST(image_path_parse)
+{
+	using namespace ipf;
+	image_path ip = parse("water/water[01~17].png~CROP(0,0,72,72):100");
+	CHECK(ip.name != nullptr && *ip.name == "water-water@A", "");
+	CHECK(ip.has_frames && ip.frames.start == 1 && ip.frames.end == 17, "");
+	CHECK(ip.has_timing && ip.timing == 100.0, "");
+	CHECK_EQ(ip.functions.size(), 1);
+	CHECK(ip.functions[0].op == opcode::CROP && *ip.functions[0].name == "CROP", "");
+	CHECK_EQ(ip.functions[0].args.size(), 4);
+	for(size_t n = 0; n != 4; ++n) {
+		CHECK(ip.functions[0].args[n].type == arg_type::INTEGER && ip.functions[0].args[n].i == (n < 2 ? 0 : 72), "");
+	}
+
+	// only the first ".png" goes, and the BLIT is chained inside the MASK.
+	ip = parse("off-map/border.png~MASK(masks/concave-@R0.png~BLIT(masks/concave-@R1.png))");
+	CHECK(*ip.name == "off-map-border" && !ip.has_frames && !ip.has_timing, "");
+	CHECK_EQ(ip.functions.size(), 1);
+	const function& mask = ip.functions[0];
+	CHECK(mask.op == opcode::MASK && mask.args.size() == 1 && mask.args[0].type == arg_type::PATH, "");
+	CHECK(*mask.args[0].s == "masks-concave-@R0.png", *mask.args[0].s);
+	CHECK(mask.chain.size() == 1 && mask.chain[0].op == opcode::BLIT, "");
+	CHECK(*mask.chain[0].args[0].s == "masks-concave-@R1.png", *mask.chain[0].args[0].s);
+
+	// percentages are scaled, timings needn't be whole and text which isn't a function
+	// is kept.
+	ip = parse("impassable-editor.png~O(50%)~NOP:150.5");
+	CHECK(ip.functions.size() == 1 && ip.functions[0].op == opcode::OPACITY, "");
+	CHECK(ip.functions[0].args[0].type == arg_type::FLOAT && ip.functions[0].args[0].f == 0.5f, "");
+	CHECK(ip.unnamed != nullptr && *ip.unnamed == "NOP", "");
+	CHECK(ip.has_timing && ip.timing == 150.5, "");
+	CHECK(parse("a.png~O(0.25)").functions[0].args[0].f == 0.25f, "");
+
+	// a range counting down is stored counting up.
+	ip = parse("fire[05~1].png");
+	CHECK(ip.frames.start == 1 && ip.frames.end == 5, "");
+
+	const auto m = to_map(parse("water/water[01~17].png~CROP(0,0,72,72)~CROP(1,2,3,4):100.5"));
+	CHECK(m.at(variant("name")) == variant("water-water@A"), "");
+	CHECK(m.at(variant("animation_timing")) == variant(100.5), "");
+	CHECK(m.count(variant("animation-frames")) != 0, "");
+	// a function used twice becomes a list.
+	const variant& crops = m.at(variant("CROP"));
+	CHECK_EQ(crops.num_elements(), 2);
+	CHECK(crops[1]["param"][3] == variant(4), "");
+	CHECK(intern("x") == intern(std::string("x")), "interned strings should be shared");
+}
+
+UNIT_TEST(image_name_cache)
+{
+	// other tests may be decoding names at the same time, so the names here are unique
+	// and the statistics are only checked as far as this test accounts for them.
+	const auto before = ipf::get_name_cache_stats();
+	const std::string name = "name-cache-test/ocean[01~17].png~CROP(0,0,72,72):100";
+	const auto first = ipf::decode_name(name);
+	CHECK(*first == ipf::to_map(ipf::parse(name)), "the cached result differs from decoding it directly");
+	CHECK(ipf::decode_name(name) == first, "a second lookup should share the first result");
+
+	// the same names from several threads at once, each decoded once and shared.
+	const int nthreads = 4, nnames = 200, rounds = 5;
+	std::vector<std::vector<ipf::decoded_name>> results(nthreads);
+	std::vector<std::thread> threads;
+	for(int t = 0; t != nthreads; ++t) {
+		threads.emplace_back([t, &results]() {
+			for(int r = 0; r != rounds; ++r) {
+				for(int n = 0; n != nnames; ++n) {
+					results[t].emplace_back(ipf::decode_name("name-cache-test/t" + std::to_string(n) + ".png~O(" + std::to_string(n % 100) + "%)"));
+				}
+			}
+		});
+	}
+	for(auto& t : threads) {
+		t.join();
+	}
+	for(int n = 0; n != nnames; ++n) {
+		CHECK((*results[0][n]).at(variant("name")) == variant("name-cache-test-t" + std::to_string(n)), "");
+		for(int t = 0; t != nthreads; ++t) {
+			for(int r = 0; r != rounds; ++r) {
+				CHECK(results[t][r * nnames + n] == results[0][n], "threads got different copies of a name");
+			}
+		}
+	}
+	const auto after = ipf::get_name_cache_stats();
+	CHECK_GE(after.hits + after.misses - before.hits - before.misses, static_cast<uint64_t>(2 + nthreads * nnames * rounds));
+	CHECK_GE(after.misses - before.misses, static_cast<uint64_t>(nnames + 1));
+	CHECK_GE(after.entries, static_cast<size_t>(nnames + 1));
+
+	ipf::name_cache_stats stats;
+	CHECK(stats.hit_rate() == 0.0, "");
+	stats.hits = 3;
+	stats.misses = 1;
+	CHECK(stats.hit_rate() == 0.75, "");
+
+	// after clearing, a name is decoded again.
+	ipf::clear_name_cache();
+	const auto again = ipf::decode_name(name);
+	CHECK(again != first && *again == *first, "");
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "anim_range.hpp"
+#include "variant.hpp"
+
+// Parser for image paths with image path functions (IPF) applied, as used in the name=
+// attribute of terrain graphics, i.e.
+//   off-map/border.png~MASK(masks/concave-@R0.png~BLIT(masks/concave-@R1.png))
+//   water/water[01~17].png~CROP(0,0,72,72):100
+// Paths are parsed into a small typed tree rather than straight into variants.
+namespace ipf
+{
+	enum class opcode
+	{
+		CROP,
+		MASK,
+		BLIT,
+		OPACITY,
+		// any function we don't interpret, its arguments are kept as strings.
+		OTHER,
+	};
+
+	enum class arg_type
+	{
+		INTEGER,
+		FLOAT,
+		PATH,
+		STRING,
+	};
+
+	struct argument
+	{
+		argument() : type(arg_type::STRING), i(0), f(0), s(nullptr) {}
+		arg_type type;
+		int i;
+		float f;
+		// interned, for PATH and STRING.
+		const std::string* s;
+	};
+
+	struct function
+	{
+		function() : op(opcode::OTHER), name(nullptr), args(), chain() {}
+		opcode op;
+		const std::string* name;
+		std::vector<argument> args;
+		// functions applied inside the argument list, i.e. the BLITs in a MASK.
+		std::vector<function> chain;
+	};
+
+	struct image_path
+	{
+		image_path() : name(nullptr), has_frames(false), frames(), functions(), unnamed(nullptr), has_timing(false), timing(0) {}
+		// The file name with '/' replaced by '-', the first ".png" removed and an animation
+		// range replaced by "@A". nullptr if there wasn't one.
+		const std::string* name;
+		bool has_frames;
+		// always counts up, with no base since the name holds the "@A" placeholder.
+		anim_range frames;
+		std::vector<function> functions;
+		// text following a '~' which isn't a function.
+		const std::string* unnamed;
+		bool has_timing;
+		double timing;
+	};
+
+	// Returns a pointer to the single shared copy of s. Thread-safe.
+	const std::string* intern(const std::string& s);
+
+	image_path parse(const std::string& s);
+	// The decoded form written to the JSON: "name", "animation-frames" and
+	// "animation_timing" keys plus one key per top-level function. animation-frames is
+	// a compact range unless expand_ranges() is set, then it lists every frame number.
+	std::map<variant, variant> to_map(const image_path& ip);
+
+	// The keys to_map() always writes with the same type of value, so code reading the
+	// decoded form needn't infer it from samples. The function keys, and animation-frames
+	// whose form depends on expand_ranges(), aren't listed.
+	struct decoded_key
+	{
+		const char* key;
+		variant::variant_type type;
+	};
+	extern const decoded_key decoded_keys[];
+	extern const size_t decoded_keys_size;
+
+	typedef std::shared_ptr<const std::map<variant, variant>> decoded_name;
+
+	// to_map(parse(s)), memoized on s, since the terrain graphics rules use the same
+	// few thousand names over and over. Results are shared between callers, so are
+	// immutable. Thread-safe.
+	decoded_name decode_name(const std::string& s);
+	void clear_name_cache();
+
+	struct name_cache_stats
+	{
+		name_cache_stats() : hits(0), misses(0), entries(0) {}
+		double hit_rate() const { return hits + misses != 0 ? static_cast<double>(hits) / (hits + misses) : 0.0; }
+		uint64_t hits;
+		uint64_t misses;
+		size_t entries;
+	};
+	name_cache_stats get_name_cache_stats();
+}
@@ -1,11 +1,16 @@
+#include <algorithm>
+#include <atomic>
 #include <deque>
 #include <cstdint>
+#include <sstream>
+#include <thread>
 #include <tuple>
 
 #include "filesystem.hpp"
 #include "formatter.hpp"
 #include "json.hpp"
 #include "lexical_cast.hpp"
+#include "unit_test.hpp"
 
 namespace json
 {
@@ -127,6 +132,8 @@ namespace json
 
 			bool running = true;
 			bool in_string = false;
+			// a string only ends at the quote it started with, "'" can be inside "...".
+			char quote = '"';
 			std::string::iterator start_it = it_;
 			std::string new_string;
 			while(running) {
@@ -137,7 +144,7 @@ namespace json
 					return std::make_tuple(DOCUMENT_END, variant());
 				}
 				if(in_string) {
-					if(*it_ == '"' || *it_ == '\'') {
+					if(*it_ == quote) {
 						++it_;
 						variant string_node(new_string);
 						//if(new_string == "true") {
@@ -238,6 +245,7 @@ namespace json
 						return std::make_tuple(COLON, variant());
 					} else if(*it_ == '"' || *it_ == '\'') {
 						in_string = true;
+						quote = *it_;
 						++it_;
 					} else if(is_digit(*it_) || *it_ == '-') {
 						bool is_float = false;
@@ -411,4 +419,161 @@ namespace json
 			throw parse_error(formatter() << "File \"" <<  fname << "\" doesn't exist");
 		}
 	}
+
+	namespace 
+	{
+		// Writes the elements [first, last) of a list or map the same way variant::write_json()
+		// does when emitting a container at the given indent. is_first tells us whether the
+		// chunk starts at the very first element of the container, which is the only one not
+		// preceded by a separator.
+		void write_list_chunk(std::ostream& os, variant_list::const_iterator first, variant_list::const_iterator last, bool is_first, bool pretty, int indent)
+		{
+			const std::string sep = pretty ? (",\n" + std::string(indent, ' ')) : ",";
+			for(auto it = first; it != last; ++it) {
+				if(it != first || !is_first) {
+					os << sep;
+				}
+				it->write_json(os, pretty, indent + 4);
+			}
+		}
+
+		void write_map_chunk(std::ostream& os, variant_map::const_iterator first, variant_map::const_iterator last, bool is_first, bool pretty, int indent)
+		{
+			const std::string sep = pretty ? (",\n" + std::string(indent, ' ')) : ",";
+			for(auto it = first; it != last; ++it) {
+				if(it != first || !is_first) {
+					os << sep;
+				}
+				it->first.write_json(os, pretty, indent + 4);
+				os << (pretty ? ": " : ":");
+				it->second.write_json(os, pretty, indent + 4);
+			}
+		}
+
+		// Splits the container elements into chunks, serializes each chunk on a pool of worker
+		// threads and writes the resulting buffers to the stream in their original order.
+		template<typename It, typename Fn>
+		void write_chunks_parallel(std::ostream& os, It begin, size_t count, int threads, int min_chunk, Fn write_chunk)
+		{
+			const size_t nchunks = std::max<size_t>(1, std::min<size_t>(threads * 4, count / min_chunk));
+			std::vector<It> starts;
+			starts.reserve(nchunks + 1);
+			It it = begin;
+			for(size_t n = 0; n != nchunks; ++n) {
+				starts.emplace_back(it);
+				std::advance(it, count / nchunks + (n < count % nchunks ? 1 : 0));
+			}
+			starts.emplace_back(it);
+
+			std::vector<std::string> buffers(nchunks);
+			std::atomic<size_t> next_chunk(0);
+			auto worker = [&]() {
+				for(size_t n = next_chunk++; n < nchunks; n = next_chunk++) {
+					std::ostringstream ss;
+					write_chunk(ss, starts[n], starts[n + 1], n == 0);
+					buffers[n] = ss.str();
+				}
+			};
+			std::vector<std::thread> pool;
+			const int nthreads = static_cast<int>(std::min<size_t>(threads, nchunks));
+			for(int n = 1; n < nthreads; ++n) {
+				pool.emplace_back(worker);
+			}
+			worker();
+			for(auto& t : pool) {
+				t.join();
+			}
+			for(const auto& buf : buffers) {
+				os << buf;
+			}
+		}
+
+		void write_value_parallel(std::ostream& os, const variant& v, bool pretty, int indent, int threads, int min_chunk)
+		{
+			if(!v.is_list() && !v.is_map()) {
+				v.write_json(os, pretty, indent);
+				return;
+			}
+			const bool split = threads > 1 && static_cast<size_t>(v.num_elements()) >= static_cast<size_t>(min_chunk) * 2;
+			if(v.is_list()) {
+				const auto& l = v.as_list();
+				os << (pretty ? ("[\n" + std::string(indent, ' ')) : "[");
+				if(split) {
+					write_chunks_parallel(os, l.cbegin(), l.size(), threads, min_chunk, [pretty, indent](std::ostream& s, variant_list::const_iterator first, variant_list::const_iterator last, bool is_first) {
+						write_list_chunk(s, first, last, is_first, pretty, indent);
+					});
+				} else {
+					for(auto it = l.cbegin(); it != l.cend(); ++it) {
+						if(it != l.cbegin()) {
+							os << (pretty ? (",\n" + std::string(indent, ' ')) : ",");
+						}
+						write_value_parallel(os, *it, pretty, indent + 4, threads, min_chunk);
+					}
+				}
+				os << (pretty ? ("\n" + std::string(indent-4, ' ') + "]") : "]");
+			} else {
+				const auto& m = v.as_map();
+				os << (pretty ? ("{\n" + std::string(indent, ' ')) : "{");
+				if(split) {
+					write_chunks_parallel(os, m.cbegin(), m.size(), threads, min_chunk, [pretty, indent](std::ostream& s, variant_map::const_iterator first, variant_map::const_iterator last, bool is_first) {
+						write_map_chunk(s, first, last, is_first, pretty, indent);
+					});
+				} else {
+					for(auto it = m.cbegin(); it != m.cend(); ++it) {
+						if(it != m.cbegin()) {
+							os << (pretty ? (",\n" + std::string(indent, ' ')) : ",");
+						}
+						it->first.write_json(os, pretty, indent + 4);
+						os << (pretty ? ": " : ":");
+						write_value_parallel(os, it->second, pretty, indent + 4, threads, min_chunk);
+					}
+				}
+				os << (pretty ? ("\n" + std::string(indent-4, ' ') + "}") : "}");
+			}
+		}
+	}
+
+	void write_parallel(std::ostream& os, const variant& n, bool pretty, int indent, int threads, int min_chunk)
+	{
+		if(threads <= 0) {
+			threads = std::max<int>(1, std::thread::hardware_concurrency());
+		}
+		write_value_parallel(os, n, pretty, indent, threads, std::max(1, min_chunk));
+	}
+
+	std::string write_parallel(const variant& n, bool pretty, int indent, int threads, int min_chunk)
+	{
+		std::ostringstream ss;
+		write_parallel(ss, n, pretty, indent, threads, min_chunk);
+		return ss.str();
+	}
+}
+
+UNIT_TEST(json_write_parallel_matches_write_json)
+{
+	std::ostringstream doc;
+	doc << "{\"rules\": [";
+	for(int n = 0; n != 300; ++n) {
+		doc << (n != 0 ? "," : "") << "{\"n\": " << n << ", \"f\": " << n * 0.25 << ", \"s\": \"a \\\"quoted\\\" line\\n" << n << "\""
+			<< ", \"b\": " << (n % 2 ? "true" : "false") << ", \"z\": null, \"l\": [[1, 2], [" << n << "]]}";
+	}
+	doc << "], \"wide\": {";
+	for(int n = 0; n != 200; ++n) {
+		doc << (n != 0 ? "," : "") << "\"k" << n << "\": [" << n << "]";
+	}
+	doc << "}}";
+	variant v = json::parse(doc.str());
+	// parse() doesn't take empty containers.
+	std::vector<variant> empty_list;
+	std::map<variant, variant> empty_map;
+	v.as_mutable_map()[variant("empty_list")] = variant(&empty_list);
+	v.as_mutable_map()[variant("empty_map")] = variant(&empty_map);
+	for(bool pretty : { true, false }) {
+		for(int threads : { 1, 4 }) {
+			for(int min_chunk : { 1, 7, 64 }) {
+				CHECK(json::write_parallel(v, pretty, 4, threads, min_chunk) == v.write_json(pretty, 4),
+					"pretty " << pretty << ", " << threads << " threads, min_chunk " << min_chunk);
+			}
+		}
+	}
 }
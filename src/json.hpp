@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdexcept>
+
 #include "variant.hpp"
 
 
@@ -16,4 +18,13 @@ namespace json
 	variant parse(const std::string& s);
 	variant parse_from_file(const std::string& fname);
 	void write(std::ostream& os, const variant& n, bool pretty=true);
+
+	// Produces exactly the same output as variant::write_json(), but any list or map with
+	// at least min_chunk * 2 elements is split into chunks which are serialized on worker
+	// threads and then concatenated in order. Containers smaller than that are framed
+	// serially and their children are examined in turn, so a large list nested under a
+	// small map (i.e. {"terrain_graphics": [...]}) still gets split.
+	// threads == 0 means use std::thread::hardware_concurrency().
+	void write_parallel(std::ostream& os, const variant& n, bool pretty=true, int indent=0, int threads=0, int min_chunk=64);
+	std::string write_parallel(const variant& n, bool pretty=true, int indent=0, int threads=0, int min_chunk=64);
 }
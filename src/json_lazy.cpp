@@ -0,0 +1,419 @@
+#include <algorithm>
+#include <cstdlib>
+
+#include "asserts.hpp"
+#include "filesystem.hpp"
+#include "formatter.hpp"
+#include "json_lazy.hpp"
+#include "unit_test.hpp"
+
+namespace json
+{
+	namespace
+	{
+		bool is_space(char c)
+		{
+			return c == ' ' || c == '\t' || c == '\v' || c == '\r' || c == '\n' || c == '\f';
+		}
+
+		void trim_span(const std::string& s, size_t& begin, size_t& end)
+		{
+			while(begin < end && is_space(s[begin])) {
+				++begin;
+			}
+			while(end > begin && is_space(s[end - 1])) {
+				--end;
+			}
+		}
+
+		void append_utf8(std::string& res, uint16_t value)
+		{
+			if(value <= 127U) {
+				res += char(value);
+			} else if(value <= 2047U) {
+				res += char(0xc0 | (value >> 6));
+				res += char(0x80 | (value & 0x3f));
+			} else {
+				res += char(0xe0 | (value >> 12));
+				res += char(0x80 | ((value >> 6) & 0x3f));
+				res += char(0x80 | (value & 0x3f));
+			}
+		}
+
+		// Decodes the quoted string in s[begin, end), which includes the quotes.
+		std::string decode_string(const std::string& s, size_t begin, size_t end)
+		{
+			std::string res;
+			res.reserve(end - begin);
+			for(size_t n = begin + 1; n < end - 1; ++n) {
+				if(s[n] != '\\') {
+					res += s[n];
+					continue;
+				}
+				if(++n >= end - 1) {
+					throw parse_error("End of data in quoted token");
+				}
+				switch(s[n]) {
+				case '"':	res += '"'; break;
+				case '\\':	res += '\\'; break;
+				case '/':	res += '/'; break;
+				case 'b':	res += '\b'; break;
+				case 'f':	res += '\f'; break;
+				case 'n':	res += '\n'; break;
+				case 'r':	res += '\r'; break;
+				case 't':	res += '\t'; break;
+				case 'u': {
+					if(end - 1 - (n + 1) < 4) {
+						throw parse_error("Expected 4 hexadecimal characters after \\u token");
+					}
+					const std::string hex = s.substr(n + 1, 4);
+					char* hex_end = nullptr;
+					const unsigned long value = std::strtoul(hex.c_str(), &hex_end, 16);
+					if(hex_end != hex.c_str() + 4) {
+						throw parse_error(formatter() << "Invalid character in decode: " << hex);
+					}
+					append_utf8(res, static_cast<uint16_t>(value));
+					n += 4;
+					break;
+				}
+				default:
+					throw parse_error(formatter() << "Unrecognised quoted token: " << s[n]);
+				}
+			}
+			return res;
+		}
+	}
+
+	lazy_document::lazy_document(const std::string& text)
+		: text_(text)
+	{
+		std::vector<int> open;
+		bool in_string = false;
+		char quote = '"';
+		for(size_t n = 0; n != text_.size(); ++n) {
+			const char c = text_[n];
+			if(in_string) {
+				if(c == '\\') {
+					++n;
+				} else if(c == quote) {
+					in_string = false;
+				}
+				continue;
+			}
+			switch(c) {
+			case '"':
+			case '\'':
+				in_string = true;
+				quote = c;
+				break;
+			case '{':
+			case '[':
+				open.emplace_back(static_cast<int>(structural_.size()));
+				structural_.emplace_back(n);
+				match_.emplace_back(-1);
+				break;
+			case '}':
+			case ']': {
+				if(open.empty() || text_[structural_[open.back()]] != (c == '}' ? '{' : '[')) {
+					throw parse_error(formatter() << "Unmatched '" << c << "' at offset " << n);
+				}
+				match_[open.back()] = static_cast<int>(structural_.size());
+				open.pop_back();
+				structural_.emplace_back(n);
+				match_.emplace_back(-1);
+				break;
+			}
+			case ':':
+			case ',':
+				structural_.emplace_back(n);
+				match_.emplace_back(-1);
+				break;
+			default: break;
+			}
+		}
+		if(in_string) {
+			throw parse_error("End of data inside string");
+		}
+		if(!open.empty()) {
+			throw parse_error("End of data inside object or array");
+		}
+		size_t first = 0;
+		size_t last = text_.size();
+		trim_span(text_, first, last);
+		if(structural_.empty() || structural_[0] != first || (text_[first] != '{' && text_[first] != '[')) {
+			throw parse_error("Expecting array or object at start of document");
+		}
+		// as json::parse, nothing but whitespace may follow the root.
+		if(structural_[match_[0]] + 1 != last) {
+			throw parse_error(formatter() << "Unexpected text after the document at offset " << structural_[match_[0]] + 1);
+		}
+	}
+
+	lazy_value lazy_document::root() const
+	{
+		return lazy_value(this, structural_[0], structural_[match_[0]] + 1, 0);
+	}
+
+	lazy_value lazy_document::make_value(size_t begin, size_t end) const
+	{
+		trim_span(text_, begin, end);
+		if(begin == end) {
+			throw parse_error(formatter() << "Missing value at offset " << begin);
+		}
+		if(text_[begin] == '{' || text_[begin] == '[') {
+			auto it = std::lower_bound(structural_.cbegin(), structural_.cend(), begin);
+			ASSERT_LOG(it != structural_.cend() && *it == begin, "Structural index doesn't contain offset " << begin);
+			const int index = static_cast<int>(it - structural_.cbegin());
+			return lazy_value(this, begin, structural_[match_[index]] + 1, index);
+		}
+		return lazy_value(this, begin, end, -1);
+	}
+
+	const lazy_document::members& lazy_document::get_members(int index) const
+	{
+		auto it = cache_.find(index);
+		if(it != cache_.end()) {
+			return *it->second;
+		}
+
+		std::unique_ptr<members> res(new members);
+		const bool is_object = text_[structural_[index]] == '{';
+		const int close = match_[index];
+		size_t seg_begin = structural_[index] + 1;
+		bool have_key = false;
+		std::string key;
+		for(int n = index + 1; n <= close; ++n) {
+			const char c = text_[structural_[n]];
+			if(n != close && (c == '{' || c == '[')) {
+				// skip over nested containers, we only split out our immediate members.
+				n = match_[n];
+				continue;
+			}
+			if(c == ':' && is_object && !have_key) {
+				size_t kb = seg_begin;
+				size_t ke = structural_[n];
+				trim_span(text_, kb, ke);
+				key = (kb != ke && (text_[kb] == '"' || text_[kb] == '\'')) ? decode_string(text_, kb, ke) : text_.substr(kb, ke - kb);
+				have_key = true;
+				seg_begin = structural_[n] + 1;
+			} else if(c == ',' || n == close) {
+				size_t vb = seg_begin;
+				size_t ve = structural_[n];
+				trim_span(text_, vb, ve);
+				// empty segments come from empty containers or trailing commas.
+				if(vb != ve) {
+					if(is_object) {
+						if(!have_key) {
+							throw parse_error(formatter() << "Expected colon ':' at offset " << vb);
+						}
+						// a repeated key replaces the earlier value where it was, as json::parse
+						// keeps the last one, so every value is reachable by a key.
+						const auto it = res->keys.find(key);
+						if(it != res->keys.end()) {
+							res->values[it->second] = make_value(vb, ve);
+						} else {
+							res->keys[key] = res->values.size();
+							res->key_order.emplace_back(key);
+							res->values.emplace_back(make_value(vb, ve));
+						}
+					} else {
+						res->values.emplace_back(make_value(vb, ve));
+					}
+				}
+				have_key = false;
+				seg_begin = structural_[n] + 1;
+			}
+		}
+		const members& m = *res;
+		cache_[index] = std::move(res);
+		return m;
+	}
+
+	char lazy_value::first_char() const
+	{
+		ASSERT_LOG(doc_ != nullptr, "Tried to access an invalid lazy json value");
+		return doc_->text_[begin_];
+	}
+
+	bool lazy_value::is_null() const
+	{
+		return doc_ == nullptr || first_char() == 'n';
+	}
+
+	bool lazy_value::is_bool() const
+	{
+		return doc_ != nullptr && (first_char() == 't' || first_char() == 'f');
+	}
+
+	bool lazy_value::is_numeric() const
+	{
+		return doc_ != nullptr && (first_char() == '-' || (first_char() >= '0' && first_char() <= '9'));
+	}
+
+	bool lazy_value::is_string() const
+	{
+		return doc_ != nullptr && (first_char() == '"' || first_char() == '\'');
+	}
+
+	bool lazy_value::is_map() const
+	{
+		return index_ >= 0 && first_char() == '{';
+	}
+
+	bool lazy_value::is_list() const
+	{
+		return index_ >= 0 && first_char() == '[';
+	}
+
+	int lazy_value::num_elements() const
+	{
+		if(index_ < 0) {
+			return is_null() ? 0 : 1;
+		}
+		return static_cast<int>(doc_->get_members(index_).values.size());
+	}
+
+	bool lazy_value::has_key(const std::string& key) const
+	{
+		if(!is_map()) {
+			return false;
+		}
+		const auto& m = doc_->get_members(index_);
+		return m.keys.find(key) != m.keys.end();
+	}
+
+	std::vector<std::string> lazy_value::keys() const
+	{
+		ASSERT_LOG(is_map(), "Tried to get the keys of a lazy json value that isn't a map");
+		return doc_->get_members(index_).key_order;
+	}
+
+	lazy_value lazy_value::operator[](const std::string& key) const
+	{
+		ASSERT_LOG(is_map(), "Tried to index lazy json value that isn't a map");
+		const auto& m = doc_->get_members(index_);
+		auto it = m.keys.find(key);
+		return it != m.keys.end() ? m.values[it->second] : lazy_value();
+	}
+
+	lazy_value lazy_value::operator[](size_t n) const
+	{
+		ASSERT_LOG(index_ >= 0, "Tried to index lazy json value that isn't a list or map");
+		const auto& m = doc_->get_members(index_);
+		return n < m.values.size() ? m.values[n] : lazy_value();
+	}
+
+	std::string lazy_value::raw() const
+	{
+		ASSERT_LOG(doc_ != nullptr, "Tried to access an invalid lazy json value");
+		return doc_->text_.substr(begin_, end_ - begin_);
+	}
+
+	std::string lazy_value::as_string() const
+	{
+		if(is_string()) {
+			return decode_string(doc_->text_, begin_, end_);
+		}
+		return raw();
+	}
+
+	int64_t lazy_value::as_int() const
+	{
+		if(is_bool()) {
+			return first_char() == 't' ? 1 : 0;
+		}
+		ASSERT_LOG(is_numeric(), "as_int() type conversion error from " << raw() << " to int");
+		const std::string s = raw();
+		if(s.find_first_of(".eE") != std::string::npos) {
+			return static_cast<int64_t>(std::strtod(s.c_str(), nullptr));
+		}
+		return std::strtoll(s.c_str(), nullptr, 10);
+	}
+
+	float lazy_value::as_float() const
+	{
+		if(is_bool()) {
+			return first_char() == 't' ? 1.0f : 0.0f;
+		}
+		ASSERT_LOG(is_numeric(), "as_float() type conversion error from " << raw() << " to float");
+		return static_cast<float>(std::strtod(raw().c_str(), nullptr));
+	}
+
+	bool lazy_value::as_bool() const
+	{
+		if(is_bool()) {
+			return first_char() == 't';
+		} else if(is_numeric()) {
+			return as_float() != 0.0f;
+		}
+		return num_elements() != 0;
+	}
+
+	variant lazy_value::as_variant() const
+	{
+		if(doc_ == nullptr || is_null()) {
+			return variant();
+		} else if(index_ >= 0) {
+			return parse(raw());
+		} else if(is_string()) {
+			return variant(as_string());
+		} else if(is_bool()) {
+			return variant::from_bool(as_bool());
+		} else if(is_numeric()) {
+			if(raw().find_first_of(".eE") != std::string::npos) {
+				return variant(as_float());
+			}
+			return variant(as_int());
+		}
+		// bare literal, the full parser treats these as strings.
+		return variant(raw());
+	}
+
+	std::unique_ptr<lazy_document> parse_lazy(const std::string& s)
+	{
+		return std::unique_ptr<lazy_document>(new lazy_document(s));
+	}
+
+	std::unique_ptr<lazy_document> parse_lazy_from_file(const std::string& fname)
+	{
+		if(sys::file_exists(fname)) {
+			return parse_lazy(sys::read_file(fname));
+		} else {
+			throw parse_error(formatter() << "File \"" <<  fname << "\" doesn't exist");
+		}
+	}
+}
+
+UNIT_TEST(lazy_json_matches_parse)
+{
+	const std::string text = "{\"a\": 1, \"list\": [1, 2.5, \"x\\\"y\", true, null, {\"b\": [3]}], \"s\": \"q\\u0041\", \"a\": 3, \"n\": {\"deep\": {\"k\": -7}}}";
+	const auto doc = json::parse_lazy(text);
+	const auto root = doc->root();
+	CHECK(root.is_map(), "");
+	// a repeated key keeps the last value, as json::parse does.
+	CHECK_EQ(root.num_elements(), 4);
+	CHECK_EQ(root["a"].as_int(), 3);
+	CHECK(!root["missing"].is_valid(), "");
+	const auto list = root["list"];
+	CHECK(list.is_list(), "");
+	CHECK_EQ(list.num_elements(), 6);
+	CHECK_EQ(list[1].as_float(), 2.5f);
+	CHECK_EQ(list[2].as_string(), "x\"y");
+	CHECK(list[3].as_bool() && list[4].is_null(), "");
+	CHECK_EQ(list[5]["b"][0].as_int(), 3);
+	CHECK_EQ(root["s"].as_string(), "qA");
+	CHECK_EQ(root["n"]["deep"]["k"].as_int(), -7);
+	CHECK(root.as_variant() == json::parse(text), "as_variant() differs from json::parse");
+	CHECK(list.as_variant() == json::parse(list.raw()), "");
+
+	for(const char* bad : { "{\"a\":1} garbage", "{}{}", "[1] ]", "{\"a\": [1}", "\"a\"", "{\"a\": \"open}" }) {
+		bool threw = false;
+		try {
+			json::parse_lazy(bad);
+		} catch(json::parse_error&) {
+			threw = true;
+		}
+		CHECK(threw, "parsed " << bad);
+	}
+	CHECK_EQ(json::parse_lazy("  [1, 2]\n")->root().num_elements(), 2);
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "json.hpp"
+
+namespace json
+{
+	class lazy_document;
+
+	// Handle to a value inside a lazy_document. Objects and arrays only have their immediate
+	// members split out the first time they are accessed, scalars are only decoded when one
+	// of the as_*() functions is called. Handles are cheap to copy and stay valid for as long
+	// as the owning document does.
+	class lazy_value
+	{
+	public:
+		lazy_value() : doc_(nullptr), begin_(0), end_(0), index_(-1) {}
+
+		bool is_valid() const { return doc_ != nullptr; }
+		bool is_null() const;
+		bool is_bool() const;
+		bool is_numeric() const;
+		bool is_string() const;
+		bool is_map() const;
+		bool is_list() const;
+
+		int num_elements() const;
+		bool has_key(const std::string& key) const;
+		std::vector<std::string> keys() const;
+
+		// Returns an invalid value if the key/index doesn't exist.
+		lazy_value operator[](const std::string& key) const;
+		lazy_value operator[](size_t n) const;
+
+		std::string as_string() const;
+		int64_t as_int() const;
+		float as_float() const;
+		bool as_bool() const;
+
+		// Fully parses this value (and everything beneath it) into a variant.
+		variant as_variant() const;
+		// The raw JSON text making up this value.
+		std::string raw() const;
+	private:
+		friend class lazy_document;
+		lazy_value(const lazy_document* doc, size_t begin, size_t end, int index)
+			: doc_(doc), begin_(begin), end_(end), index_(index) {}
+		char first_char() const;
+
+		const lazy_document* doc_;
+		// Extent of the value in the document text.
+		size_t begin_;
+		size_t end_;
+		// Position of the opening bracket/brace in the structural index or -1 for scalars.
+		int index_;
+	};
+
+	// Keeps the raw JSON text along with a structural index (the positions of all brackets,
+	// braces, colons and commas which aren't inside strings and where each bracket closes).
+	// Building the index is a single linear pass over the text; nothing is converted until
+	// it is asked for. Not thread-safe, since accessing a container caches its members.
+	class lazy_document
+	{
+	public:
+		explicit lazy_document(const std::string& text);
+		lazy_value root() const;
+		const std::string& text() const { return text_; }
+	private:
+		lazy_document(const lazy_document&);
+		void operator=(const lazy_document&);
+
+		friend class lazy_value;
+		struct members
+		{
+			std::vector<lazy_value> values;
+			std::map<std::string, size_t> keys;
+			std::vector<std::string> key_order;
+		};
+		const members& get_members(int index) const;
+		lazy_value make_value(size_t begin, size_t end) const;
+
+		std::string text_;
+		std::vector<size_t> structural_;
+		std::vector<int> match_;
+		mutable std::map<int, std::unique_ptr<members>> cache_;
+	};
+
+	std::unique_ptr<lazy_document> parse_lazy(const std::string& s);
+	std::unique_ptr<lazy_document> parse_lazy_from_file(const std::string& fname);
+}
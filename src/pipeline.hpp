@@ -0,0 +1,215 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace pipeline
+{
+	typedef std::chrono::steady_clock clock;
+
+	inline double seconds_since(const clock::time_point& start)
+	{
+		return std::chrono::duration<double>(clock::now() - start).count();
+	}
+
+	struct queue_stats
+	{
+		queue_stats() : name(), capacity(0), items(0), max_occupancy(0), occupancy_sum(0), push_wait(0), pop_wait(0) {}
+		double mean_occupancy() const { return items != 0 ? occupancy_sum / items : 0.0; }
+
+		std::string name;
+		size_t capacity;
+		size_t items;
+		size_t max_occupancy;
+		// occupancy is sampled every time an item is pushed.
+		double occupancy_sum;
+		// time producers spent blocked on a full queue and consumers on an empty one.
+		double push_wait;
+		double pop_wait;
+	};
+
+	// Fixed capacity FIFO connecting two stages. push() blocks while the queue is full and
+	// pop() blocks while it is empty. Each producer calls close() when it has finished,
+	// once all of them have, pop() returns false after the queue drains.
+	template<typename T>
+	class bounded_queue
+	{
+	public:
+		bounded_queue(const std::string& name, size_t capacity, int producers=1)
+			: items_(),
+			  producers_(producers)
+		{
+			stats_.name = name;
+			stats_.capacity = capacity;
+		}
+
+		void push(T value)
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			if(items_.size() >= stats_.capacity) {
+				const auto start = clock::now();
+				not_full_.wait(lock, [this]() { return items_.size() < stats_.capacity; });
+				stats_.push_wait += seconds_since(start);
+			}
+			items_.emplace_back(std::move(value));
+			++stats_.items;
+			stats_.occupancy_sum += items_.size();
+			if(items_.size() > stats_.max_occupancy) {
+				stats_.max_occupancy = items_.size();
+			}
+			not_empty_.notify_one();
+		}
+
+		bool pop(T& value)
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			if(items_.empty() && producers_ > 0) {
+				const auto start = clock::now();
+				not_empty_.wait(lock, [this]() { return !items_.empty() || producers_ == 0; });
+				stats_.pop_wait += seconds_since(start);
+			}
+			if(items_.empty()) {
+				return false;
+			}
+			value = std::move(items_.front());
+			items_.pop_front();
+			not_full_.notify_one();
+			return true;
+		}
+
+		void close()
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if(--producers_ <= 0) {
+				not_empty_.notify_all();
+			}
+		}
+
+		queue_stats stats() const
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			return stats_;
+		}
+	private:
+		bounded_queue(const bounded_queue&);
+		void operator=(const bounded_queue&);
+
+		mutable std::mutex mutex_;
+		std::condition_variable not_full_;
+		std::condition_variable not_empty_;
+		std::deque<T> items_;
+		int producers_;
+		queue_stats stats_;
+	};
+
+	// Items handed on by parallel workers arrive out of order, this puts them back in
+	// sequence for a stage which needs to see them in source order.
+	template<typename T>
+	class reorder_buffer
+	{
+	public:
+		reorder_buffer() : next_(0), pending_() {}
+		void put(size_t seq, T value) { pending_[seq] = std::move(value); }
+		bool next(T& value)
+		{
+			auto it = pending_.find(next_);
+			if(it == pending_.end()) {
+				return false;
+			}
+			value = std::move(it->second);
+			pending_.erase(it);
+			++next_;
+			return true;
+		}
+		bool empty() const { return pending_.empty(); }
+	private:
+		size_t next_;
+		std::map<size_t, T> pending_;
+	};
+
+	// Holds each of a fixed number of threads in wait() until all of them have called it,
+	// then lets them all go on. It can be waited on again straight away.
+	class barrier
+	{
+	public:
+		explicit barrier(int threads) : threads_(threads), waiting_(0), generation_(0) {}
+
+		void wait()
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			const size_t generation = generation_;
+			if(++waiting_ >= threads_) {
+				waiting_ = 0;
+				++generation_;
+				all_arrived_.notify_all();
+				return;
+			}
+			all_arrived_.wait(lock, [this, generation]() { return generation_ != generation; });
+		}
+	private:
+		barrier(const barrier&);
+		void operator=(const barrier&);
+
+		std::mutex mutex_;
+		std::condition_variable all_arrived_;
+		int threads_;
+		int waiting_;
+		size_t generation_;
+	};
+
+	struct stage_stats
+	{
+		stage_stats() : name(), threads(0), items(0), busy(0) {}
+		std::string name;
+		int threads;
+		size_t items;
+		// time spent doing work, summed over the stage's threads. Excludes queue waits.
+		double busy;
+	};
+
+	class stage
+	{
+	public:
+		stage(const std::string& name, int threads)
+		{
+			stats_.name = name;
+			stats_.threads = threads;
+		}
+		void add(double busy, size_t items=1)
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			stats_.busy += busy;
+			stats_.items += items;
+		}
+		stage_stats stats() const
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			return stats_;
+		}
+	private:
+		mutable std::mutex mutex_;
+		stage_stats stats_;
+	};
+
+	inline void report(std::ostream& os, const std::vector<stage_stats>& stages, const std::vector<queue_stats>& queues, double wall)
+	{
+		os << std::fixed << std::setprecision(3);
+		os << "pipeline finished in " << wall << "s\n";
+		os << std::left << std::setw(20) << "stage" << std::right << std::setw(8) << "threads" << std::setw(10) << "items" << std::setw(12) << "busy(s)" << std::setw(12) << "util" << "\n";
+		for(const auto& s : stages) {
+			const double util = wall > 0 && s.threads > 0 ? s.busy / (wall * s.threads) : 0.0;
+			os << std::left << std::setw(20) << s.name << std::right << std::setw(8) << s.threads << std::setw(10) << s.items << std::setw(12) << s.busy << std::setw(11) << (util * 100.0) << "%\n";
+		}
+		os << std::left << std::setw(20) << "queue" << std::right << std::setw(8) << "cap" << std::setw(10) << "items" << std::setw(8) << "max" << std::setw(10) << "mean" << std::setw(14) << "push wait(s)" << std::setw(14) << "pop wait(s)" << "\n";
+		for(const auto& q : queues) {
+			os << std::left << std::setw(20) << q.name << std::right << std::setw(8) << q.capacity << std::setw(10) << q.items << std::setw(8) << q.max_occupancy << std::setw(10) << q.mean_occupancy() << std::setw(14) << q.push_wait << std::setw(14) << q.pop_wait << "\n";
+		}
+	}
+}
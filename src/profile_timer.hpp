@@ -23,44 +23,44 @@
 
 #pragma once
 
+#include <chrono>
 #include <iostream>
 #include <string>
-#include "SDL.h"
 
 namespace profile 
 {
+	typedef std::chrono::steady_clock clock;
+
 	struct manager
 	{
-		Uint64 frequency;
-		Uint64 t1, t2;
+		clock::time_point t1, t2;
 		double elapsedTime;
 		const char* name;
 
 		manager(const char* const str) : name(str)
 		{
-			frequency = SDL_GetPerformanceFrequency();
-			t1 = SDL_GetPerformanceCounter();
+			t1 = clock::now();
 		}
 
 		~manager()
 		{
-			t2 = SDL_GetPerformanceCounter();
-			elapsedTime = (t2 - t1) * 1000.0 / frequency;
+			t2 = clock::now();
+			elapsedTime = std::chrono::duration<double, std::milli>(t2 - t1).count();
 			std::cerr << name << ": " << elapsedTime << " milliseconds" << std::endl;
 		}
 	};
 
 	struct timer
 	{
-		Uint64 frequency;
-		Uint64 t1, t2;
-		timer()			{ frequency = SDL_GetPerformanceFrequency(); }
-		void start()	{ t1 = SDL_GetPerformanceCounter(); }
-		double check()	{ t2 = SDL_GetPerformanceCounter(); return (t2 - t1) / double(frequency); }
+		clock::time_point t1, t2;
+		timer()			{}
+		void start()	{ t1 = clock::now(); }
+		double check()	{ t2 = clock::now(); return std::chrono::duration<double>(t2 - t1).count(); }
 	};
 
     inline int get_tick_time()
     {
-        return static_cast<int>(SDL_GetTicks());
+        static const clock::time_point start_time = clock::now();
+        return static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(clock::now() - start_time).count());
     }
 }
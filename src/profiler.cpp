@@ -0,0 +1,301 @@
+#include "profiler.hpp"
+
+#ifdef ENABLE_PROFILING
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "filesystem.hpp"
+#include "json.hpp"
+#include "unit_test.hpp"
+#include "variant.hpp"
+#include "variant_utils.hpp"
+
+namespace profile
+{
+	std::atomic<bool> recording(false);
+
+	namespace
+	{
+		typedef std::chrono::steady_clock clock;
+
+		int64_t now_ns()
+		{
+			static const clock::time_point epoch = clock::now();
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - epoch).count();
+		}
+
+		struct event
+		{
+			const char* name;
+			const char* category;
+			int64_t start;
+			int64_t duration;
+			int ncounters;
+			zone_counter counters[max_zone_counters];
+		};
+
+		// Events are appended to a chain of fixed size blocks. Only the owning thread
+		// writes, it publishes each event by bumping count and each new block through
+		// next, so an exporter can walk the chain while the owner is still recording.
+		struct event_block
+		{
+			static const size_t capacity = 4096;
+			event_block() : count(0), next(nullptr) {}
+			event events[capacity];
+			std::atomic<size_t> count;
+			std::atomic<event_block*> next;
+		};
+
+		struct thread_buffer
+		{
+			explicit thread_buffer(int id) : tid(id), name(nullptr), head(new event_block), tail(head), current(nullptr) {}
+			int tid;
+			std::atomic<const char*> name;
+			event_block* head;
+			event_block* tail;
+			// innermost open zone.
+			zone* current;
+		};
+
+		// Buffers are never freed, so the events of threads which have finished can still
+		// be exported.
+		struct registry
+		{
+			std::mutex mutex;
+			std::vector<thread_buffer*> buffers;
+			std::unordered_set<std::string> names;
+		};
+
+		registry& get_registry()
+		{
+			static registry* res = new registry;
+			return *res;
+		}
+
+		thread_local thread_buffer* this_thread_buffer = nullptr;
+
+		thread_buffer& get_thread_buffer()
+		{
+			if(this_thread_buffer == nullptr) {
+				auto& reg = get_registry();
+				std::lock_guard<std::mutex> lock(reg.mutex);
+				this_thread_buffer = new thread_buffer(static_cast<int>(reg.buffers.size()) + 1);
+				reg.buffers.emplace_back(this_thread_buffer);
+			}
+			return *this_thread_buffer;
+		}
+
+		void record(thread_buffer& buf, const event& e)
+		{
+			event_block* block = buf.tail;
+			size_t n = block->count.load(std::memory_order_relaxed);
+			if(n == event_block::capacity) {
+				block = new event_block;
+				buf.tail->next.store(block, std::memory_order_release);
+				buf.tail = block;
+				n = 0;
+			}
+			block->events[n] = e;
+			block->count.store(n + 1, std::memory_order_release);
+		}
+	}
+
+	void set_recording(bool on)
+	{
+		recording.store(on, std::memory_order_relaxed);
+	}
+
+	zone::zone(const char* name, const char* category)
+		: name_(name),
+		  category_(category),
+		  start_(0),
+		  parent_(nullptr),
+		  ncounters_(0)
+	{
+		if(name_ == nullptr) {
+			return;
+		}
+		start_ = now_ns();
+		auto& buf = get_thread_buffer();
+		parent_ = buf.current;
+		buf.current = this;
+	}
+
+	zone::~zone()
+	{
+		if(name_ == nullptr) {
+			return;
+		}
+		event e;
+		e.name = name_;
+		e.category = category_;
+		e.start = start_;
+		e.duration = now_ns() - start_;
+		e.ncounters = ncounters_;
+		std::copy(counters_, counters_ + ncounters_, e.counters);
+		auto& buf = get_thread_buffer();
+		record(buf, e);
+		buf.current = parent_;
+	}
+
+	void zone::add_counter(const char* name, int64_t value)
+	{
+		for(int n = 0; n != ncounters_; ++n) {
+			if(counters_[n].name == name) {
+				counters_[n].value += value;
+				return;
+			}
+		}
+		if(ncounters_ != max_zone_counters) {
+			counters_[ncounters_].name = name;
+			counters_[ncounters_].value = value;
+			++ncounters_;
+		}
+	}
+
+	const char* intern(const std::string& s)
+	{
+		// most lookups are satisfied without touching the shared table.
+		thread_local std::unordered_map<std::string, const char*> local;
+		auto it = local.find(s);
+		if(it != local.end()) {
+			return it->second;
+		}
+		auto& reg = get_registry();
+		std::lock_guard<std::mutex> lock(reg.mutex);
+		const char* res = reg.names.insert(s).first->c_str();
+		local[s] = res;
+		return res;
+	}
+
+	void set_thread_name(const char* name)
+	{
+		get_thread_buffer().name.store(name, std::memory_order_release);
+	}
+
+	void add_counter(const char* name, int64_t value)
+	{
+		auto& buf = get_thread_buffer();
+		if(buf.current != nullptr) {
+			buf.current->add_counter(name, value);
+		}
+	}
+
+	void write_chrome_trace(std::ostream& os)
+	{
+		std::vector<thread_buffer*> buffers;
+		{
+			auto& reg = get_registry();
+			std::lock_guard<std::mutex> lock(reg.mutex);
+			buffers = reg.buffers;
+		}
+
+		std::vector<variant> events;
+		for(auto buf : buffers) {
+			const char* thread_name = buf->name.load(std::memory_order_acquire);
+			if(thread_name != nullptr) {
+				variant_builder args;
+				args.add("name", std::string(thread_name));
+				variant_builder meta;
+				meta.add("name", std::string("thread_name"));
+				meta.add("ph", std::string("M"));
+				meta.add("pid", 1);
+				meta.add("tid", buf->tid);
+				meta.add("args", args.build());
+				events.emplace_back(meta.build());
+			}
+			for(auto block = buf->head; block != nullptr; block = block->next.load(std::memory_order_acquire)) {
+				const size_t count = block->count.load(std::memory_order_acquire);
+				for(size_t n = 0; n != count; ++n) {
+					const event& e = block->events[n];
+					variant_builder vb;
+					vb.add("name", std::string(e.name));
+					if(e.category != nullptr) {
+						vb.add("cat", std::string(e.category));
+					}
+					vb.add("ph", std::string("X"));
+					vb.add("pid", 1);
+					vb.add("tid", buf->tid);
+					// the trace format wants microseconds.
+					vb.add("ts", e.start / 1000);
+					vb.add("dur", e.duration / 1000);
+					if(e.ncounters != 0) {
+						variant_builder args;
+						for(int c = 0; c != e.ncounters; ++c) {
+							args.add(e.counters[c].name, e.counters[c].value);
+						}
+						vb.add("args", args.build());
+					}
+					events.emplace_back(vb.build());
+				}
+			}
+		}
+
+		variant_builder res;
+		res.add("traceEvents", variant(&events));
+		res.add("displayTimeUnit", std::string("ms"));
+		res.build().write_json(os, false);
+	}
+
+	void write_chrome_trace(const std::string& filename)
+	{
+		sys::file_sink sink(filename);
+		write_chrome_trace(sink.stream());
+		sink.commit();
+	}
+}
+
+UNIT_TEST(profiler_chrome_trace_export)
+{
+	// on a thread of its own, so the events are easy to pick out of everything else
+	// recorded while the test runs.
+	const bool was_recording = profile::is_recording();
+	profile::set_recording(true);
+	std::thread([]() {
+		PROFILE_THREAD_NAME("profiler test");
+		PROFILE_ZONE("profiler test outer");
+		PROFILE_COUNTER("bytes", 100);
+		PROFILE_COUNTER("bytes", 23);
+		{
+			PROFILE_ZONE_CAT("test", profile::intern("profiler test " + std::to_string(1)));
+			std::this_thread::sleep_for(std::chrono::milliseconds(2));
+		}
+		profile::set_recording(false);
+		PROFILE_ZONE("profiler test not recorded");
+	}).join();
+	profile::set_recording(was_recording);
+
+	std::ostringstream ss;
+	profile::write_chrome_trace(ss);
+	const variant trace = json::parse(ss.str());
+	std::map<std::string, variant> events;
+	variant thread_name;
+	for(const auto& e : trace["traceEvents"].as_list()) {
+		const std::string name = e["name"].as_string();
+		if(name.compare(0, 13, "profiler test") == 0) {
+			events[name] = e;
+		} else if(name == "thread_name" && e["args"]["name"].as_string() == "profiler test") {
+			thread_name = e;
+		}
+	}
+	CHECK_EQ(events.size(), 2);
+	const variant& outer = events["profiler test outer"];
+	const variant& inner = events["profiler test 1"];
+	CHECK(outer["ph"].as_string() == "X" && inner["cat"].as_string() == "test", "");
+	CHECK(!outer.has_key("cat"), "a zone without a category shouldn't have one in the trace");
+	CHECK_EQ(outer["args"]["bytes"].as_int(), 123);
+	CHECK(outer["tid"] == inner["tid"] && thread_name["tid"] == outer["tid"], "the events aren't all on the test's thread");
+	CHECK_GE(inner["dur"].as_int(), 2000);
+	// times are truncated to microseconds, so the ends can be one out.
+	CHECK(inner["ts"].as_int() >= outer["ts"].as_int() && inner["ts"].as_int() + inner["dur"].as_int() <= outer["ts"].as_int() + outer["dur"].as_int() + 1, "the inner zone isn't inside the outer one");
+}
+
+#endif
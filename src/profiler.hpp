@@ -0,0 +1,95 @@
+#pragma once
+
+// Hierarchical scoped profiler. Code is instrumented with the PROFILE_* macros, which
+// expand to nothing unless ENABLE_PROFILING is defined.
+//
+//   PROFILE_ZONE("parse wml");                       times the rest of the enclosing scope
+//   PROFILE_ZONE_CAT("macro", profile::intern(name)); as above, with a category and a name
+//                                                     only known at run time
+//   PROFILE_COUNTER("bytes", n);                     adds n to a counter on the innermost
+//                                                     open zone of the calling thread
+//   PROFILE_THREAD_NAME("convert");                  names the calling thread in the trace
+//
+// Nothing is recorded until set_recording(true) is called, i.e. by --trace. Until then a
+// zone is a flag test, and the name of a PROFILE_ZONE_CAT isn't even evaluated, so an
+// ordinary run neither pays for the interning nor keeps events it will never write.
+//
+// Zones nest, and each one is recorded by the thread which opened it into a buffer only
+// that thread writes to, so recording never takes a lock. write_chrome_trace() exports
+// everything recorded so far in the Chrome trace event format, which can be loaded into
+// chrome://tracing or Perfetto.
+
+#ifdef ENABLE_PROFILING
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+namespace profile
+{
+	struct zone_counter
+	{
+		const char* name;
+		int64_t value;
+	};
+
+	const int max_zone_counters = 4;
+
+	extern std::atomic<bool> recording;
+
+	inline bool is_recording()
+	{
+		return recording.load(std::memory_order_relaxed);
+	}
+
+	// Turns recording on or off for every thread, zones already open when it's turned on
+	// aren't recorded.
+	void set_recording(bool on);
+
+	class zone
+	{
+	public:
+		// name and category must outlive the profiler, i.e. be literals or from intern().
+		// A zone with no name records nothing.
+		explicit zone(const char* name, const char* category=nullptr);
+		~zone();
+		// Counters beyond max_zone_counters are dropped.
+		void add_counter(const char* name, int64_t value);
+	private:
+		zone(const zone&);
+		void operator=(const zone&);
+
+		const char* name_;
+		const char* category_;
+		int64_t start_;
+		zone* parent_;
+		int ncounters_;
+		zone_counter counters_[max_zone_counters];
+	};
+
+	// Returns a copy of s which lives for the rest of the program, for names which
+	// aren't literals.
+	const char* intern(const std::string& s);
+	void set_thread_name(const char* name);
+	void add_counter(const char* name, int64_t value);
+
+	void write_chrome_trace(std::ostream& os);
+	void write_chrome_trace(const std::string& filename);
+}
+
+#define PROFILE_CONCAT_IMPL(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_IMPL(a, b)
+#define PROFILE_ZONE(name) profile::zone PROFILE_CONCAT(profile_zone_, __LINE__)(profile::is_recording() ? (name) : nullptr)
+#define PROFILE_ZONE_CAT(category, name) profile::zone PROFILE_CONCAT(profile_zone_, __LINE__)(profile::is_recording() ? (name) : nullptr, category)
+#define PROFILE_COUNTER(name, value) do { if(profile::is_recording()) { profile::add_counter(name, value); } } while(0)
+#define PROFILE_THREAD_NAME(name) do { if(profile::is_recording()) { profile::set_thread_name(name); } } while(0)
+
+#else
+
+#define PROFILE_ZONE(name) do {} while(0)
+#define PROFILE_ZONE_CAT(category, name) do {} while(0)
+#define PROFILE_COUNTER(name, value) do {} while(0)
+#define PROFILE_THREAD_NAME(name) do {} while(0)
+
+#endif
@@ -0,0 +1,341 @@
+#include <algorithm>
+#include <iterator>
+#include <limits>
+#include <thread>
+
+#include "asserts.hpp"
+#include "profiler.hpp"
+#include "rule_index.hpp"
+#include "terrain_parser.hpp"
+#include "unit_test.hpp"
+
+namespace terrain
+{
+	namespace
+	{
+		// Calls fn on each element of v, whether v is a single map or a list of them, as
+		// variant_builder leaves repeated tags.
+		template<typename Fn>
+		void for_each_tag(const variant& v, Fn fn)
+		{
+			if(v.is_list()) {
+				for(const auto& e : v.as_list()) {
+					fn(e);
+				}
+			} else if(v.is_map()) {
+				fn(v);
+			}
+		}
+
+		// Whether some code with this layer could match p, looking at one layer only.
+		bool could_match_base(const type_pattern& p, layer_code base)
+		{
+			if(p.otherwise) {
+				return true;
+			}
+			for(const auto& item : p.items) {
+				if(!item.negate && (base & item.mask.base) == item.code.base) {
+					return true;
+				}
+			}
+			return false;
+		}
+
+		bool could_match_overlay(const type_pattern& p, layer_code overlay)
+		{
+			if(p.otherwise) {
+				return true;
+			}
+			for(const auto& item : p.items) {
+				if(!item.negate && (overlay & item.mask.overlay) == item.code.overlay) {
+					return true;
+				}
+			}
+			return false;
+		}
+
+		// The rows of one layer from per thread lists, joined in thread order.
+		void join_lists(const std::vector<std::vector<std::vector<uint32_t>>>& results, size_t layer_count, std::vector<uint32_t>& offsets, std::vector<uint32_t>& rules)
+		{
+			offsets.assign(layer_count + 1, 0);
+			for(size_t l = 0; l != layer_count; ++l) {
+				size_t count = 0;
+				for(const auto& lists : results) {
+					count += lists[l].size();
+				}
+				offsets[l + 1] = offsets[l] + static_cast<uint32_t>(count);
+			}
+			rules.clear();
+			rules.reserve(offsets.back());
+			for(size_t l = 0; l != layer_count; ++l) {
+				for(const auto& lists : results) {
+					rules.insert(rules.end(), lists[l].cbegin(), lists[l].cend());
+				}
+			}
+		}
+
+		std::pair<const uint32_t*, const uint32_t*> find_row(const std::vector<layer_code>& layers, const std::vector<uint32_t>& offsets, const std::vector<uint32_t>& rules, layer_code layer)
+		{
+			const auto it = std::lower_bound(layers.cbegin(), layers.cend(), layer);
+			if(it == layers.cend() || *it != layer) {
+				return std::make_pair(nullptr, nullptr);
+			}
+			const size_t n = it - layers.cbegin();
+			return std::make_pair(rules.data() + offsets[n], rules.data() + offsets[n + 1]);
+		}
+
+		std::vector<variant> to_variants(const std::vector<uint32_t>& v)
+		{
+			std::vector<variant> res;
+			res.reserve(v.size());
+			for(auto n : v) {
+				res.emplace_back(static_cast<int64_t>(n));
+			}
+			return res;
+		}
+
+		std::vector<uint32_t> from_variants(const variant& v)
+		{
+			std::vector<uint32_t> res;
+			for(const auto& n : v.as_list()) {
+				res.emplace_back(static_cast<uint32_t>(n.as_int()));
+			}
+			return res;
+		}
+	}
+
+	rule_patterns get_rule_patterns(const variant& rule)
+	{
+		rule_patterns res;
+		for_each_tag(rule["tile"], [&res](const variant& tile) {
+			const variant& match = tile["type_match"];
+			res.tiles.emplace_back(match.is_null() ? compile_pattern("*") : pattern_from_variant(match));
+		});
+		return res;
+	}
+
+	rule_patterns get_rule_patterns(const node& rule)
+	{
+		rule_patterns res;
+		for(node tile = rule.first_child(); tile; tile = tile.next_sibling()) {
+			if(tile.name() != "tile") {
+				continue;
+			}
+			const std::string* type = nullptr;
+			for(const auto& a : tile.attributes()) {
+				if(*a.key == "type") {
+					type = &a.value;
+				}
+			}
+			res.tiles.emplace_back(compile_pattern(type != nullptr ? *type : "*"));
+		}
+		return res;
+	}
+
+	std::vector<terrain_code> get_terrain_codes(const variant& terrain_types)
+	{
+		std::vector<terrain_code> res;
+		for_each_tag(terrain_types["terrain_type"], [&res](const variant& tt) {
+			const variant& s = tt["string"];
+			if(s.is_string()) {
+				res.emplace_back(read_terrain_code(s.as_string()));
+			}
+		});
+		return res;
+	}
+
+	void rule_index::candidates(const terrain_code& c, std::vector<uint32_t>& res) const
+	{
+		res.clear();
+		const auto b = find_row(bases, base_offsets, base_rules, c.base);
+		const auto o = find_row(overlays, overlay_offsets, overlay_rules, c.overlay);
+		std::set_intersection(b.first, b.second, o.first, o.second, std::back_inserter(res));
+	}
+
+	rule_index build_rule_index(std::vector<terrain_code> codes, const std::vector<rule_patterns>& rules, int threads)
+	{
+		PROFILE_ZONE("build rule index");
+		std::vector<layer_code> bases, overlays;
+		for(const auto& c : codes) {
+			bases.emplace_back(c.base);
+			overlays.emplace_back(c.overlay);
+		}
+		// a map hex needn't have an overlay even if every code listed does.
+		overlays.emplace_back(no_layer);
+		std::sort(bases.begin(), bases.end());
+		bases.erase(std::unique(bases.begin(), bases.end()), bases.end());
+		std::sort(overlays.begin(), overlays.end());
+		overlays.erase(std::unique(overlays.begin(), overlays.end()), overlays.end());
+		if(threads <= 0) {
+			threads = std::max<int>(1, std::thread::hardware_concurrency());
+		}
+		const size_t nthreads = std::max<size_t>(1, std::min<size_t>(threads, rules.size()));
+
+		// Each thread takes a contiguous run of rules and lists them per layer, so joining
+		// the lists in thread order keeps the rules of a layer ascending.
+		typedef std::vector<std::vector<uint32_t>> layer_lists;
+		std::vector<layer_lists> base_results(nthreads, layer_lists(bases.size()));
+		std::vector<layer_lists> overlay_results(nthreads, layer_lists(overlays.size()));
+		std::vector<uint32_t> anchors(rules.size(), 0);
+		auto worker = [&bases, &overlays, &rules, &base_results, &overlay_results, &anchors, nthreads](size_t t) {
+			PROFILE_ZONE("index rules");
+			const size_t first = rules.size() * t / nthreads;
+			const size_t last = rules.size() * (t + 1) / nthreads;
+			std::vector<uint32_t> matched_bases, matched_overlays, best_bases, best_overlays;
+			for(size_t r = first; r != last; ++r) {
+				// a rule without tiles is never applied, so isn't listed. Otherwise the
+				// anchor is the tile with the fewest pairs of layers it could match.
+				size_t best = std::numeric_limits<size_t>::max();
+				for(size_t tile = 0; tile != rules[r].tiles.size(); ++tile) {
+					const auto& pattern = rules[r].tiles[tile];
+					matched_bases.clear();
+					matched_overlays.clear();
+					for(size_t l = 0; l != bases.size(); ++l) {
+						if(could_match_base(pattern, bases[l])) {
+							matched_bases.emplace_back(static_cast<uint32_t>(l));
+						}
+					}
+					for(size_t l = 0; l != overlays.size(); ++l) {
+						if(could_match_overlay(pattern, overlays[l])) {
+							matched_overlays.emplace_back(static_cast<uint32_t>(l));
+						}
+					}
+					const size_t pairs = matched_bases.size() * matched_overlays.size();
+					if(pairs < best) {
+						best = pairs;
+						best_bases.swap(matched_bases);
+						best_overlays.swap(matched_overlays);
+						anchors[r] = static_cast<uint32_t>(tile);
+					}
+				}
+				if(best == std::numeric_limits<size_t>::max()) {
+					continue;
+				}
+				for(auto l : best_bases) {
+					base_results[t][l].emplace_back(static_cast<uint32_t>(r));
+				}
+				for(auto l : best_overlays) {
+					overlay_results[t][l].emplace_back(static_cast<uint32_t>(r));
+				}
+			}
+		};
+		std::vector<std::thread> pool;
+		for(size_t t = 1; t < nthreads; ++t) {
+			pool.emplace_back([&worker, t]() {
+				PROFILE_THREAD_NAME("rule index");
+				worker(t);
+			});
+		}
+		worker(0);
+		for(auto& t : pool) {
+			t.join();
+		}
+
+		rule_index res;
+		res.anchors = std::move(anchors);
+		join_lists(base_results, bases.size(), res.base_offsets, res.base_rules);
+		join_lists(overlay_results, overlays.size(), res.overlay_offsets, res.overlay_rules);
+		res.bases = std::move(bases);
+		res.overlays = std::move(overlays);
+		return res;
+	}
+
+	variant index_to_variant(const rule_index& index)
+	{
+		std::vector<variant> anchors = to_variants(index.anchors);
+		std::vector<variant> base_offsets = to_variants(index.base_offsets);
+		std::vector<variant> base_rules = to_variants(index.base_rules);
+		std::vector<variant> overlay_offsets = to_variants(index.overlay_offsets);
+		std::vector<variant> overlay_rules = to_variants(index.overlay_rules);
+		std::vector<variant> bases = to_variants(index.bases);
+		std::vector<variant> overlays = to_variants(index.overlays);
+		std::map<variant, variant> res;
+		res[variant("anchors")] = variant(&anchors);
+		res[variant("base_offsets")] = variant(&base_offsets);
+		res[variant("base_rules")] = variant(&base_rules);
+		res[variant("bases")] = variant(&bases);
+		res[variant("overlay_offsets")] = variant(&overlay_offsets);
+		res[variant("overlay_rules")] = variant(&overlay_rules);
+		res[variant("overlays")] = variant(&overlays);
+		return variant(&res);
+	}
+
+	rule_index index_from_variant(const variant& v)
+	{
+		rule_index res;
+		res.anchors = from_variants(v["anchors"]);
+		res.bases = from_variants(v["bases"]);
+		res.base_offsets = from_variants(v["base_offsets"]);
+		res.base_rules = from_variants(v["base_rules"]);
+		res.overlays = from_variants(v["overlays"]);
+		res.overlay_offsets = from_variants(v["overlay_offsets"]);
+		res.overlay_rules = from_variants(v["overlay_rules"]);
+		ASSERT_LOG(res.base_offsets.size() == res.bases.size() + 1 && res.overlay_offsets.size() == res.overlays.size() + 1, "Malformed rule index.");
+		ASSERT_LOG(res.base_offsets.back() == res.base_rules.size() && res.overlay_offsets.back() == res.overlay_rules.size(),
+			"Rule index offsets don't match the number of rules.");
+		return res;
+	}
+}
+
+UNIT_TEST(rule_index_candidates)
+{
+	using namespace terrain;
+	std::vector<terrain_code> codes;
+	for(const char* s : { "Gg", "Gs", "Ww", "Wo", "Hh", "^Vh", "^Fp" }) {
+		codes.emplace_back(read_terrain_code(s));
+	}
+	std::vector<rule_patterns> rules;
+	for(const auto& tiles : std::vector<std::vector<std::string>>{
+		{ "Gg" },
+		{ "G*" },
+		{ "*^Vh" },
+		{ "*", "Ww" },
+		{},
+		{ "!,Gg" },
+		{ "Gg^Vh,Hh*^*" },
+	}) {
+		rule_patterns rp;
+		for(const auto& t : tiles) {
+			rp.tiles.emplace_back(compile_pattern(t));
+		}
+		rules.emplace_back(rp);
+	}
+
+	const rule_index index = build_rule_index(codes, rules, 1);
+	CHECK_EQ(index.anchors[3], 1);
+	std::vector<terrain_code> hexes;
+	for(const char* s : { "Gg", "Gs", "Ww", "Wo", "Hh", "Gg^Vh", "Gs^Fp", "Hh^Vh", "Wo^Fp" }) {
+		hexes.emplace_back(read_terrain_code(s));
+	}
+	// the same whatever the threads, and after the JSON round trip.
+	const rule_index three = build_rule_index(codes, rules, 3);
+	const rule_index copy = index_from_variant(index_to_variant(index));
+	std::vector<uint32_t> res, other;
+	for(const auto& c : hexes) {
+		index.candidates(c, res);
+		CHECK(std::is_sorted(res.begin(), res.end()), "candidates should be ascending");
+		// every rule whose anchor matches is a candidate, and a rule without tiles never is.
+		for(uint32_t r = 0; r != rules.size(); ++r) {
+			const bool listed = std::find(res.begin(), res.end(), r) != res.end();
+			if(rules[r].tiles.empty()) {
+				CHECK(!listed, "rule " << r << " has no tiles but is listed for " << write_terrain_code(c));
+			} else if(rules[r].tiles[index.anchors[r]].matches(c)) {
+				CHECK(listed, "rule " << r << " is missing for " << write_terrain_code(c));
+			}
+		}
+		three.candidates(c, other);
+		CHECK(other == res, "the index differs with 3 threads for " << write_terrain_code(c));
+		copy.candidates(c, other);
+		CHECK(other == res, "the index differs after the round trip for " << write_terrain_code(c));
+	}
+	index.candidates(read_terrain_code("Gg^Vh"), res);
+	CHECK(std::find(res.begin(), res.end(), 0) == res.end(), "Gg can't match a hex with an overlay");
+	CHECK(std::find(res.begin(), res.end(), 2) != res.end() && std::find(res.begin(), res.end(), 6) != res.end(), "");
+	index.candidates(read_terrain_code("Ww"), res);
+	CHECK(res == std::vector<uint32_t>({ 3, 5 }), "");
+	// layers terrain.cfg doesn't list get nothing.
+	index.candidates(read_terrain_code("Xx"), res);
+	CHECK(res.empty(), "");
+	index.candidates(read_terrain_code("Gg^Xx"), res);
+	CHECK(res.empty(), "");
+}
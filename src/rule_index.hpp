@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "terrain_pattern.hpp"
+#include "variant.hpp"
+
+class node;
+
+// Index from the terrain layers in terrain.cfg to the [terrain_graphics] rules which could
+// apply to a hex of that terrain, so rules don't all have to be tried on every hex.
+namespace terrain
+{
+	// The type patterns of the tiles in a rule, in the order of its [tile] tags. A tile
+	// without a type matches any terrain.
+	struct rule_patterns
+	{
+		rule_patterns() : tiles() {}
+		std::vector<type_pattern> tiles;
+	};
+
+	// From a converted rule, read back from the type_match of each [tile].
+	rule_patterns get_rule_patterns(const variant& rule);
+	// The same, from the parsed rule before conversion.
+	rule_patterns get_rule_patterns(const node& rule);
+	// The codes of the [terrain_type] tags in converted terrain.cfg.
+	std::vector<terrain_code> get_terrain_codes(const variant& terrain_types);
+
+	// A map hex carries a base and an overlay, like Gg^Vh, while terrain.cfg lists most
+	// overlays on their own (^Vh), so the index resolves the two layers separately rather
+	// than listing every combination. Compressed rows: the rules whose anchor tile could
+	// match base bases[n] are base_rules[base_offsets[n]] up to base_rules[base_offsets[n+1]],
+	// in ascending order, and the same for overlays, where no_layer stands for no overlay.
+	// bases and overlays are the sorted layers of the codes in terrain.cfg.
+	//
+	// A rule can only apply where all of its tiles match, so as in Wesnoth's terrain
+	// builder each rule is indexed by one anchor tile, the one matching the fewest layers.
+	// anchors[r] is the position of that tile in rule r.
+	struct rule_index
+	{
+		rule_index() : bases(), base_offsets(1, 0), base_rules(), overlays(), overlay_offsets(1, 0), overlay_rules(), anchors() {}
+		// Sets res to the rules listed for both layers of c, ascending. A rule is listed
+		// for a layer if any item of its anchor's pattern could match it, so this is a
+		// superset of the rules whose anchor matches c and callers still test the anchor
+		// tile. A code with a layer not in terrain.cfg gets no rules.
+		void candidates(const terrain_code& c, std::vector<uint32_t>& res) const;
+		std::vector<layer_code> bases;
+		std::vector<uint32_t> base_offsets;
+		std::vector<uint32_t> base_rules;
+		std::vector<layer_code> overlays;
+		std::vector<uint32_t> overlay_offsets;
+		std::vector<uint32_t> overlay_rules;
+		std::vector<uint32_t> anchors;
+	};
+
+	// The rules are split between the threads, threads == 0 means use
+	// std::thread::hardware_concurrency().
+	rule_index build_rule_index(std::vector<terrain_code> codes, const std::vector<rule_patterns>& rules, int threads=0);
+
+	// Written next to the rules as
+	//   {"anchors": [...], "base_offsets": [...], "base_rules": [...], "bases": [...],
+	//    "overlay_offsets": [...], "overlay_rules": [...], "overlays": [...]}
+	variant index_to_variant(const rule_index& index);
+	rule_index index_from_variant(const variant& v);
+}
@@ -0,0 +1,460 @@
+#include <algorithm>
+#include <cctype>
+#include <limits>
+#include <sstream>
+
+#include "asserts.hpp"
+#include "attribute_schema.hpp"
+#include "image_path.hpp"
+#include "json.hpp"
+#include "struct_gen.hpp"
+#include "terrain_parser.hpp"
+#include "unit_test.hpp"
+
+namespace codegen
+{
+	namespace
+	{
+		// along with the decoder's parameter names.
+		const char* const cpp_keywords[] = {
+			"alignas", "alignof", "and", "asm", "auto", "bool", "break", "case", "catch", "char",
+			"class", "const", "constexpr", "continue", "default", "delete", "do", "double", "else",
+			"enum", "explicit", "export", "extern", "false", "float", "for", "friend", "goto", "if",
+			"inline", "int", "long", "mutable", "namespace", "new", "noexcept", "not", "nullptr",
+			"operator", "or", "private", "protected", "public", "register", "return", "short",
+			"signed", "sizeof", "static", "struct", "switch", "template", "this", "throw", "true",
+			"try", "typedef", "typeid", "typename", "union", "unsigned", "using", "virtual", "void",
+			"volatile", "while", "xor", "out", "v", "std", "variant",
+		};
+
+		bool is_ident_char(char c)
+		{
+			return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+		}
+
+		// "animation-frames" -> "AnimationFrames"
+		std::string camel_case(const std::string& s)
+		{
+			std::string res;
+			bool upper = true;
+			for(auto c : s) {
+				if(!std::isalnum(static_cast<unsigned char>(c))) {
+					upper = true;
+					continue;
+				}
+				res += upper ? static_cast<char>(std::toupper(static_cast<unsigned char>(c))) : c;
+				upper = false;
+			}
+			if(res.empty() || std::isdigit(static_cast<unsigned char>(res[0]))) {
+				res = "S" + res;
+			}
+			return res;
+		}
+
+		// "TerrainGraphics" -> "terrain_graphics"
+		std::string snake_case(const std::string& s)
+		{
+			std::string res;
+			for(auto c : s) {
+				if(std::isupper(static_cast<unsigned char>(c))) {
+					if(!res.empty()) {
+						res += '_';
+					}
+					res += static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+				} else {
+					res += c;
+				}
+			}
+			return res;
+		}
+
+		// A field name for key which isn't a keyword, a struct or another field of the same struct.
+		std::string field_name(const std::string& key, const std::set<std::string>& taken)
+		{
+			std::string res;
+			for(auto c : key) {
+				res += is_ident_char(c) ? c : '_';
+			}
+			if(res.empty() || std::isdigit(static_cast<unsigned char>(res[0]))) {
+				res = "_" + res;
+			}
+			while(taken.count(res) || std::find(std::begin(cpp_keywords), std::end(cpp_keywords), res) != std::end(cpp_keywords)) {
+				res += '_';
+			}
+			return res;
+		}
+
+		std::string quote(const std::string& s)
+		{
+			std::string res = "\"";
+			for(auto c : s) {
+				if(c == '"' || c == '\\') {
+					res += '\\';
+				}
+				res += c;
+			}
+			return res + "\"";
+		}
+
+		// The decoders the generated ones are built from.
+		const char* const field_decoders =
+			"\t\tvoid decode_field(const variant& v, bool& out) { out = v.as_bool(); }\n"
+			"\t\tvoid decode_field(const variant& v, int& out) { out = v.as_int32(); }\n"
+			"\t\tvoid decode_field(const variant& v, int64_t& out) { out = v.as_int(); }\n"
+			"\t\tvoid decode_field(const variant& v, float& out) { out = v.as_float(); }\n"
+			"\t\tvoid decode_field(const variant& v, std::string& out) { out = v.as_string(); }\n"
+			"\t\tvoid decode_field(const variant& v, variant& out) { out = v; }\n"
+			"\t\tvoid decode_field(const variant& v, std::vector<bool>& out)\n"
+			"\t\t{\n"
+			"\t\t\tout.clear();\n"
+			"\t\t\tfor(const auto& e : v.is_list() ? v.as_list() : std::vector<variant>(1, v)) {\n"
+			"\t\t\t\tout.push_back(e.as_bool());\n"
+			"\t\t\t}\n"
+			"\t\t}\n"
+			"\t\ttemplate<typename T> void decode_field(const variant& v, T& out);\n"
+			"\t\ttemplate<typename T> void decode_field(const variant& v, std::vector<T>& out);\n"
+			"\n"
+			"\t\ttemplate<typename T>\n"
+			"\t\tvoid decode_field(const variant& v, T& out)\n"
+			"\t\t{\n"
+			"\t\t\tdecode(v, out);\n"
+			"\t\t}\n"
+			"\n"
+			"\t\t// a tag that appears once is a single map rather than a list.\n"
+			"\t\ttemplate<typename T>\n"
+			"\t\tvoid decode_field(const variant& v, std::vector<T>& out)\n"
+			"\t\t{\n"
+			"\t\t\tif(v.is_list()) {\n"
+			"\t\t\t\tconst auto& l = v.as_list();\n"
+			"\t\t\t\tout.resize(l.size());\n"
+			"\t\t\t\tfor(size_t n = 0; n != l.size(); ++n) {\n"
+			"\t\t\t\t\tdecode_field(l[n], out[n]);\n"
+			"\t\t\t\t}\n"
+			"\t\t\t} else {\n"
+			"\t\t\t\tout.resize(1);\n"
+			"\t\t\t\tdecode_field(v, out[0]);\n"
+			"\t\t\t}\n"
+			"\t\t}\n";
+	}
+
+	void struct_generator::set_struct_name(const std::string& key, const std::string& name, bool tag)
+	{
+		names_[key] = name;
+		if(tag) {
+			tags_.insert(key);
+		}
+	}
+
+	void struct_generator::add_document(const std::string& root, const variant& doc)
+	{
+		ASSERT_LOG(doc.is_map(), "Expected a map for the document " << root);
+		if(std::find(roots_.cbegin(), roots_.cend(), root) == roots_.cend()) {
+			roots_.emplace_back(root);
+		}
+		observe_struct(root, doc, false);
+	}
+
+	std::string struct_generator::struct_name(const std::string& key) const
+	{
+		auto it = names_.find(key);
+		return it != names_.end() ? it->second : camel_case(key);
+	}
+
+	struct_generator::field struct_generator::merge(const field& a, const field& b)
+	{
+		field res;
+		res.list = a.list || b.list;
+		if(a.type == field_type::none) {
+			res.type = b.type;
+			res.object = b.object;
+		} else if(b.type == field_type::none || (a.type == b.type && a.object == b.object)) {
+			res.type = a.type;
+			res.object = a.object;
+		} else if((a.type == field_type::integer || a.type == field_type::integer64) && (b.type == field_type::integer || b.type == field_type::integer64)) {
+			res.type = field_type::integer64;
+		} else if((a.type == field_type::integer || a.type == field_type::real) && (b.type == field_type::integer || b.type == field_type::real)) {
+			res.type = field_type::real;
+		} else {
+			res.type = field_type::any;
+		}
+		return res;
+	}
+
+	bool struct_generator::schema_field(const std::string& key, field& res)
+	{
+		const attribute_rule* rule = find_attribute_rule(key);
+		if(rule == nullptr) {
+			return false;
+		}
+		res = field();
+		switch(rule->kind) {
+		case attribute_kind::integer:
+			res.type = field_type::integer;
+			res.default_value = rule->default_value != nullptr ? rule->default_value : "";
+			break;
+		case attribute_kind::int_list:
+			res.type = field_type::integer;
+			res.list = true;
+			break;
+		case attribute_kind::string_list:
+		case attribute_kind::variations:
+		case attribute_kind::map_grid:
+		case attribute_kind::terrain_types:
+			res.type = field_type::string;
+			res.list = true;
+			break;
+		case attribute_kind::flag_list:
+			res.type = field_type::any;
+			res.list = true;
+			break;
+		case attribute_kind::string:
+			res.type = field_type::string;
+			break;
+		case attribute_kind::point:
+		case attribute_kind::image_name:
+			// written as other keys, x and y or the parts of the name.
+			return false;
+		}
+		return true;
+	}
+
+	bool struct_generator::decoded_name_field(const std::string& key, field& res)
+	{
+		for(size_t n = 0; n != ipf::decoded_keys_size; ++n) {
+			if(key != ipf::decoded_keys[n].key) {
+				continue;
+			}
+			res = field();
+			switch(ipf::decoded_keys[n].type) {
+			case variant::VARIANT_TYPE_BOOL:	res.type = field_type::boolean; break;
+			case variant::VARIANT_TYPE_INTEGER:	res.type = field_type::integer64; break;
+			case variant::VARIANT_TYPE_FLOAT:	res.type = field_type::real; break;
+			case variant::VARIANT_TYPE_STRING:	res.type = field_type::string; break;
+			default:							res.type = field_type::any; break;
+			}
+			return true;
+		}
+		return false;
+	}
+
+	struct_generator::field struct_generator::observe(const std::string& key, const variant& v)
+	{
+		field res;
+		switch(v.type()) {
+		case variant::VARIANT_TYPE_NULL:
+			break;
+		case variant::VARIANT_TYPE_BOOL:
+			res.type = field_type::boolean;
+			break;
+		case variant::VARIANT_TYPE_INTEGER:
+			res.type = v.as_int() < std::numeric_limits<int>::min() || v.as_int() > std::numeric_limits<int>::max() ? field_type::integer64 : field_type::integer;
+			break;
+		case variant::VARIANT_TYPE_FLOAT:
+			res.type = field_type::real;
+			break;
+		case variant::VARIANT_TYPE_STRING:
+			res.type = field_type::string;
+			break;
+		case variant::VARIANT_TYPE_MAP:
+			res.type = field_type::object;
+			res.list = tags_.count(key) != 0;
+			res.object = struct_name(key);
+			observe_struct(res.object, v, tags_.count(key) != 0);
+			break;
+		case variant::VARIANT_TYPE_LIST:
+			res.list = true;
+			for(const auto& e : v.as_list()) {
+				const field element = observe(key, e);
+				if(element.list && !e.is_map()) {
+					// lists of lists are left as variants.
+					res.type = field_type::any;
+				} else {
+					res = merge(res, element);
+				}
+				res.list = true;
+			}
+			break;
+		}
+		return res;
+	}
+
+	void struct_generator::observe_struct(const std::string& name, const variant& v, bool tag)
+	{
+		auto& fields = structs_[name].fields;
+		for(const auto& p : v.as_map()) {
+			const std::string key = p.first.as_string();
+			field f;
+			if(tag && !p.second.is_map() && (schema_field(key, f) || decoded_name_field(key, f))) {
+				fields[key] = f;
+			} else {
+				fields[key] = merge(fields[key], observe(key, p.second));
+			}
+		}
+	}
+
+	void struct_generator::order_structs(const std::string& name, std::vector<std::string>& order, std::set<std::string>& visiting) const
+	{
+		if(std::find(order.cbegin(), order.cend(), name) != order.cend()) {
+			return;
+		}
+		ASSERT_LOG(visiting.insert(name).second, "Struct " << name << " contains itself.");
+		for(const auto& p : structs_.at(name).fields) {
+			if(p.second.type == field_type::object) {
+				order_structs(p.second.object, order, visiting);
+			}
+		}
+		visiting.erase(name);
+		order.emplace_back(name);
+	}
+
+	void struct_generator::write(const std::string& ns, const std::string& header_name, std::ostream& hpp, std::ostream& cpp) const
+	{
+		// a struct has to be defined before any struct holding it.
+		std::vector<std::string> order;
+		std::set<std::string> visiting;
+		for(const auto& root : roots_) {
+			order_structs(root, order, visiting);
+		}
+		std::set<std::string> struct_names(order.cbegin(), order.cend());
+
+		const auto cpp_type = [](const field& f) -> std::string {
+			std::string t;
+			switch(f.type) {
+			case field_type::boolean:	t = "bool"; break;
+			case field_type::integer:	t = "int"; break;
+			case field_type::integer64:	t = "int64_t"; break;
+			case field_type::real:		t = "float"; break;
+			case field_type::string:	t = "std::string"; break;
+			case field_type::object:	t = f.object; break;
+			case field_type::none:
+			case field_type::any:		t = "variant"; break;
+			}
+			return f.list ? "std::vector<" + t + ">" : t;
+		};
+
+		// the C++ name of each field, in key order.
+		std::map<std::string, std::vector<std::pair<std::string, std::string>>> names;
+		for(const auto& name : order) {
+			std::set<std::string> taken(struct_names);
+			for(const auto& p : structs_.at(name).fields) {
+				const std::string fname = field_name(p.first, taken);
+				taken.insert(fname);
+				names[name].emplace_back(p.first, fname);
+			}
+		}
+
+		hpp << "// Generated by terrain_parser --generate-structs from the converted terrain data, don't edit.\n"
+			<< "#pragma once\n\n"
+			<< "#include <cstdint>\n#include <string>\n#include <vector>\n\n"
+			<< "#include \"variant.hpp\"\n\n"
+			<< "namespace " << ns << "\n{\n";
+		for(const auto& name : order) {
+			const auto& fields = structs_.at(name).fields;
+			hpp << "\tstruct " << name << "\n\t{\n\t\t" << name << "()";
+			bool first = true;
+			for(const auto& fn : names[name]) {
+				const field& f = fields.at(fn.first);
+				const bool number = !f.list && (f.type == field_type::boolean || f.type == field_type::integer || f.type == field_type::integer64 || f.type == field_type::real);
+				const std::string init = !f.default_value.empty() ? f.default_value : f.type == field_type::boolean ? "false" : "0";
+				hpp << (first ? " : " : ", ") << fn.second << (number ? "(" + init + ")" : "()");
+				first = false;
+			}
+			hpp << " {}\n";
+			for(const auto& fn : names[name]) {
+				hpp << "\t\t" << cpp_type(fields.at(fn.first)) << " " << fn.second << ";\n";
+			}
+			hpp << "\t};\n\n";
+		}
+		for(const auto& name : order) {
+			hpp << "\tvoid decode(const variant& v, " << name << "& out);\n";
+		}
+		hpp << "\n";
+		for(const auto& root : roots_) {
+			hpp << "\t" << root << " decode_" << snake_case(root) << "(const variant& doc);\n";
+		}
+		hpp << "}\n";
+
+		cpp << "// Generated by terrain_parser --generate-structs from the converted terrain data, don't edit.\n"
+			<< "#include \"" << header_name << "\"\n\n"
+			<< "namespace " << ns << "\n{\n"
+			<< "\tnamespace\n\t{\n" << field_decoders << "\t}\n";
+		for(const auto& name : order) {
+			const auto& fields = names[name];
+			if(fields.empty()) {
+				cpp << "\n\tvoid decode(const variant&, " << name << "&)\n\t{\n\t}\n";
+				continue;
+			}
+			cpp << "\n\tvoid decode(const variant& v, " << name << "& out)\n\t{\n";
+			// both the map and the keys are sorted, so they're walked together.
+			cpp << "\t\tstatic const char* const keys[] = {";
+			for(size_t n = 0; n != fields.size(); ++n) {
+				cpp << (n == 0 ? " " : ", ") << quote(fields[n].first);
+			}
+			cpp << " };\n"
+				<< "\t\tconst size_t nkeys = " << fields.size() << ";\n"
+				<< "\t\tsize_t n = 0;\n"
+				<< "\t\tfor(const auto& p : v.as_map()) {\n"
+				<< "\t\t\tconst std::string& key = p.first.as_string();\n"
+				<< "\t\t\twhile(n != nkeys && key.compare(keys[n]) > 0) {\n"
+				<< "\t\t\t\t++n;\n"
+				<< "\t\t\t}\n"
+				<< "\t\t\tif(n == nkeys) {\n"
+				<< "\t\t\t\tbreak;\n"
+				<< "\t\t\t}\n"
+				<< "\t\t\tif(key != keys[n]) {\n"
+				<< "\t\t\t\tcontinue;\n"
+				<< "\t\t\t}\n"
+				<< "\t\t\tswitch(n) {\n";
+			for(size_t n = 0; n != fields.size(); ++n) {
+				cpp << "\t\t\tcase " << n << ": decode_field(p.second, out." << fields[n].second << "); break;\n";
+			}
+			cpp << "\t\t\t}\n"
+				<< "\t\t}\n"
+				<< "\t}\n";
+		}
+		for(const auto& root : roots_) {
+			cpp << "\n\t" << root << " decode_" << snake_case(root) << "(const variant& doc)\n\t{\n"
+				<< "\t\t" << root << " res;\n"
+				<< "\t\tdecode(doc, res);\n"
+				<< "\t\treturn res;\n"
+				<< "\t}\n";
+		}
+		cpp << "}\n";
+	}
+}
+
+UNIT_TEST(struct_generator_types)
+{
+	// every timing and probability here is whole, and each rule has a single [tile].
+	const variant rules = convert_node(read_wml2(
+		"[terrain_graphics]\n[tile]\nx=0\ny=1\ntype=Gg\n[/tile]\n"
+		"[image]\nname=tiles/grass[1~3].png:100\nlayer=-1\n[/image]\n[/terrain_graphics]\n"
+		"[terrain_graphics]\nprobability=50\n[tile]\nx,y=1,1\nset_flag=a,b\n[/tile]\n[/terrain_graphics]\n")->root());
+	codegen::struct_generator gen;
+	gen.set_struct_name("terrain_graphics", "Rule", true);
+	gen.set_struct_name("tile", "Tile", true);
+	gen.set_struct_name("image", "Image", true);
+	gen.add_document("Rules", rules);
+	// not tags, so typed from the values alone.
+	gen.add_document("Other", json::parse("{\"count\": 3, \"big\": 10000000000, \"ratio\": [1, 2.5], \"mixed\": [1, \"a\"], \"variant\": \"x\"}"));
+	std::ostringstream hpp, cpp;
+	gen.write("test_data", "test_data.hpp", hpp, cpp);
+	const std::string h = hpp.str(), c = cpp.str();
+	const auto has = [&h](const std::string& s) { return h.find(s) != std::string::npos; };
+
+	// from the schema and the image name decoder, whatever the samples held.
+	CHECK(has("\t\tint probability;") && has("probability(100)"), h);
+	CHECK(has("\t\tfloat animation_timing;"), h);
+	CHECK(has("\t\tint x;") && has("\t\tint y;") && has("\t\tint layer;"), h);
+	CHECK(has("\t\tstd::vector<variant> set_flag;") && has("\t\tstd::vector<std::string> type;"), h);
+	// tags are lists even when there was only one.
+	CHECK(has("\t\tstd::vector<Tile> tile;") && has("\t\tstd::vector<Image> image;") && has("\t\tstd::vector<Rule> terrain_graphics;"), h);
+	// a struct comes before the structs holding it.
+	CHECK(h.find("struct Tile") < h.find("struct Rule") && h.find("struct Rule") < h.find("struct Rules"), h);
+
+	CHECK(has("\t\tint count;") && has("\t\tint64_t big;") && has("\t\tstd::vector<float> ratio;") && has("\t\tstd::vector<variant> mixed;"), h);
+	// names which can't be used as they are.
+	CHECK(has("\t\tstd::string variant_;"), h);
+	CHECK(has("\tRules decode_rules(const variant& doc);") && has("\tOther decode_other(const variant& doc);"), h);
+	CHECK(c.find("#include \"test_data.hpp\"") != std::string::npos && c.find("decode_field(p.second, out.variant_)") != std::string::npos, c);
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <map>
+#include <ostream>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "variant.hpp"
+
+// Generates plain C++ structs for the converted documents, with decoders from their JSON,
+// so code using the data reads fields rather than looking keys up in variant maps.
+//
+// The structs are inferred from the documents: every map found under a key becomes a
+// struct, named after the key, holding a field for each key seen in any of those maps.
+// Maps under the same key share a struct, so [image] in a rule and in a [tile] is one
+// Image. In the structs of tags (see set_struct_name()) a field for an attribute in the
+// attribute schema has the type its conversion gives, whatever the documents hold, and
+// starts at the schema's default, so a rule without a probability decodes with 100 as in
+// WML. Likewise the keys an image name is decoded to have the type the decoder gives
+// them, so animation_timing is a float even if every timing seen was whole. Flag lists
+// are variants, as a compacted range is a map. Other fields take their
+// type from the values seen: a field is a list if any of its values was one, since
+// variant_builder leaves a tag that appears once as a single map, and falls back to
+// variant where its values don't agree on a type.
+namespace codegen
+{
+	class struct_generator
+	{
+	public:
+		struct_generator() : names_(), tags_(), structs_(), roots_() {}
+		// The struct generated for maps under key, rather than the key in CamelCase. If
+		// tag is set the maps are WML tags, which may be repeated, so fields holding them
+		// are always lists even if every one seen was on its own. Set these before adding
+		// the documents.
+		void set_struct_name(const std::string& key, const std::string& name, bool tag=false);
+		// Adds a converted document, root is the struct generated for the document itself.
+		void add_document(const std::string& root, const variant& doc);
+		// Writes the structs to hpp and the decoders to cpp, which includes header_name.
+		// Each struct S gets a
+		//   void decode(const variant& v, S& out);
+		// which sets the fields of out found in v and leaves the others alone,
+		// and each document root R a
+		//   R decode_R(const variant& doc);
+		// with R in snake_case.
+		void write(const std::string& ns, const std::string& header_name, std::ostream& hpp, std::ostream& cpp) const;
+	private:
+		enum class field_type { none, boolean, integer, integer64, real, string, object, any };
+		struct field
+		{
+			field() : type(field_type::none), list(false), object(), default_value() {}
+			field_type type;
+			bool list;
+			// the struct, for field_type::object.
+			std::string object;
+			// the initial value of a number, if not 0.
+			std::string default_value;
+		};
+		struct struct_info
+		{
+			struct_info() : fields() {}
+			std::map<std::string, field> fields;
+		};
+
+		static field merge(const field& a, const field& b);
+		// The field for an attribute in the schema, false for those copied as strings.
+		static bool schema_field(const std::string& key, field& res);
+		// The field for a key an image name decodes to, false if its type isn't fixed.
+		static bool decoded_name_field(const std::string& key, field& res);
+		field observe(const std::string& key, const variant& v);
+		// the attributes of a tag are typed by the schema, the maps the converter adds
+		// aren't WML so are typed by their values.
+		void observe_struct(const std::string& name, const variant& v, bool tag);
+		std::string struct_name(const std::string& key) const;
+		void order_structs(const std::string& name, std::vector<std::string>& order, std::set<std::string>& visiting) const;
+
+		std::map<std::string, std::string> names_;
+		std::set<std::string> tags_;
+		std::map<std::string, struct_info> structs_;
+		std::vector<std::string> roots_;
+	};
+}
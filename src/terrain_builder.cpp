@@ -0,0 +1,617 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <sstream>
+#include <thread>
+
+#include <boost/algorithm/string.hpp>
+
+#include "asserts.hpp"
+#include "builder_map.hpp"
+#include "image_path.hpp"
+#include "pipeline.hpp"
+#include "profiler.hpp"
+#include "terrain_builder.hpp"
+#include "terrain_parser.hpp"
+#include "unit_test.hpp"
+
+namespace terrain
+{
+	namespace
+	{
+		// Images are 72 pixels square and the columns overlap by a quarter, as in Wesnoth.
+		const int tile_size = 72;
+		const int min_band_height = 32;
+		const int num_rotations = 6;
+
+		template<typename Fn>
+		void for_each_tag(const variant& v, Fn fn)
+		{
+			if(v.is_list()) {
+				for(const auto& e : v.as_list()) {
+					fn(e);
+				}
+			} else if(v.is_map()) {
+				fn(v);
+			}
+		}
+
+		std::vector<std::string> as_strings(const variant& v)
+		{
+			std::vector<std::string> res;
+			if(v.is_list()) {
+				for(const auto& s : v.as_list()) {
+					res.emplace_back(s.as_string());
+				}
+			} else if(v.is_string()) {
+				res.emplace_back(v.as_string());
+			}
+			return res;
+		}
+
+		// A tile's separate x= or y=, which the converter may have left as a string. False
+		// if it isn't a whole number.
+		bool read_coordinate(const variant& v, int& res)
+		{
+			if(v.is_int()) {
+				res = v.as_int32();
+				return true;
+			}
+			if(!v.is_string() || v.as_string().empty()) {
+				return false;
+			}
+			const std::string& s = v.as_string();
+			char* end = nullptr;
+			const long n = std::strtol(s.c_str(), &end, 10);
+			if(*end != '\0') {
+				return false;
+			}
+			res = static_cast<int>(n);
+			return true;
+		}
+
+		// Replaces @R0 to @R5 with the rotations, shifted by rot.
+		std::string rotate_string(std::string s, const std::vector<std::string>& rotations, int rot)
+		{
+			if(rotations.size() != num_rotations || s.find("@R") == std::string::npos) {
+				return s;
+			}
+			for(int n = 0; n != num_rotations; ++n) {
+				boost::replace_all(s, "@R" + std::to_string(n), rotations[(n + rot) % num_rotations]);
+			}
+			return s;
+		}
+
+		// Turns x,y 60 degrees clockwise about 0,0, going through cube coordinates.
+		void rotate_location(int& x, int& y)
+		{
+			const int cx = x;
+			const int cz = y - (x - (x & 1)) / 2;
+			const int cy = -cx - cz;
+			x = -cz;
+			y = -cy + (x - (x & 1)) / 2;
+		}
+
+		// x,y of a rule tile placed with the rule origin at ox,oy. Offsets are from an even
+		// column, so from an odd one the odd columns move down a row.
+		inline void place(int ox, int oy, int tx, int ty, int& x, int& y)
+		{
+			x = ox + tx;
+			y = oy + ty + ((ox & 1) && (tx & 1) ? 1 : 0);
+		}
+
+		inline uint32_t noise(int x, int y, uint32_t seed)
+		{
+			uint64_t z = (static_cast<uint64_t>(static_cast<uint32_t>(x)) << 32 | static_cast<uint32_t>(y)) + seed * 0x9e3779b97f4a7c15ULL;
+			z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+			z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+			return static_cast<uint32_t>(z ^ (z >> 31));
+		}
+
+		// A [tile] before rotation.
+		struct source_tile
+		{
+			source_tile() : x(0), y(0), type(), set_flags(), no_flags(), has_flags(), images() {}
+			int x;
+			int y;
+			type_pattern type;
+			std::vector<std::string> set_flags;
+			std::vector<std::string> no_flags;
+			std::vector<std::string> has_flags;
+			std::vector<variant> images;
+		};
+
+		source_tile read_tile(const variant& tile)
+		{
+			source_tile res;
+			const variant& match = tile["type_match"];
+			res.type = match.is_null() ? compile_pattern("*") : pattern_from_variant(match);
+			res.set_flags = as_strings(tile["set_flag"]);
+			res.no_flags = as_strings(tile["no_flag"]);
+			res.has_flags = as_strings(tile["has_flag"]);
+			for(const auto& f : as_strings(tile["set_no_flag"])) {
+				res.set_flags.emplace_back(f);
+				res.no_flags.emplace_back(f);
+			}
+			for_each_tag(tile["image"], [&res](const variant& img) {
+				res.images.emplace_back(img);
+			});
+			return res;
+		}
+
+		// Rule level images are drawn on the tile under their base (or center) point.
+		size_t image_tile(const variant& img, const std::vector<source_tile>& tiles)
+		{
+			const variant& pos = img["base"].is_list() ? img["base"] : img["center"];
+			if(!pos.is_list() || pos.num_elements() < 2) {
+				return 0;
+			}
+			const int px = pos[0].as_int32();
+			const int py = pos[1].as_int32();
+			size_t res = 0;
+			int64_t best = -1;
+			for(size_t n = 0; n != tiles.size(); ++n) {
+				const int cx = tiles[n].x * tile_size * 3 / 4 + tile_size / 2;
+				const int cy = tiles[n].y * tile_size + (tiles[n].x & 1) * tile_size / 2 + tile_size / 2;
+				const int64_t d = static_cast<int64_t>(cx - px) * (cx - px) + static_cast<int64_t>(cy - py) * (cy - py);
+				if(best < 0 || d < best) {
+					best = d;
+					res = n;
+				}
+			}
+			return res;
+		}
+
+		// Per-build information about a rule.
+		struct rule_anchor
+		{
+			rule_anchor() : tile(0), codes() {}
+			size_t tile;
+			// ids of the map's codes matching the anchor tile.
+			std::vector<int> codes;
+		};
+	}
+
+	hex_map read_map(const std::string& s)
+	{
+		hex_map res;
+		std::vector<std::string> lines;
+		boost::split(lines, s, boost::is_any_of("\n"));
+		for(auto& line : lines) {
+			boost::trim(line);
+			if(line.empty() || line.find('=') != std::string::npos) {
+				continue;
+			}
+			std::vector<std::string> cells;
+			boost::split(cells, line, boost::is_any_of(","));
+			for(auto& cell : cells) {
+				boost::trim(cell);
+				const auto space = cell.find_last_of(" \t");
+				res.codes.emplace_back(read_terrain_code(space != std::string::npos ? cell.substr(space + 1) : cell));
+			}
+			if(res.height == 0) {
+				res.width = static_cast<int>(cells.size());
+			}
+			ASSERT_LOG(static_cast<int>(cells.size()) == res.width, "Map row " << res.height << " has " << cells.size() << " hexes, expected " << res.width);
+			++res.height;
+		}
+		return res;
+	}
+
+	std::string write_map(const hex_map& m)
+	{
+		std::ostringstream ss;
+		for(int y = 0; y != m.height; ++y) {
+			for(int x = 0; x != m.width; ++x) {
+				ss << (x != 0 ? ", " : "") << write_terrain_code(m.get(x, y));
+			}
+			ss << "\n";
+		}
+		return ss.str();
+	}
+
+	terrain_builder::terrain_builder(const variant& terrain_graphics)
+		: rules_(),
+		  flags_()
+	{
+		PROFILE_ZONE("load terrain rules");
+		uint32_t index = 0;
+		for_each_tag(terrain_graphics["terrain_graphics"], [this, &index](const variant& rule) {
+			add_rule(rule, index++);
+		});
+	}
+
+	int terrain_builder::get_flag(const std::string& flag)
+	{
+		return flags_.emplace(flag, static_cast<int>(flags_.size())).first->second;
+	}
+
+	void terrain_builder::add_rule(const variant& rule, uint32_t index)
+	{
+		std::vector<source_tile> tiles;
+		std::vector<variant> tile_tags;
+		for_each_tag(rule["tile"], [&tile_tags](const variant& tile) {
+			tile_tags.emplace_back(tile);
+		});
+		if(rule["map_grid"].is_map()) {
+			const auto grid = builder_map_from_variant(rule["map_grid"]);
+			for(int n = 0; n != static_cast<int>(grid.cells.size()); ++n) {
+				if(grid.cells[n] == map_cell_none) {
+					continue;
+				}
+				// '*' and a pos without a [tile] only need to be on the map.
+				source_tile t;
+				t.type = compile_pattern("*");
+				for(const auto& tag : tile_tags) {
+					if(grid.cells[n] != map_cell_any && tag["pos"].as_int32(-1) == grid.cells[n]) {
+						t = read_tile(tag);
+						break;
+					}
+				}
+				t.x = n % grid.width;
+				t.y = n / grid.width;
+				tiles.emplace_back(t);
+			}
+		}
+		for(const auto& tag : tile_tags) {
+			int x = 0, y = 0;
+			if(read_coordinate(tag["x"], x) && read_coordinate(tag["y"], y)) {
+				tiles.emplace_back(read_tile(tag));
+				tiles.back().x = x;
+				tiles.back().y = y;
+			}
+		}
+		if(tiles.empty()) {
+			return;
+		}
+		for_each_tag(rule["image"], [&tiles](const variant& img) {
+			tiles[image_tile(img, tiles)].images.emplace_back(img);
+		});
+
+		const auto rotations = as_strings(rule["rotations"]);
+		const int nrotations = rotations.size() == num_rotations ? num_rotations : 1;
+		for(int rot = 0; rot != nrotations; ++rot) {
+			building_rule br;
+			br.index = index;
+			br.probability = rule["probability"].as_int32(100);
+			br.mod_x = rule["mod_x"].as_int32(0);
+			br.mod_y = rule["mod_y"].as_int32(0);
+			for(const auto& st : tiles) {
+				rule_tile t;
+				t.x = st.x;
+				t.y = st.y;
+				for(int n = 0; n != rot; ++n) {
+					rotate_location(t.x, t.y);
+				}
+				t.type = st.type;
+				for(const auto& f : st.set_flags) {
+					t.set_flags.emplace_back(get_flag(rotate_string(f, rotations, rot)));
+				}
+				for(const auto& f : st.no_flags) {
+					t.no_flags.emplace_back(get_flag(rotate_string(f, rotations, rot)));
+				}
+				for(const auto& f : st.has_flags) {
+					t.has_flags.emplace_back(get_flag(rotate_string(f, rotations, rot)));
+				}
+				for(const auto& img : st.images) {
+					if(!img["name"].is_string()) {
+						continue;
+					}
+					rule_image ri;
+					ri.layer = img["layer"].as_int32(0);
+					const std::string name = rotate_string(img["name"].as_string(), rotations, rot);
+					auto variations = as_strings(img["variations"]);
+					if(variations.empty()) {
+						variations.emplace_back("");
+					}
+					for(const auto& v : variations) {
+						ri.names.emplace_back(ipf::intern(boost::replace_all_copy(name, "@V", v)));
+					}
+					t.images.emplace_back(ri);
+				}
+				br.tiles.emplace_back(t);
+			}
+			rules_.emplace_back(br);
+		}
+	}
+
+	std::vector<std::vector<hex_image>> terrain_builder::build(const hex_map& m, int threads) const
+	{
+		PROFILE_ZONE("build terrain");
+		if(threads <= 0) {
+			threads = std::max<int>(1, std::thread::hardware_concurrency());
+		}
+		const size_t nhexes = m.codes.size();
+
+		// hexes grouped by code, in order, so a rule is only tried where its anchor fits.
+		std::vector<terrain_code> codes(m.codes);
+		std::sort(codes.begin(), codes.end());
+		codes.erase(std::unique(codes.begin(), codes.end()), codes.end());
+		std::vector<uint32_t> code_offsets(codes.size() + 1, 0);
+		std::vector<uint32_t> hexes(nhexes);
+		{
+			PROFILE_ZONE("group hexes");
+			std::vector<int> hex_codes(nhexes);
+			for(size_t n = 0; n != nhexes; ++n) {
+				hex_codes[n] = static_cast<int>(std::lower_bound(codes.cbegin(), codes.cend(), m.codes[n]) - codes.cbegin());
+				++code_offsets[hex_codes[n] + 1];
+			}
+			for(size_t c = 0; c != codes.size(); ++c) {
+				code_offsets[c + 1] += code_offsets[c];
+			}
+			std::vector<uint32_t> next(code_offsets.cbegin(), code_offsets.cend() - 1);
+			for(size_t n = 0; n != nhexes; ++n) {
+				hexes[next[hex_codes[n]]++] = static_cast<uint32_t>(n);
+			}
+		}
+
+		// Each rule is anchored on the tile matching fewest of the map's codes. The band
+		// height has to cover twice the rows a rule reaches from its anchor.
+		std::vector<rule_anchor> anchors(rules_.size());
+		int band_height = min_band_height;
+		{
+			PROFILE_ZONE("anchor rules");
+			std::vector<int> matched;
+			for(size_t r = 0; r != rules_.size(); ++r) {
+				const auto& rule = rules_[r];
+				auto& anchor = anchors[r];
+				bool first = true;
+				for(size_t t = 0; t != rule.tiles.size(); ++t) {
+					matched.clear();
+					for(size_t c = 0; c != codes.size(); ++c) {
+						if(rule.tiles[t].type.matches(codes[c])) {
+							matched.emplace_back(static_cast<int>(c));
+						}
+					}
+					if(first || matched.size() < anchor.codes.size()) {
+						anchor.codes = matched;
+						anchor.tile = t;
+						first = false;
+					}
+				}
+				const auto& at = rule.tiles[anchor.tile];
+				for(const auto& t : rule.tiles) {
+					band_height = std::max(band_height, 2 * (std::abs(t.y - at.y) + 1));
+				}
+			}
+		}
+
+		std::vector<std::vector<int>> flags(nhexes);
+		std::vector<std::vector<hex_image>> res(nhexes);
+
+		auto try_rule = [&](size_t r, int hx, int hy) {
+			const auto& rule = rules_[r];
+			const auto& at = rule.tiles[anchors[r].tile];
+			const int ox = hx - at.x;
+			const int oy = hy - at.y - ((ox & 1) && (at.x & 1) ? 1 : 0);
+			if((rule.mod_x > 0 && ((ox % rule.mod_x) + rule.mod_x) % rule.mod_x != 0)
+				|| (rule.mod_y > 0 && ((oy % rule.mod_y) + rule.mod_y) % rule.mod_y != 0)) {
+				return;
+			}
+			if(rule.probability < 100 && static_cast<int>(noise(ox, oy, static_cast<uint32_t>(r)) % 100) >= rule.probability) {
+				return;
+			}
+			int x, y;
+			for(const auto& t : rule.tiles) {
+				place(ox, oy, t.x, t.y, x, y);
+				if(!m.on_map(x, y) || !t.type.matches(m.get(x, y))) {
+					return;
+				}
+				const auto& hex_flags = flags[y * m.width + x];
+				for(auto f : t.no_flags) {
+					if(std::find(hex_flags.cbegin(), hex_flags.cend(), f) != hex_flags.cend()) {
+						return;
+					}
+				}
+				for(auto f : t.has_flags) {
+					if(std::find(hex_flags.cbegin(), hex_flags.cend(), f) == hex_flags.cend()) {
+						return;
+					}
+				}
+			}
+			for(const auto& t : rule.tiles) {
+				place(ox, oy, t.x, t.y, x, y);
+				const size_t hex = y * m.width + x;
+				for(auto f : t.set_flags) {
+					if(std::find(flags[hex].cbegin(), flags[hex].cend(), f) == flags[hex].cend()) {
+						flags[hex].emplace_back(f);
+					}
+				}
+				for(size_t n = 0; n != t.images.size(); ++n) {
+					const auto& img = t.images[n];
+					hex_image hi;
+					hi.layer = img.layer;
+					hi.name = img.names.size() == 1 ? img.names[0] : img.names[noise(x, y, static_cast<uint32_t>(r * 64 + n)) % img.names.size()];
+					hi.rule = rule.index;
+					res[hex].emplace_back(hi);
+				}
+			}
+		};
+
+		// The hexes of one band where rule r could be anchored.
+		auto process_band = [&](size_t r, int band) {
+			const uint32_t first = static_cast<uint32_t>(band * band_height * m.width);
+			const uint32_t last = static_cast<uint32_t>(std::min(m.height, (band + 1) * band_height) * m.width);
+			for(auto c : anchors[r].codes) {
+				const auto begin = hexes.cbegin() + code_offsets[c];
+				const auto end = hexes.cbegin() + code_offsets[c + 1];
+				for(auto it = std::lower_bound(begin, end, first); it != end && *it < last; ++it) {
+					try_rule(r, *it % m.width, *it / m.width);
+				}
+			}
+		};
+
+		// Rules are applied one after another, so each sees the flags set by the rules
+		// before it and none of those after it. A rule takes two passes over the bands,
+		// the even ones and then the odd ones, with all the threads finishing a pass
+		// before any starts the next. Each parity has a counter handing out its bands,
+		// the first thread resets the one for the other parity while no one is using it.
+		const int nbands = (m.height + band_height - 1) / band_height;
+		const int nthreads = std::max(1, std::min(threads, (nbands + 1) / 2));
+		pipeline::barrier pass_done(nthreads);
+		std::atomic<int> next_band[2];
+		next_band[0] = 0;
+		next_band[1] = 1;
+		auto worker = [&](int id) {
+			PROFILE_ZONE("apply rules");
+			for(size_t r = 0; r != rules_.size(); ++r) {
+				// every thread skips the same rules, so they all still meet at each barrier.
+				if(anchors[r].codes.empty()) {
+					continue;
+				}
+				for(int parity = 0; parity != 2; ++parity) {
+					if(id == 0) {
+						next_band[1 - parity] = 1 - parity;
+					}
+					for(int band = next_band[parity].fetch_add(2); band < nbands; band = next_band[parity].fetch_add(2)) {
+						process_band(r, band);
+					}
+					pass_done.wait();
+				}
+			}
+		};
+		std::vector<std::thread> pool;
+		for(int n = 1; n < nthreads; ++n) {
+			pool.emplace_back([&worker, n]() {
+				PROFILE_THREAD_NAME("terrain builder");
+				worker(n);
+			});
+		}
+		worker(0);
+		for(auto& t : pool) {
+			t.join();
+		}
+
+		{
+			PROFILE_ZONE("sort layers");
+			for(auto& images : res) {
+				std::stable_sort(images.begin(), images.end(), [](const hex_image& a, const hex_image& b) { return a.layer < b.layer; });
+			}
+		}
+		return res;
+	}
+}
+
+namespace
+{
+	// A rule for the test below, its tiles stacked in one column from the anchor down.
+	struct test_tile
+	{
+		const char* type;
+		const char* set_flag;
+		const char* no_flag;
+		const char* has_flag;
+		const char* image;
+	};
+
+	bool test_has_flag(const std::vector<std::string>& flags, const char* flag)
+	{
+		return std::find(flags.cbegin(), flags.cend(), flag) != flags.cend();
+	}
+}
+
+// Flags set by later rules mustn't be seen by earlier ones, at band edges as anywhere else.
+// None of the rules conflict with themselves, so applying each rule to every hex in turn
+// gives the only right answer.
+UNIT_TEST(terrain_builder_applies_rules_in_order)
+{
+	const std::vector<std::vector<test_tile>> rules = {
+		{ { "Gg", "a", "b", "", "r0" } },
+		{ { "Ww", "b", "", "", "r1" }, { "Gg", "b", "", "", "" } },
+		{ { "*", "", "", "b", "r2" }, { "*", "", "", "a", "" } },
+		{ { "Gg,Ww", "c", "c", "", "r3" } },
+	};
+	std::ostringstream wml;
+	for(const auto& rule : rules) {
+		wml << "[terrain_graphics]\n";
+		for(size_t n = 0; n != rule.size(); ++n) {
+			const auto& t = rule[n];
+			wml << "[tile]\nx,y=0," << n << "\ntype=" << t.type << "\n";
+			if(*t.set_flag) { wml << "set_flag=" << t.set_flag << "\n"; }
+			if(*t.no_flag) { wml << "no_flag=" << t.no_flag << "\n"; }
+			if(*t.has_flag) { wml << "has_flag=" << t.has_flag << "\n"; }
+			if(*t.image) { wml << "[image]\nname=" << t.image << "\n[/image]\n"; }
+			wml << "[/tile]\n";
+		}
+		wml << "[/terrain_graphics]\n";
+	}
+	const terrain::terrain_builder builder(convert_node(read_wml2(wml.str())->root()));
+
+	// tall enough for several bands.
+	const int width = 5, height = 300;
+	std::ostringstream map_text;
+	uint32_t seed = 1;
+	for(int y = 0; y != height; ++y) {
+		for(int x = 0; x != width; ++x) {
+			seed = seed * 1103515245 + 12345;
+			map_text << (x != 0 ? "," : "") << ((seed >> 16) % 3 == 0 ? "Ww" : "Gg");
+		}
+		map_text << "\n";
+	}
+	const terrain::hex_map m = terrain::read_map(map_text.str());
+
+	std::vector<std::vector<std::string>> flags(m.codes.size()), expected(m.codes.size());
+	for(const auto& rule : rules) {
+		std::vector<terrain::type_pattern> types;
+		for(const auto& t : rule) {
+			types.emplace_back(terrain::compile_pattern(t.type));
+		}
+		for(int y = 0; y != height; ++y) {
+			for(int x = 0; x != width; ++x) {
+				bool fits = y + static_cast<int>(rule.size()) <= height;
+				for(size_t n = 0; fits && n != rule.size(); ++n) {
+					const auto& hex_flags = flags[(y + n) * width + x];
+					fits = types[n].matches(m.get(x, y + static_cast<int>(n)))
+						&& (!*rule[n].no_flag || !test_has_flag(hex_flags, rule[n].no_flag))
+						&& (!*rule[n].has_flag || test_has_flag(hex_flags, rule[n].has_flag));
+				}
+				for(size_t n = 0; fits && n != rule.size(); ++n) {
+					const size_t hex = (y + n) * width + x;
+					if(*rule[n].set_flag && !test_has_flag(flags[hex], rule[n].set_flag)) {
+						flags[hex].emplace_back(rule[n].set_flag);
+					}
+					if(*rule[n].image) {
+						expected[hex].emplace_back(rule[n].image);
+					}
+				}
+			}
+		}
+	}
+
+	for(int threads : { 1, 4 }) {
+		const auto images = builder.build(m, threads);
+		CHECK_EQ(images.size(), expected.size());
+		for(size_t hex = 0; hex != images.size(); ++hex) {
+			std::vector<std::string> names;
+			for(const auto& img : images[hex]) {
+				names.emplace_back(*img.name);
+			}
+			CHECK(names == expected[hex], "hex " << hex << " with " << threads << " threads has " << boost::join(names, " ") << ", expected " << boost::join(expected[hex], " "));
+		}
+	}
+}
+
+UNIT_TEST(terrain_builder_separate_x_and_y)
+{
+	// the same two tile rule, placed with x,y= and with separate x= and y=, whether the
+	// converter gave the numbers as strings or not.
+	const auto rule = [](const std::string& first, const std::string& second) {
+		return "[terrain_graphics]\n[tile]\n" + first + "\ntype=Gg\n[image]\nname=top\n[/image]\n[/tile]\n"
+			"[tile]\n" + second + "\ntype=Ww\n[image]\nname=below\n[/image]\n[/tile]\n[/terrain_graphics]\n";
+	};
+	const terrain::terrain_builder together(convert_node(read_wml2(rule("x,y=0,0", "x,y=1,1"))->root()));
+	const terrain::terrain_builder apart(convert_node(read_wml2(rule("x=0\ny=0", "x=1\ny=1"))->root()));
+	const terrain::hex_map m = terrain::read_map("Gg,Gg,Gg\nGg,Ww,Ww\nWw,Ww,Gg\n");
+	const auto expected = together.build(m, 1);
+	const auto images = apart.build(m, 1);
+	CHECK_EQ(images.size(), expected.size());
+	size_t placed = 0;
+	for(size_t hex = 0; hex != images.size(); ++hex) {
+		CHECK_EQ(images[hex].size(), expected[hex].size());
+		for(size_t n = 0; n != images[hex].size(); ++n) {
+			CHECK(*images[hex][n].name == *expected[hex][n].name, "hex " << hex);
+		}
+		placed += images[hex].size();
+	}
+	CHECK_GE(placed, 2);
+}
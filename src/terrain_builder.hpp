@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "terrain_pattern.hpp"
+#include "variant.hpp"
+
+// Applies the converted [terrain_graphics] rules to a map, giving the images drawn on
+// each hex. A cut down version of Wesnoth's terrain builder: rules are tried in order
+// and use type patterns, probability, mod_x/mod_y, set_flag/no_flag/has_flag/set_no_flag,
+// rotations and image layers. Animation, image positioning within the hex and the
+// drawing itself are left to the caller.
+namespace terrain
+{
+	// A Wesnoth .map: rows of comma separated codes. Hexes are x,y with the odd columns
+	// half a hex lower than the even ones.
+	struct hex_map
+	{
+		hex_map() : width(0), height(0), codes() {}
+		const terrain_code& get(int x, int y) const { return codes[y * width + x]; }
+		bool on_map(int x, int y) const { return x >= 0 && y >= 0 && x < width && y < height; }
+		int width;
+		int height;
+		std::vector<terrain_code> codes;
+	};
+
+	// Reads a .map, header lines (key=value) and starting positions ("1 Kh") are skipped.
+	hex_map read_map(const std::string& s);
+	std::string write_map(const hex_map& m);
+
+	struct hex_image
+	{
+		hex_image() : layer(0), name(nullptr), rule(0) {}
+		int layer;
+		// the decoded image name with rotations and variations filled in, interned.
+		const std::string* name;
+		// index of the [terrain_graphics] rule which placed it.
+		uint32_t rule;
+	};
+
+	class terrain_builder
+	{
+	public:
+		// From the converted terrain-graphics document, the map holding the
+		// terrain_graphics list. The rules need the type_match and map_grid the converter
+		// adds. Each rotation of a rule becomes a rule of its own.
+		explicit terrain_builder(const variant& terrain_graphics);
+
+		size_t num_rules() const { return rules_.size(); }
+		size_t num_flags() const { return flags_.size(); }
+
+		// The images of every hex, row by row, ordered by layer and then by the order
+		// the rules were applied. As in Wesnoth the rules are applied in order, each
+		// seeing only the flags of the rules before it. Each rule is spread over bands of
+		// rows processed in parallel, first the even bands and then the odd ones. Bands
+		// are tall enough that no rule placed in one touches a hex of another being
+		// processed at the same time, and the random choices (probability, variations)
+		// are seeded by location and rule, so the result doesn't depend on threads.
+		// threads == 0 means use std::thread::hardware_concurrency().
+		std::vector<std::vector<hex_image>> build(const hex_map& m, int threads=0) const;
+	private:
+		struct rule_image
+		{
+			rule_image() : layer(0), names() {}
+			int layer;
+			// one for each variation.
+			std::vector<const std::string*> names;
+		};
+
+		struct rule_tile
+		{
+			rule_tile() : x(0), y(0), type(), set_flags(), no_flags(), has_flags(), images() {}
+			// relative to the rule origin, which is on an even column.
+			int x;
+			int y;
+			type_pattern type;
+			std::vector<int> set_flags;
+			std::vector<int> no_flags;
+			std::vector<int> has_flags;
+			std::vector<rule_image> images;
+		};
+
+		struct building_rule
+		{
+			building_rule() : index(0), probability(100), mod_x(0), mod_y(0), tiles() {}
+			uint32_t index;
+			int probability;
+			int mod_x;
+			int mod_y;
+			std::vector<rule_tile> tiles;
+		};
+
+		void add_rule(const variant& rule, uint32_t index);
+		int get_flag(const std::string& flag);
+
+		std::vector<building_rule> rules_;
+		std::map<std::string, int> flags_;
+	};
+}
@@ -16,11 +16,11 @@ namespace
 	boost::regex re_macro_match("\\{(.*?)\\}");
 	boost::regex re_parens_match("\\((.*?)\\)");
 
-	node_ptr read_wml_macro(const std::string& root_name, const std::string& contents) 
+	node_tree_ptr read_wml_macro(const std::string& root_name, const std::string& contents) 
 	{
-		node_ptr root = std::make_shared<node>(root_name);
-		std::stack<node_ptr> current;
-		current.emplace(root);
+		node_tree_ptr root = std::make_shared<node_tree>(root_name);
+		std::stack<node> current;
+		current.emplace(root->root());
 
 		auto lines = split(contents, "\n", SplitFlags::NONE);
 
@@ -31,7 +31,7 @@ namespace
 
 		int expect_merge = 0;
 
-		std::map<std::string, node_ptr> last_node;
+		std::map<std::string, node> last_node;
 
 		const auto& cache = get_macro_cache();
 
@@ -60,7 +60,7 @@ namespace
 				ml_string += "\n" + line.substr(0, quote_pos);
 				if(quote_pos != std::string::npos) {
 					in_multi_line_string = false;
-					current.top()->add_attr(attribute, (is_translateable_ml_string ? "~" : "") + ml_string + (is_translateable_ml_string ? "~" : ""));
+					current.top().add_attr(attribute, (is_translateable_ml_string ? "~" : "") + ml_string + (is_translateable_ml_string ? "~" : ""));
 					is_translateable_ml_string = false;
 					ml_string.clear();
 				}
@@ -73,7 +73,7 @@ namespace
 					ASSERT_LOG(it != last_node.end(), "Unable to find merge to node for " << tag_name);
 					current.emplace(it->second);
 				} else {
-					current.emplace(current.top()->add_child(std::make_shared<node>(tag_name)));
+					current.emplace(current.top().add_child(tag_name));
 					last_node[tag_name] = current.top();
 				}
 			} else if(boost::regex_match(line.c_str(), what, re_close_tag)) {
@@ -84,7 +84,7 @@ namespace
 					current.pop();
 					continue;
 				}
-				ASSERT_LOG(this_tag == current.top()->name(), "tag name mismatch error: " << this_tag << " != " << current.top()->name());
+				ASSERT_LOG(this_tag == current.top().name(), "tag name mismatch error: " << this_tag << " != " << current.top().name());
 				current.pop();
 			} else if(boost::regex_match(line.c_str(), what, re_macro_match)) {
 				std::string inner{what[1].first, what[1].second};
@@ -97,10 +97,10 @@ namespace
 				//		"flag": "@eval flag", 
 				//		"builder": "@eval builder", 
 				//		"imagestem": "@eval imagestem" }
-				//current.top()->add_attr(attribute, line);
+				//current.top().add_attr(attribute, line);
 				auto strs = split(inner, " ", SplitFlags::ALLOW_EMPTY_STRINGS);
-				current.emplace(current.top()->add_child(std::make_shared<node>("@merge")));
-				current.top()->add_attr("@call", strs[0]);
+				current.emplace(current.top().add_child("@merge"));
+				current.top().add_attr("@call", strs[0]);
 				auto it = strs.cbegin() + 1;
 				auto cache_it = cache.find(strs[0]);
 				if(cache_it != cache.end()) {
@@ -112,14 +112,14 @@ namespace
 						if(boost::regex_match(current_str.c_str(), what, re_parens_match)) {
 							current_str = std::string(what[1].first, what[1].second);
 						}
-						current.top()->add_attr(boost::to_lower_copy(*param_it), /*"@eval " + */current_str);
+						current.top().add_attr(boost::to_lower_copy(*param_it), /*"@eval " + */current_str);
 						++it;
 						++param_it;
 					}
 				} else {
 					for(const auto& str : strs) {
 						if(boost::regex_match(str.c_str(), what, re_macro_match)) {
-							current.top()->add_attr("@call", "@eval " + std::string(what[1].first, what[1].second));
+							current.top().add_attr("@call", "@eval " + std::string(what[1].first, what[1].second));
 						} else {
 							ASSERT_LOG(false, "derp");
 						}
@@ -153,11 +153,11 @@ namespace
 						if(quote_pos_start != std::string::npos && quote_pos_end != std::string::npos) {
 							value = value.substr(quote_pos_start+1, quote_pos_end - (quote_pos_start + 1));
 						}
-						current.top()->add_attr(attribute, (is_translateable ? "~" : "") + value + (is_translateable ? "~" : ""));
+						current.top().add_attr(attribute, (is_translateable ? "~" : "") + value + (is_translateable ? "~" : ""));
 					}
 				} else {
 					// no '=' probably just a macro replace
-					current.top()->add_attr(attribute, line);
+					current.top().add_attr(attribute, line);
 				}
 			}
 		}
@@ -167,8 +167,6 @@ namespace
 
 }
 
-extern variant read_wml(const std::string& filename, const std::string& contents, int line_offset);
-
 std::string convert_macro_string(const std::string& str)
 {
 	boost::match_results<std::string::const_iterator> what;
@@ -191,11 +189,12 @@ std::string convert_macro_string(const std::string& str)
 
 void parse_terrain_files(const std::string& terrain_graphics_macros_dir, const std::string& terrain_graphics_file)
 {
-	sys::file_path_map fpm;
-	sys::get_unique_files(terrain_graphics_macros_dir, fpm);
-	for(const auto& p : fpm) {
+	sys::file_info_map fim;
+	sys::get_unique_files_parallel(terrain_graphics_macros_dir, fim);
+	for(const auto& p : fim) {
 		if(p.first.find(".cfg") != std::string::npos) {
-			pre_process_wml(p.first, sys::read_file(p.second));
+			sys::mapped_file mf(p.second.path);
+			pre_process_wml(p.first, mf.begin(), mf.end());
 		}
 	}
 
@@ -211,25 +210,25 @@ void parse_terrain_files(const std::string& terrain_graphics_macros_dir, const s
 		ss << "); " << it->second->getDefinition();
 		LOG_INFO(ss.str());
 
-		node_ptr root = read_wml_macro("@macro " + it->first, it->second->getDefinition());
+		node_tree_ptr root = read_wml_macro("@macro " + it->first, it->second->getDefinition());
 		std::stack<variant_builder> tags;
 		tags.emplace();
-		root->post_order_traversal<std::stack<variant_builder>>([](node_ptr n, std::stack<variant_builder>& tags) {
+		root->root().post_order_traversal<std::stack<variant_builder>>([](const node& n, std::stack<variant_builder>& tags) {
 			tags.emplace();
-		}, [it](node_ptr n, std::stack<variant_builder>& tags) {
-			if(n->attributes().size() == 1) {
+		}, [it](const node& n, std::stack<variant_builder>& tags) {
+			if(n.attributes().size() == 1) {
 				auto old_vb = tags.top();
 				tags.pop();
-				const auto& p = *n->attributes().begin();
-				tags.top().add(n->name(), convert_macro_string(p.second));
+				const auto& a = *n.attributes().begin();
+				tags.top().add(n.name(), convert_macro_string(a.value));
 			} else {
-				for(const auto& p : n->attributes()) {
-					auto str = convert_macro_string(p.second);
-					tags.top().add(p.first, str);
+				for(const auto& a : n.attributes()) {
+					auto str = convert_macro_string(a.value);
+					tags.top().add(*a.key, str);
 				}
 				auto old_vb = tags.top();
 				tags.pop();
-				tags.top().add(n->name(), old_vb.build());
+				tags.top().add(n.name(), old_vb.build());
 			}
 		}, tags);
 		variant terrain_graphics = tags.top().build();
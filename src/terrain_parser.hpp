@@ -1,12 +1,15 @@
 #pragma once
 
 #include <algorithm>
+#include <array>
+#include <cstdint>
 #include <iostream>
 #include <functional>
 #include <map>
 #include <memory>
 #include <stack>
 #include <string>
+#include <unordered_set>
 #include <vector>
 
 #include "variant.hpp"
@@ -41,6 +44,7 @@ extern macro_cache_type& get_macro_cache();
 
 extern void parse_terrain_files(const std::string& terrain_graphics_macros_dir, const std::string& terrain_graphics_file);
 extern void pre_process_wml(const std::string& filename, const std::string& contents);
+extern void pre_process_wml(const std::string& filename, const char* begin, const char* end);
 
 enum class SplitFlags {
 	NONE					= 0,
@@ -48,57 +52,227 @@ enum class SplitFlags {
 };
 
 extern std::vector<std::string> split(const std::string& str, const std::string& delimiters, SplitFlags flags);
+extern std::vector<std::string> split(const char* begin, const char* end, const std::string& delimiters, SplitFlags flags);
 
-class node;
-typedef std::shared_ptr<node> node_ptr;
+class node_tree;
+typedef std::shared_ptr<node_tree> node_tree_ptr;
 
-class node : public std::enable_shared_from_this<node>
+struct node_attribute
+{
+	node_attribute() : key(nullptr), value() {}
+	// interned by the node_tree, so keys from the same tree compare by address.
+	const std::string* key;
+	std::string value;
+};
+
+// A node's attributes, in key order. Tags mostly have a handful, so the first few live
+// in the node itself and lookups are a linear search.
+class attribute_list
 {
 public:
-	explicit node(const std::string& name) : name_(name), children_(), attr_(), parent_() {}
-	const std::string& name() const { return name_; }
-	node_ptr add_child(const node_ptr& child) {
-		child->set_parent(shared_from_this()); 
-		children_.emplace_back(child);
-		return child;
-	}
-	node_ptr parent() const {
-		auto p = parent_.lock();
-		return p;
-	}
-	void add_attr(const std::string& a, const std::string& v) {
-		attr_[a] = v;
-	}
-	const std::map<std::string, std::string>& attributes() const { return attr_; }
-	template<typename T>
-	bool pre_order_traversal(std::function<bool(node_ptr, T& param)> fn, T& param) {
-		if(!fn(shared_from_this(), param)) {
-			return false;
-		}
-		for(auto& c : children_) {
-			if(!c->pre_order_traversal(fn, param)) {
+	attribute_list() : size_(0), inline_(), more_() {}
+	const node_attribute* begin() const { return size_ <= inline_size ? inline_.data() : more_.data(); }
+	const node_attribute* end() const { return begin() + size_; }
+	size_t size() const { return size_; }
+	bool empty() const { return size_ == 0; }
+	// nullptr if the key isn't there.
+	const std::string* find(const std::string* key) const;
+	// Adds the attribute, or replaces its value if the key is already there.
+	void set(const std::string* key, const std::string& value);
+private:
+	static const size_t inline_size = 4;
+	size_t size_;
+	std::array<node_attribute, inline_size> inline_;
+	// all of them, once there are more than fit inline.
+	std::vector<node_attribute> more_;
+};
+
+// A node of a node_tree, which is just the tree and the node's index in it. It doesn't
+// own anything, so copying one is cheap and the tree has to outlive it.
+class node
+{
+public:
+	node() : tree_(nullptr), index_(0) {}
+	node(node_tree* tree, uint32_t index) : tree_(tree), index_(index) {}
+	explicit operator bool() const { return tree_ != nullptr; }
+	bool operator==(const node& other) const { return tree_ == other.tree_ && index_ == other.index_; }
+	bool operator!=(const node& other) const { return !(*this == other); }
+
+	const std::string& name() const;
+	// null for the root.
+	node parent() const;
+	// null if there are none.
+	node first_child() const;
+	node next_sibling() const;
+	node add_child(const std::string& name) const;
+	void add_attr(const std::string& a, const std::string& v) const;
+	const attribute_list& attributes() const;
+
+	// Visit the subtree rooted here without recursing: the parent and sibling links say
+	// where to go next, so deep nesting needs no stack. fn and fn1 are called as a node
+	// is entered and fn2 once all its children are done. pre_order_traversal stops as
+	// soon as fn returns false, and returns false if it did.
+	template<typename T, typename Fn>
+	bool pre_order_traversal(Fn fn, T& param) const {
+		node n = *this;
+		for(;;) {
+			if(!fn(static_cast<const node&>(n), param)) {
 				return false;
 			}
+			node next = n.first_child();
+			while(!next) {
+				if(n == *this) {
+					return true;
+				}
+				next = n.next_sibling();
+				if(!next) {
+					n = n.parent();
+				}
+			}
+			n = next;
 		}
-		return true;
 	}
-	template<typename T>
-	void post_order_traversal(std::function<void(node_ptr, T& param)> fn1, std::function<void(node_ptr, T& param)> fn2, T& param) {
-		fn1(shared_from_this(), param);
-		for(auto& c : children_) {
-			c->post_order_traversal(fn1, fn2, param);
+	template<typename T, typename Fn1, typename Fn2>
+	void post_order_traversal(Fn1 fn1, Fn2 fn2, T& param) const {
+		node n = *this;
+		fn1(static_cast<const node&>(n), param);
+		for(;;) {
+			node next = n.first_child();
+			while(!next) {
+				fn2(static_cast<const node&>(n), param);
+				if(n == *this) {
+					return;
+				}
+				next = n.next_sibling();
+				if(!next) {
+					n = n.parent();
+				}
+			}
+			n = next;
+			fn1(static_cast<const node&>(n), param);
 		}
-		fn2(shared_from_this(), param);
 	}
-protected:
-	void set_parent(node_ptr parent) { parent_ = parent; }
 private:
-	std::string name_;
-	std::vector<node_ptr> children_;
-	std::map<std::string, std::string> attr_;
-	std::weak_ptr<node> parent_;
+	node_tree* tree_;
+	uint32_t index_;
 };
 
+// The nodes of a tree in one vector, in the order they were added, linked by index to
+// their parent, first child and next sibling. Node 0 is the root.
+class node_tree
+{
+public:
+	explicit node_tree(const std::string& root_name, size_t capacity=1);
+	node root() { return node(this, 0); }
+	size_t size() const { return nodes_.size(); }
+	// Adding nodes may move the vector, so a tree being built mustn't be read from
+	// other threads.
+	void reserve(size_t n) { nodes_.reserve(n); }
+	// The tree's copy of an attribute name.
+	const std::string* intern(const std::string& key) { return &*keys_.insert(key).first; }
+private:
+	friend class node;
+	static const uint32_t npos = 0xffffffff;
+	struct entry
+	{
+		explicit entry(const std::string& n, uint32_t p) : name(n), attr(), parent(p), first_child(npos), last_child(npos), next_sibling(npos) {}
+		std::string name;
+		attribute_list attr;
+		uint32_t parent;
+		uint32_t first_child;
+		uint32_t last_child;
+		uint32_t next_sibling;
+	};
+	std::vector<entry> nodes_;
+	std::unordered_set<std::string> keys_;
+};
+
+inline const std::string& node::name() const
+{
+	return tree_->nodes_[index_].name;
+}
+
+inline node node::parent() const
+{
+	const uint32_t p = tree_->nodes_[index_].parent;
+	return p == node_tree::npos ? node() : node(tree_, p);
+}
+
+inline node node::first_child() const
+{
+	const uint32_t c = tree_->nodes_[index_].first_child;
+	return c == node_tree::npos ? node() : node(tree_, c);
+}
+
+inline node node::next_sibling() const
+{
+	const uint32_t s = tree_->nodes_[index_].next_sibling;
+	return s == node_tree::npos ? node() : node(tree_, s);
+}
+
+inline const attribute_list& node::attributes() const
+{
+	return tree_->nodes_[index_].attr;
+}
+
+// Incremental version of read_wml2(). Expanded WML can be fed in as it becomes available
+// (in whole lines), and each top-level tag is handed to the child callback as soon as it
+// can't be changed any more -- that is once the next top-level tag opens, or on finish().
+// With a callback set each top-level tag is built as a tree of its own, rooted at the tag,
+// rather than under the document root, so it can be read while parsing carries on.
+// A [+tag] merging into a top-level tag that was already handed on can't be applied; the
+// parser then stops, needs_reparse() is true and the input has to go through read_wml2().
+class wml_parser
+{
+public:
+	typedef std::function<void(const node_tree_ptr&)> child_fn;
+	wml_parser();
+	void set_child_callback(child_fn fn);
+	// Room for this many tags, so the tree is built without moving.
+	void reserve(size_t n);
+	void feed(const std::string& contents);
+	node_tree_ptr finish();
+	bool needs_reparse() const { return needs_reparse_; }
+private:
+	void parse_line(std::string& line);
+	void emit_pending_child();
+
+	node_tree_ptr tree_;
+	std::stack<node> current_;
+	bool in_multi_line_string_;
+	bool is_translateable_ml_string_;
+	std::string ml_string_;
+	std::string attribute_;
+	int expect_merge_;
+	// last node seen with each tag name, along with which top-level tag it lives under.
+	std::map<std::string, std::pair<node, size_t>> last_node_;
+	child_fn child_fn_;
+	node_tree_ptr pending_child_;
+	size_t child_count_;
+	bool needs_reparse_;
+};
+
+class variant_builder;
+
+extern variant read_wml(const std::string& filename, const std::string& contents, int line_offset=0);
+extern node_tree_ptr read_wml2(const std::string& contents);
+extern std::string macro_substitute(const std::string& contents);
+extern void macro_substitute(const std::string& contents, std::ostream& os);
+// Applies the per-attribute conversions (center, layer, name decoding, ...) for a node,
+// as given by the attribute schema.
+extern void convert_attributes(const node& n, variant_builder& vb);
+// Converts the subtree rooted at n to a variant, as the whole-document conversion would.
+extern variant convert_node(const node& n);
+// convert_node() with the children of n converted concurrently, each on a builder of its
+// own, and put together in source order. threads == 0 means use
+// std::thread::hardware_concurrency().
+extern variant convert_tree(const node& n, int threads=0);
+// Writes convert_node(n) as variant::write_json(os, pretty, indent) would, converting the
+// attributes of each node as it's written so the variant tree is never built. extra is
+// written as though they were attributes of n. The children of n are written in parallel,
+// threads == 0 means use std::thread::hardware_concurrency().
+extern void write_node_json(std::ostream& os, const node& n, bool pretty=true, int indent=0, int threads=0, const std::map<variant, variant>& extra=std::map<variant, variant>());
+
 extern std::map<variant, variant> process_name_string(const std::string& s);
 extern variant to_list_string(const std::string& s, const std::string& sep=",", SplitFlags flags=SplitFlags::NONE);
 extern variant to_list_int(const std::string& s, const std::string& sep=",");
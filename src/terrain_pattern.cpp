@@ -0,0 +1,170 @@
+#include <boost/algorithm/string.hpp>
+
+#include "asserts.hpp"
+#include "terrain_parser.hpp"
+#include "terrain_pattern.hpp"
+#include "unit_test.hpp"
+
+namespace terrain
+{
+	namespace
+	{
+		const size_t max_layer_length = 4;
+
+		layer_code pack_layer(const std::string& s, size_t len)
+		{
+			layer_code res = 0;
+			for(size_t n = 0; n != len; ++n) {
+				res |= static_cast<layer_code>(static_cast<unsigned char>(s[n])) << (24 - 8 * n);
+			}
+			return res;
+		}
+
+		// Reads one layer of a pattern into its code and mask.
+		void read_pattern_layer(const std::string& s, const std::string& orig, layer_code& code, layer_code& mask)
+		{
+			const auto star = s.find('*');
+			const size_t len = star != std::string::npos ? star : s.size();
+			ASSERT_LOG(star == std::string::npos || star == s.size() - 1, "Wildcard must end the layer in terrain type: " << orig);
+			ASSERT_LOG(len <= max_layer_length, "Terrain code layer longer than " << max_layer_length << " characters: " << orig);
+			mask = star == std::string::npos ? no_layer : (len == 0 ? 0 : no_layer << (32 - 8 * len));
+			code = pack_layer(s, len) & mask;
+		}
+
+		pattern_item read_pattern_item(const std::string& s)
+		{
+			pattern_item res;
+			if(s == "*") {
+				res.mask = terrain_code(0, 0);
+				res.code = terrain_code(0, 0);
+				return res;
+			}
+			const auto caret = s.find('^');
+			if(caret == std::string::npos) {
+				read_pattern_layer(s, s, res.code.base, res.mask.base);
+			} else {
+				read_pattern_layer(s.substr(0, caret), s, res.code.base, res.mask.base);
+				read_pattern_layer(s.substr(caret + 1), s, res.code.overlay, res.mask.overlay);
+			}
+			return res;
+		}
+	}
+
+	terrain_code read_terrain_code(const std::string& s)
+	{
+		const auto caret = s.find('^');
+		const std::string base = s.substr(0, caret);
+		ASSERT_LOG(base.size() <= max_layer_length, "Terrain code layer longer than " << max_layer_length << " characters: " << s);
+		terrain_code res(pack_layer(base, base.size()), no_layer);
+		if(caret != std::string::npos) {
+			const std::string overlay = s.substr(caret + 1);
+			ASSERT_LOG(overlay.size() <= max_layer_length, "Terrain code layer longer than " << max_layer_length << " characters: " << s);
+			res.overlay = pack_layer(overlay, overlay.size());
+		}
+		return res;
+	}
+
+	std::string write_terrain_code(const terrain_code& c)
+	{
+		std::string res;
+		auto write_layer = [&res](layer_code layer) {
+			for(int shift = 24; shift >= 0 && ((layer >> shift) & 0xff) != 0; shift -= 8) {
+				res += static_cast<char>((layer >> shift) & 0xff);
+			}
+		};
+		write_layer(c.base);
+		if(c.overlay != no_layer) {
+			res += '^';
+			write_layer(c.overlay);
+		}
+		return res;
+	}
+
+	type_pattern compile_pattern(const std::vector<std::string>& types)
+	{
+		type_pattern res;
+		bool negate = false;
+		for(const auto& type : types) {
+			const std::string s = boost::trim_copy(type);
+			if(s == "!") {
+				negate = !negate;
+				continue;
+			}
+			if(s.empty()) {
+				continue;
+			}
+			res.items.emplace_back(read_pattern_item(s));
+			res.items.back().negate = negate;
+		}
+		res.otherwise = negate;
+		return res;
+	}
+
+	type_pattern compile_pattern(const std::string& s)
+	{
+		return compile_pattern(split(s, ",", SplitFlags::NONE));
+	}
+
+	variant pattern_to_variant(const type_pattern& p)
+	{
+		std::vector<variant> code, mask, negate;
+		for(const auto& item : p.items) {
+			code.emplace_back(static_cast<int64_t>(item.code.base));
+			code.emplace_back(static_cast<int64_t>(item.code.overlay));
+			mask.emplace_back(static_cast<int64_t>(item.mask.base));
+			mask.emplace_back(static_cast<int64_t>(item.mask.overlay));
+			negate.emplace_back(variant::from_bool(item.negate));
+		}
+		std::map<variant, variant> res;
+		res[variant("code")] = variant(&code);
+		res[variant("mask")] = variant(&mask);
+		res[variant("negate")] = variant(&negate);
+		res[variant("otherwise")] = variant::from_bool(p.otherwise);
+		return variant(&res);
+	}
+
+	type_pattern pattern_from_variant(const variant& v)
+	{
+		const auto& code = v["code"].as_list();
+		const auto& mask = v["mask"].as_list();
+		const auto& negate = v["negate"].as_list();
+		ASSERT_LOG(code.size() == negate.size() * 2 && mask.size() == code.size(), "Malformed terrain type pattern: " << v.write_json());
+		type_pattern res;
+		for(size_t n = 0; n != negate.size(); ++n) {
+			pattern_item item;
+			item.code = terrain_code(static_cast<layer_code>(code[n * 2].as_int()), static_cast<layer_code>(code[n * 2 + 1].as_int()));
+			item.mask = terrain_code(static_cast<layer_code>(mask[n * 2].as_int()), static_cast<layer_code>(mask[n * 2 + 1].as_int()));
+			item.negate = negate[n].as_bool();
+			res.items.emplace_back(item);
+		}
+		res.otherwise = v["otherwise"].as_bool();
+		return res;
+	}
+}
+
+UNIT_TEST(compile_pattern_matching)
+{
+	using terrain::compile_pattern;
+	using terrain::read_terrain_code;
+	const auto matches = [](const std::string& pattern, const std::string& code) {
+		return compile_pattern(pattern).matches(read_terrain_code(code));
+	};
+	CHECK(matches("Gg", "Gg"), "");
+	CHECK(!matches("Gg", "Gs"), "");
+	CHECK(!matches("Gg", "Gg^Vh"), "a code without '^' matches no overlay");
+	CHECK(matches("G*", "Gs") && matches("G*", "Gll"), "");
+	CHECK(!matches("G*", "Ww"), "");
+	CHECK(matches("*", "Gg^Vh") && matches("*", "Ww"), "");
+	CHECK(matches("*^V*", "Gg^Vh") && !matches("*^V*", "Gg") && !matches("*^V*", "Gg^Fp"), "");
+	CHECK(matches("Gg,Ww", "Ww") && !matches("Gg,Ww", "Wo"), "");
+	CHECK(matches("!,W*", "Gg") && !matches("!,W*", "Wo"), "");
+	// the first item matching decides, the last '!' decides the rest.
+	CHECK(!matches("!,Xu,!,X*", "Xu") && matches("!,Xu,!,X*", "Xv") && !matches("!,Xu,!,X*", "Gg"), "");
+
+	const auto p = compile_pattern("!,Xu,!,X*^*");
+	const auto back = terrain::pattern_from_variant(terrain::pattern_to_variant(p));
+	CHECK_EQ(back.items.size(), p.items.size());
+	for(const char* code : { "Xu", "Xv", "Xv^Fp", "Gg" }) {
+		CHECK_EQ(back.matches(read_terrain_code(code)), p.matches(read_terrain_code(code)));
+	}
+}
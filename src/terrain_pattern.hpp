@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "variant.hpp"
+
+// Terrain codes and the tile type patterns which match them, i.e. type=!,W*,Ai or
+// type=*^_fme. Codes are packed into integers so a pattern can be matched against a hex
+// with a few masks and compares rather than by re-reading the wildcard syntax.
+namespace terrain
+{
+	// Each layer of a code holds up to 4 characters, packed first character in the top
+	// byte and padded with zeros, so "Wo" is 0x576f0000.
+	typedef uint32_t layer_code;
+	// The overlay of a code without one. No terrain code uses the character 0xff.
+	const layer_code no_layer = 0xffffffff;
+
+	struct terrain_code
+	{
+		terrain_code() : base(0), overlay(no_layer) {}
+		terrain_code(layer_code b, layer_code o) : base(b), overlay(o) {}
+		bool operator==(const terrain_code& rhs) const { return base == rhs.base && overlay == rhs.overlay; }
+		bool operator!=(const terrain_code& rhs) const { return !(*this == rhs); }
+		bool operator<(const terrain_code& rhs) const { return base < rhs.base || (base == rhs.base && overlay < rhs.overlay); }
+		layer_code base;
+		layer_code overlay;
+	};
+
+	// Reads a code like "Gg^Efm", "Wo" or "^Vh". Asserts on a layer longer than 4 characters.
+	terrain_code read_terrain_code(const std::string& s);
+	std::string write_terrain_code(const terrain_code& c);
+
+	// One entry in a type list. A '*' matches any remaining characters of its layer, so
+	// the masks are zero from there on. Without a '^' the code must not have an overlay;
+	// "*" on its own matches everything.
+	struct pattern_item
+	{
+		pattern_item() : code(), mask(no_layer, no_layer), negate(false) {}
+		bool matches(const terrain_code& c) const {
+			return (c.base & mask.base) == code.base && (c.overlay & mask.overlay) == code.overlay;
+		}
+		// already masked.
+		terrain_code code;
+		terrain_code mask;
+		// set when an odd number of '!' come before the item, a hex matching it then
+		// fails the pattern.
+		bool negate;
+	};
+
+	// The items are tried in order and the first to match decides. If none does the result
+	// is otherwise, which is true when the list holds an odd number of '!'.
+	struct type_pattern
+	{
+		type_pattern() : items(), otherwise(false) {}
+		bool matches(const terrain_code& c) const {
+			for(const auto& item : items) {
+				if(item.matches(c)) {
+					return !item.negate;
+				}
+			}
+			return otherwise;
+		}
+		std::vector<pattern_item> items;
+		bool otherwise;
+	};
+
+	type_pattern compile_pattern(const std::vector<std::string>& types);
+	type_pattern compile_pattern(const std::string& s);
+
+	// The compiled form written next to type in each [tile], the items as parallel lists:
+	//   {"code": [base, overlay, ...], "mask": [base, overlay, ...], "negate": [...], "otherwise": false}
+	variant pattern_to_variant(const type_pattern& p);
+	type_pattern pattern_from_variant(const variant& v);
+}
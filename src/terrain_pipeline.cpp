@@ -0,0 +1,501 @@
+#include <algorithm>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <thread>
+
+#include <boost/filesystem.hpp>
+
+#include "asserts.hpp"
+#include "filesystem.hpp"
+#include "image_path.hpp"
+#include "pipeline.hpp"
+#include "profiler.hpp"
+#include "rule_index.hpp"
+#include "terrain_parser.hpp"
+#include "terrain_pipeline.hpp"
+#include "unit_test.hpp"
+#include "variant.hpp"
+
+namespace pipeline
+{
+	namespace
+	{
+		// Expansion works on whole lines, so the source is cut into chunks of about this
+		// many bytes, ending on a newline.
+		const size_t source_chunk_size = 32 * 1024;
+
+		// the macro files go to the harvester still mapped, rather than copied.
+		typedef std::pair<std::string, std::shared_ptr<sys::mapped_file>> named_file;
+		typedef std::pair<size_t, std::string> text_chunk;
+
+		// A top-level tag, the root of a tree of its own or, after a serial reparse, a child
+		// of the document root. A null tag tells the write stage to start again.
+		struct parsed_tag
+		{
+			parsed_tag() : seq(0), tree(), tag() {}
+			parsed_tag(size_t s, node_tree_ptr t, node n) : seq(s), tree(std::move(t)), tag(n) {}
+			size_t seq;
+			node_tree_ptr tree;
+			node tag;
+		};
+
+		// A top-level tag converted and serialized by the convert stage, at the indent it has
+		// as a list element, which is the common case.
+		struct converted_tag
+		{
+			converted_tag() : seq(0), name(), text(), tree(), tag(), patterns() {}
+			size_t seq;
+			std::string name;
+			std::string text;
+			node_tree_ptr tree;
+			node tag;
+			// for a [terrain_graphics].
+			terrain::rule_patterns patterns;
+		};
+
+		// Collects the serialized top-level tags for the final document. A tag name only
+		// seen once is written directly rather than as a list, matching variant_builder, so
+		// we hold on to the tree of the first tag of each name to write it again at the
+		// indent of a map value.
+		class document_writer
+		{
+		public:
+			void add(const std::string& name, std::string text, const node_tree_ptr& tree, const node& tag)
+			{
+				auto& out = outputs_[variant(name)];
+				if(out.elements.empty()) {
+					out.first_tree = tree;
+					out.first_tag = tag;
+				}
+				out.elements.emplace_back(std::move(text));
+			}
+
+			void add(const std::string& name, const variant& value)
+			{
+				auto& out = outputs_[variant(name)];
+				if(out.elements.empty()) {
+					out.first = value;
+				}
+				out.elements.emplace_back(value.write_json(true, 12));
+			}
+
+			// Writes the document exactly as variant::write_json(true, 4) would write the
+			// map built from the tags.
+			void write(std::ostream& os) const
+			{
+				os << "{\n" << std::string(4, ' ');
+				for(auto it = outputs_.cbegin(); it != outputs_.cend(); ++it) {
+					if(it != outputs_.cbegin()) {
+						os << ",\n" << std::string(4, ' ');
+					}
+					it->first.write_json(os, true, 8);
+					os << ": ";
+					if(it->second.elements.size() == 1) {
+						if(it->second.first_tree) {
+							write_node_json(os, it->second.first_tag, true, 8, 1);
+						} else {
+							it->second.first.write_json(os, true, 8);
+						}
+						continue;
+					}
+					os << "[\n" << std::string(8, ' ');
+					for(auto eit = it->second.elements.cbegin(); eit != it->second.elements.cend(); ++eit) {
+						if(eit != it->second.elements.cbegin()) {
+							os << ",\n" << std::string(8, ' ');
+						}
+						os << *eit;
+					}
+					os << "\n" << std::string(4, ' ') << "]";
+				}
+				os << "\n}";
+			}
+		private:
+			struct tag_output
+			{
+				variant first;
+				node_tree_ptr first_tree;
+				node first_tag;
+				std::vector<std::string> elements;
+			};
+			std::map<variant, tag_output> outputs_;
+		};
+	}
+
+	void convert_terrain_files(const std::string& base_path,
+		const std::string& terrain_type_file,
+		const std::string& terrain_graphics_file,
+		const std::string& terrain_graphics_macros_dir,
+		int threads)
+	{
+		const auto start = clock::now();
+		if(threads <= 0) {
+			threads = std::max<int>(1, std::thread::hardware_concurrency());
+		}
+		// Converting and serializing the tags is most of the work, expanding macros about a
+		// twentieth of it and the other stages are a single thread each which mostly waits,
+		// so convert gets everything expansion doesn't.
+		const int nexpand = std::max(1, threads / 8);
+		const int nconvert = std::max(1, threads - nexpand);
+
+		bounded_queue<named_file> macro_files("macro files", 16);
+		bounded_queue<text_chunk> source_chunks("source chunks", 32);
+		bounded_queue<text_chunk> expanded_chunks("expanded chunks", 32, nexpand);
+		bounded_queue<parsed_tag> parsed_tags("parsed tags", 256);
+		bounded_queue<converted_tag> converted_tags("converted tags", 256, nconvert);
+
+		stage types_stage("terrain types", 1);
+		stage read_stage("read", 1);
+		stage harvest_stage("harvest macros", 1);
+		stage expand_stage("expand macros", nexpand);
+		stage parse_stage("parse wml", 1);
+		stage convert_stage("convert", nconvert);
+		stage write_stage("write json", 1);
+		stage index_stage("index rules", 1);
+
+		std::promise<void> macros_ready;
+		std::shared_future<void> macros_ready_future = macros_ready.get_future().share();
+		// the rule index is built from the codes in terrain.cfg once every rule is converted.
+		std::promise<std::vector<terrain::terrain_code>> terrain_codes;
+		auto terrain_codes_future = terrain_codes.get_future();
+
+		std::vector<std::thread> workers;
+
+		// terrain.cfg doesn't depend on anything else, so it goes through on its own.
+		workers.emplace_back([&]() {
+			PROFILE_THREAD_NAME("terrain types");
+			PROFILE_ZONE("terrain types");
+			const auto t = clock::now();
+			variant terrain_types = read_wml(terrain_type_file, sys::read_file(base_path + terrain_type_file));
+			sys::file_sink sink(terrain_type_file);
+			terrain_types.write_json(sink.stream(), true, 4);
+			sink.commit();
+			terrain_codes.set_value(terrain::get_terrain_codes(terrain_types));
+			types_stage.add(seconds_since(t));
+		});
+
+		workers.emplace_back([&]() {
+			PROFILE_THREAD_NAME("read");
+			auto t = clock::now();
+			sys::file_info_map fim;
+			{
+				PROFILE_ZONE("list macro files");
+				sys::get_unique_files_parallel(base_path + terrain_graphics_macros_dir, fim);
+			}
+			double busy = seconds_since(t);
+			for(const auto& p : fim) {
+				if(p.first.find(".cfg") != std::string::npos) {
+					t = clock::now();
+					named_file nf;
+					{
+						PROFILE_ZONE("read macro file");
+						nf = named_file(p.first, std::make_shared<sys::mapped_file>(p.second.path));
+						PROFILE_COUNTER("bytes", nf.second->size());
+					}
+					busy += seconds_since(t);
+					macro_files.push(std::move(nf));
+				}
+			}
+			macro_files.close();
+
+			t = clock::now();
+			sys::mapped_file mf(base_path + terrain_graphics_file);
+			busy += seconds_since(t);
+			size_t seq = 0;
+			for(const char* p = mf.begin(); p != mf.end(); ) {
+				t = clock::now();
+				const char* e = p + std::min<size_t>(source_chunk_size, mf.end() - p);
+				e = std::find(e, mf.end(), '\n');
+				if(e != mf.end()) {
+					++e;
+				}
+				text_chunk chunk(seq++, std::string(p, e));
+				busy += seconds_since(t);
+				source_chunks.push(std::move(chunk));
+				p = e;
+			}
+			source_chunks.close();
+			read_stage.add(busy, fim.size() + seq);
+		});
+
+		// get_macro_cache() isn't safe to add to from several threads, so there is a single
+		// harvester. Expansion can't start until every macro is known.
+		workers.emplace_back([&]() {
+			PROFILE_THREAD_NAME("harvest macros");
+			named_file nf;
+			while(macro_files.pop(nf)) {
+				const auto t = clock::now();
+				pre_process_wml(nf.first, nf.second->begin(), nf.second->end());
+				harvest_stage.add(seconds_since(t));
+			}
+			macros_ready.set_value();
+		});
+
+		for(int n = 0; n != nexpand; ++n) {
+			workers.emplace_back([&]() {
+				PROFILE_THREAD_NAME("expand macros");
+				macros_ready_future.wait();
+				text_chunk chunk;
+				while(source_chunks.pop(chunk)) {
+					const auto t = clock::now();
+					chunk.second = macro_substitute(chunk.second);
+					expand_stage.add(seconds_since(t));
+					expanded_chunks.push(std::move(chunk));
+				}
+				expanded_chunks.close();
+			});
+		}
+
+		workers.emplace_back([&]() {
+			PROFILE_THREAD_NAME("parse wml");
+			sys::file_sink test_sink("test.cfg");
+			wml_parser parser;
+			size_t seq = 0;
+			parser.set_child_callback([&](const node_tree_ptr& n) {
+				parsed_tags.push(parsed_tag(seq++, n, n->root()));
+			});
+			reorder_buffer<std::string> pending;
+			text_chunk chunk;
+			std::string text;
+			while(expanded_chunks.pop(chunk)) {
+				pending.put(chunk.first, std::move(chunk.second));
+				while(pending.next(text)) {
+					const auto t = clock::now();
+					test_sink.write(text);
+					parser.feed(text);
+					parse_stage.add(seconds_since(t));
+				}
+			}
+			ASSERT_LOG(pending.empty(), "Expanded chunks missing from the pipeline");
+			{
+				PROFILE_ZONE("wml_parser::finish");
+				parser.finish();
+			}
+			test_sink.commit();
+			if(parser.needs_reparse()) {
+				// a merge into a tag that was already converted, so throw away what the
+				// write stage has and parse it all again in one go.
+				LOG_INFO("A [+tag] merges into an earlier top-level tag, parsing test.cfg again serially.");
+				const auto t = clock::now();
+				parsed_tags.push(parsed_tag(seq++, node_tree_ptr(), node()));
+				node_tree_ptr tree = read_wml2(sys::read_file("test.cfg"));
+				for(node c = tree->root().first_child(); c; c = c.next_sibling()) {
+					parsed_tags.push(parsed_tag(seq++, tree, c));
+				}
+				parse_stage.add(seconds_since(t));
+			}
+			parsed_tags.close();
+		});
+
+		for(int n = 0; n != nconvert; ++n) {
+			workers.emplace_back([&]() {
+				PROFILE_THREAD_NAME("convert");
+				parsed_tag tag;
+				while(parsed_tags.pop(tag)) {
+					const auto t = clock::now();
+					converted_tag ct;
+					ct.seq = tag.seq;
+					ct.tag = tag.tag;
+					if(ct.tag) {
+						ct.name = ct.tag.name();
+						std::ostringstream ss;
+						write_node_json(ss, ct.tag, true, 12, 1);
+						ct.text = ss.str();
+						if(ct.name == "terrain_graphics") {
+							ct.patterns = terrain::get_rule_patterns(ct.tag);
+						}
+					}
+					ct.tree = std::move(tag.tree);
+					convert_stage.add(seconds_since(t));
+					converted_tags.push(std::move(ct));
+				}
+				converted_tags.close();
+			});
+		}
+
+		workers.emplace_back([&]() {
+			PROFILE_THREAD_NAME("write json");
+			document_writer doc;
+			reorder_buffer<converted_tag> pending;
+			std::vector<terrain::rule_patterns> rules;
+			converted_tag ct;
+			while(converted_tags.pop(ct)) {
+				pending.put(ct.seq, std::move(ct));
+				while(pending.next(ct)) {
+					PROFILE_ZONE("serialize tag");
+					const auto t = clock::now();
+					if(!ct.tag) {
+						doc = document_writer();
+						rules.clear();
+						continue;
+					}
+					doc.add(ct.name, std::move(ct.text), ct.tree, ct.tag);
+					if(ct.name == "terrain_graphics") {
+						rules.emplace_back(std::move(ct.patterns));
+					}
+					ct.tree.reset();
+					write_stage.add(seconds_since(t));
+				}
+			}
+			ASSERT_LOG(pending.empty(), "Converted tags missing from the pipeline");
+			{
+				const auto codes = terrain_codes_future.get();
+				const auto t = clock::now();
+				doc.add("terrain_rule_index", terrain::index_to_variant(terrain::build_rule_index(codes, rules, threads)));
+				index_stage.add(seconds_since(t));
+			}
+			PROFILE_ZONE("write document");
+			const auto t = clock::now();
+			sys::file_sink sink(terrain_graphics_file);
+			doc.write(sink.stream());
+			sink.commit();
+			write_stage.add(seconds_since(t), 0);
+		});
+
+		for(auto& w : workers) {
+			w.join();
+		}
+
+		std::vector<stage_stats> stages;
+		for(auto s : { &types_stage, &read_stage, &harvest_stage, &expand_stage, &parse_stage, &convert_stage, &write_stage, &index_stage }) {
+			stages.emplace_back(s->stats());
+		}
+		std::vector<queue_stats> queues;
+		queues.emplace_back(macro_files.stats());
+		queues.emplace_back(source_chunks.stats());
+		queues.emplace_back(expanded_chunks.stats());
+		queues.emplace_back(parsed_tags.stats());
+		queues.emplace_back(converted_tags.stats());
+		report(std::cerr, stages, queues, seconds_since(start));
+		const auto names = ipf::get_name_cache_stats();
+		std::cerr << "image name cache: " << names.entries << " entries, " << names.hits << " hits, " << names.misses << " misses (" << (names.hit_rate() * 100.0) << "% hit rate)\n";
+	}
+}
+
+UNIT_TEST(pipeline_matches_serial)
+{
+	namespace fs = boost::filesystem;
+	const fs::path dir = fs::temp_directory_path() / fs::unique_path("pipeline_test_%%%%-%%%%-%%%%");
+	const auto put = [&dir](const std::string& name, const std::string& data) {
+		const fs::path p = dir / "in" / name;
+		fs::create_directories(p.parent_path());
+		std::ofstream(p.string(), std::ios_base::binary) << data;
+	};
+	put("terrain.cfg", "[terrain_type]\n\tstring=Gg\n[/terrain_type]\n[terrain_type]\n\tstring=Ww\n[/terrain_type]\n");
+	put("macros/rules.cfg",
+		"#define PIPELINE_TEST_RULE TERRAIN IMAGE\n"
+		"[terrain_graphics]\n\tmap=\", 1\n1, .\"\n\trotations=n,ne,se,s,sw,nw\n"
+		"\t[tile]\n\t\tpos=1\n\t\ttype={TERRAIN}\n\t\tset_no_flag=base-@R0\n\t[/tile]\n"
+		"\t[image]\n\t\tname={IMAGE}-@R0.png~CROP(0,0,72,72):100\n\t\tlayer=-500\n\t[/image]\n"
+		"[/terrain_graphics]\n"
+		"#enddef\n");
+
+	// the pipeline writes to the working directory, as the serial conversion does.
+	const fs::path old_dir = fs::current_path();
+	fs::current_path(dir);
+	const std::string base_path = (dir / "in").string() + "/";
+	const auto check = [&](const std::string& graphics) {
+		put("graphics.cfg", graphics);
+		for(int threads : { 1, 4 }) {
+			// macros are harvested into the global cache, which refuses to define one twice.
+			get_macro_cache().erase("PIPELINE_TEST_RULE");
+			pipeline::convert_terrain_files(base_path, "terrain.cfg", "graphics.cfg", "macros", threads);
+
+			const std::string expanded = macro_substitute(sys::read_file(base_path + "graphics.cfg"));
+			const node_tree_ptr rt = read_wml2(expanded);
+			std::vector<terrain::rule_patterns> rules;
+			for(node rule = rt->root().first_child(); rule; rule = rule.next_sibling()) {
+				if(rule.name() == "terrain_graphics") {
+					rules.emplace_back(terrain::get_rule_patterns(rule));
+				}
+			}
+			const auto codes = terrain::get_terrain_codes(read_wml("terrain.cfg", sys::read_file(base_path + "terrain.cfg")));
+			std::map<variant, variant> extra;
+			extra[variant("terrain_rule_index")] = terrain::index_to_variant(terrain::build_rule_index(codes, rules, 1));
+			std::ostringstream serial;
+			write_node_json(serial, rt->root(), true, 4, 1, extra);
+
+			CHECK(sys::read_file("test.cfg") == expanded, "expanded WML differs with " << threads << " threads");
+			CHECK(sys::read_file("graphics.cfg") == serial.str(), "output differs from the serial conversion with " << threads << " threads");
+		}
+	};
+
+	std::ostringstream adjacent;
+	for(int n = 0; n != 300; ++n) {
+		adjacent << "{PIPELINE_TEST_RULE " << (n % 2 ? "Gg" : "Ww") << " tiles/t" << n << "}\n";
+		if(n % 7 == 0) {
+			adjacent << "[+terrain_graphics]\n\tprobability=" << n % 100 << "\n[/terrain_graphics]\n";
+		}
+	}
+	check(adjacent.str());
+
+	// a merge into a top-level tag which isn't the last one, which the pipeline can only
+	// apply by parsing again.
+	check(adjacent.str() + "[terrain_type]\n\tstring=Hh\n[/terrain_type]\n[+terrain_graphics]\n\tprobability=1\n[/terrain_graphics]\n");
+
+	fs::current_path(old_dir);
+	fs::remove_all(dir);
+}
+
+UNIT_TEST(bounded_queue_and_reorder_buffer)
+{
+	const int producers = 3, per_producer = 2000;
+	pipeline::bounded_queue<int> q("test", 4, producers);
+	std::vector<std::thread> threads;
+	for(int p = 0; p != producers; ++p) {
+		threads.emplace_back([&q, p]() {
+			for(int n = 0; n != per_producer; ++n) {
+				q.push(p * per_producer + n);
+			}
+			q.close();
+		});
+	}
+	// two consumers, each seeing every producer's items in the order they were pushed.
+	std::vector<int> seen[2];
+	for(auto& s : seen) {
+		threads.emplace_back([&q, &s]() {
+			int v;
+			while(q.pop(v)) {
+				s.push_back(v);
+			}
+		});
+	}
+	for(auto& t : threads) {
+		t.join();
+	}
+	std::vector<int> all;
+	for(const auto& s : seen) {
+		std::vector<int> last(producers, -1);
+		for(int v : s) {
+			CHECK(v > last[v / per_producer], "items from one producer were reordered");
+			last[v / per_producer] = v;
+		}
+		all.insert(all.end(), s.begin(), s.end());
+	}
+	std::sort(all.begin(), all.end());
+	CHECK_EQ(all.size(), static_cast<size_t>(producers * per_producer));
+	for(int n = 0; n != static_cast<int>(all.size()); ++n) {
+		CHECK_EQ(all[n], n);
+	}
+	const auto stats = q.stats();
+	CHECK_EQ(stats.items, all.size());
+	CHECK(stats.max_occupancy >= 1 && stats.max_occupancy <= 4, "occupancy went past the capacity: " << stats.max_occupancy);
+	int v;
+	CHECK(!q.pop(v), "pop() on a closed, drained queue should fail");
+
+	pipeline::reorder_buffer<std::string> rb;
+	std::string s;
+	CHECK(!rb.next(s) && rb.empty(), "");
+	for(size_t seq : { 2, 0, 3 }) {
+		rb.put(seq, std::to_string(seq));
+	}
+	CHECK(rb.next(s) && s == "0", "");
+	CHECK(!rb.next(s), "1 hasn't arrived, so nothing else should come out");
+	rb.put(1, "1");
+	for(const char* expected : { "1", "2", "3" }) {
+		CHECK(rb.next(s) && s == expected, "expected " << expected << ", got " << s);
+	}
+	CHECK(!rb.next(s) && rb.empty(), "");
+}
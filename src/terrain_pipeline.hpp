@@ -0,0 +1,20 @@
+#pragma once
+
+#include <string>
+
+namespace pipeline
+{
+	// Pipelined version of the METHOD1 conversion in main(). File reading, macro harvesting,
+	// macro expansion, WML parsing, attribute conversion and JSON writing each run on their
+	// own thread(s), connected by bounded queues, and terrain.cfg is converted alongside.
+	// Each tag is converted straight to JSON text by the convert stage, which gets all the
+	// threads but an eighth kept for expansion, since it's most of the work. The rule index
+	// is built once the last rule is converted.
+	// Output is identical to the serial conversion. Per-stage and per-queue statistics are
+	// written to stderr at the end. threads == 0 means use std::thread::hardware_concurrency().
+	void convert_terrain_files(const std::string& base_path,
+		const std::string& terrain_type_file,
+		const std::string& terrain_graphics_file,
+		const std::string& terrain_graphics_macros_dir,
+		int threads=0);
+}
@@ -0,0 +1,273 @@
+#include <algorithm>
+#include <numeric>
+#include <sstream>
+
+#include "asserts.hpp"
+#include "terrain_parser.hpp"
+#include "terrain_table.hpp"
+#include "unit_test.hpp"
+
+namespace terrain
+{
+	namespace
+	{
+		// Average number of codes per displacement bucket, and the slots per code.
+		const size_t codes_per_bucket = 4;
+		const double slots_per_code = 1.25;
+		const uint32_t max_displacement = 1 << 20;
+
+		struct entry
+		{
+			terrain_code code;
+			std::string id;
+			terrain_code default_base;
+			std::vector<terrain_code> aliases;
+			std::vector<terrain_code> mvt_aliases;
+		};
+
+		std::vector<terrain_code> read_code_list(const variant& v)
+		{
+			std::vector<terrain_code> res;
+			if(v.is_string()) {
+				for(const auto& s : split(v.as_string(), ", ", SplitFlags::NONE)) {
+					res.emplace_back(read_terrain_code(s));
+				}
+			}
+			return res;
+		}
+
+		void add_rows(const std::vector<std::vector<terrain_code>>& rows, std::vector<uint32_t>& offsets, std::vector<terrain_code>& values)
+		{
+			for(const auto& row : rows) {
+				values.insert(values.end(), row.cbegin(), row.cend());
+				offsets.emplace_back(static_cast<uint32_t>(values.size()));
+			}
+		}
+
+		void build_hash(terrain_table& t)
+		{
+			const size_t nbuckets = std::max<size_t>(1, (t.codes.size() + codes_per_bucket - 1) / codes_per_bucket);
+			const size_t nslots = std::max<size_t>(1, static_cast<size_t>(t.codes.size() * slots_per_code));
+			std::vector<std::vector<int>> buckets(nbuckets);
+			for(size_t n = 0; n != t.codes.size(); ++n) {
+				buckets[hash_code(t.codes[n], 0) % nbuckets].emplace_back(static_cast<int>(n));
+			}
+			// the largest buckets are the hardest to place, so go first.
+			std::vector<size_t> order(nbuckets);
+			std::iota(order.begin(), order.end(), 0);
+			std::stable_sort(order.begin(), order.end(), [&buckets](size_t a, size_t b) { return buckets[a].size() > buckets[b].size(); });
+
+			t.displacements.assign(nbuckets, 0);
+			t.slots.assign(nslots, -1);
+			std::vector<size_t> placed;
+			for(auto b : order) {
+				if(buckets[b].empty()) {
+					continue;
+				}
+				uint32_t d = 1;
+				for(; d != max_displacement; ++d) {
+					placed.clear();
+					for(auto n : buckets[b]) {
+						const size_t slot = hash_code(t.codes[n], d) % nslots;
+						if(t.slots[slot] != -1 || std::find(placed.cbegin(), placed.cend(), slot) != placed.cend()) {
+							break;
+						}
+						placed.emplace_back(slot);
+					}
+					if(placed.size() == buckets[b].size()) {
+						break;
+					}
+				}
+				ASSERT_LOG(d != max_displacement, "Couldn't build a perfect hash of the terrain codes.");
+				t.displacements[b] = d;
+				for(size_t n = 0; n != placed.size(); ++n) {
+					t.slots[placed[n]] = buckets[b][n];
+				}
+			}
+		}
+
+		variant codes_to_variant(const std::vector<terrain_code>& codes)
+		{
+			std::vector<variant> res;
+			for(const auto& c : codes) {
+				res.emplace_back(static_cast<int64_t>(c.base));
+				res.emplace_back(static_cast<int64_t>(c.overlay));
+			}
+			return variant(&res);
+		}
+
+		std::vector<terrain_code> codes_from_variant(const variant& v)
+		{
+			const auto& l = v.as_list();
+			ASSERT_LOG(l.size() % 2 == 0, "Expected a list of base and overlay pairs: " << v.write_json());
+			std::vector<terrain_code> res;
+			for(size_t n = 0; n != l.size(); n += 2) {
+				res.emplace_back(static_cast<layer_code>(l[n].as_int()), static_cast<layer_code>(l[n + 1].as_int()));
+			}
+			return res;
+		}
+
+		template<typename T>
+		variant ints_to_variant(const std::vector<T>& ints)
+		{
+			std::vector<variant> res;
+			for(auto n : ints) {
+				res.emplace_back(static_cast<int64_t>(n));
+			}
+			return variant(&res);
+		}
+
+		template<typename T>
+		std::vector<T> ints_from_variant(const variant& v)
+		{
+			std::vector<T> res;
+			for(const auto& n : v.as_list()) {
+				res.emplace_back(static_cast<T>(n.as_int()));
+			}
+			return res;
+		}
+	}
+
+	uint64_t hash_code(const terrain_code& c, uint32_t seed)
+	{
+		uint64_t x = (static_cast<uint64_t>(c.base) << 32 | c.overlay) ^ (seed * 0x9e3779b97f4a7c15ULL);
+		x = (x ^ (x >> 33)) * 0xff51afd7ed558ccdULL;
+		x = (x ^ (x >> 33)) * 0xc4ceb9fe1a85ec53ULL;
+		return x ^ (x >> 33);
+	}
+
+	int terrain_table::find(const terrain_code& c) const
+	{
+		if(slots.empty()) {
+			return -1;
+		}
+		const uint32_t d = displacements[hash_code(c, 0) % displacements.size()];
+		const int n = slots[hash_code(c, d) % slots.size()];
+		return n != -1 && codes[n] == c ? n : -1;
+	}
+
+	std::pair<const terrain_code*, const terrain_code*> terrain_table::get_aliases(int n) const
+	{
+		return std::make_pair(aliases.data() + alias_offsets[n], aliases.data() + alias_offsets[n + 1]);
+	}
+
+	std::pair<const terrain_code*, const terrain_code*> terrain_table::get_mvt_aliases(int n) const
+	{
+		return std::make_pair(mvt_aliases.data() + mvt_alias_offsets[n], mvt_aliases.data() + mvt_alias_offsets[n + 1]);
+	}
+
+	terrain_table build_terrain_table(const variant& terrain_types)
+	{
+		std::vector<entry> entries;
+		const variant& types = terrain_types["terrain_type"];
+		const auto add = [&entries](const variant& tt) {
+			if(!tt["string"].is_string()) {
+				return;
+			}
+			entry e;
+			e.code = read_terrain_code(tt["string"].as_string());
+			e.id = tt["id"].as_string_default("");
+			if(tt["default_base"].is_string()) {
+				e.default_base = read_terrain_code(tt["default_base"].as_string());
+			}
+			e.aliases = read_code_list(tt["aliasof"]);
+			e.mvt_aliases = read_code_list(tt["mvt_alias"]);
+			entries.emplace_back(e);
+		};
+		if(types.is_list()) {
+			for(const auto& tt : types.as_list()) {
+				add(tt);
+			}
+		} else if(types.is_map()) {
+			add(types);
+		}
+		std::stable_sort(entries.begin(), entries.end(), [](const entry& a, const entry& b) { return a.code < b.code; });
+		for(size_t n = 1; n < entries.size(); ++n) {
+			ASSERT_LOG(entries[n - 1].code != entries[n].code, "Terrain code defined twice: " << write_terrain_code(entries[n].code));
+		}
+
+		terrain_table res;
+		std::vector<std::vector<terrain_code>> aliases, mvt_aliases;
+		for(const auto& e : entries) {
+			res.codes.emplace_back(e.code);
+			res.ids.emplace_back(e.id);
+			res.default_base.emplace_back(e.default_base);
+			aliases.emplace_back(e.aliases);
+			mvt_aliases.emplace_back(e.mvt_aliases);
+		}
+		add_rows(aliases, res.alias_offsets, res.aliases);
+		add_rows(mvt_aliases, res.mvt_alias_offsets, res.mvt_aliases);
+		build_hash(res);
+		return res;
+	}
+
+	variant table_to_variant(const terrain_table& t)
+	{
+		std::vector<variant> ids;
+		for(const auto& id : t.ids) {
+			ids.emplace_back(id);
+		}
+		std::map<variant, variant> res;
+		res[variant("codes")] = codes_to_variant(t.codes);
+		res[variant("ids")] = variant(&ids);
+		res[variant("default_base")] = codes_to_variant(t.default_base);
+		res[variant("alias_offsets")] = ints_to_variant(t.alias_offsets);
+		res[variant("aliases")] = codes_to_variant(t.aliases);
+		res[variant("mvt_alias_offsets")] = ints_to_variant(t.mvt_alias_offsets);
+		res[variant("mvt_aliases")] = codes_to_variant(t.mvt_aliases);
+		res[variant("displacements")] = ints_to_variant(t.displacements);
+		res[variant("slots")] = ints_to_variant(t.slots);
+		return variant(&res);
+	}
+
+	terrain_table table_from_variant(const variant& v)
+	{
+		terrain_table res;
+		res.codes = codes_from_variant(v["codes"]);
+		for(const auto& id : v["ids"].as_list()) {
+			res.ids.emplace_back(id.as_string());
+		}
+		res.default_base = codes_from_variant(v["default_base"]);
+		res.alias_offsets = ints_from_variant<uint32_t>(v["alias_offsets"]);
+		res.aliases = codes_from_variant(v["aliases"]);
+		res.mvt_alias_offsets = ints_from_variant<uint32_t>(v["mvt_alias_offsets"]);
+		res.mvt_aliases = codes_from_variant(v["mvt_aliases"]);
+		res.displacements = ints_from_variant<uint32_t>(v["displacements"]);
+		res.slots = ints_from_variant<int>(v["slots"]);
+		ASSERT_LOG(res.ids.size() == res.codes.size() && res.default_base.size() == res.codes.size()
+			&& res.alias_offsets.size() == res.codes.size() + 1 && res.mvt_alias_offsets.size() == res.codes.size() + 1
+			&& (res.slots.empty() || !res.displacements.empty()), "Malformed terrain table.");
+		return res;
+	}
+}
+
+UNIT_TEST(terrain_table_find)
+{
+	std::ostringstream wml;
+	wml << "[terrain_type]\nstring=Gg\nid=grassland\naliasof=Gt\n[/terrain_type]\n"
+		<< "[terrain_type]\nstring=^Vh\nid=village\n[/terrain_type]\n"
+		<< "[terrain_type]\nstring=Gg^Efm\nid=flowers\n[/terrain_type]\n";
+	// enough codes for a few displacements.
+	for(int n = 0; n != 300; ++n) {
+		wml << "[terrain_type]\nstring=X" << static_cast<char>('a' + n % 26) << static_cast<char>('a' + n / 26) << "\nid=x" << n << "\n[/terrain_type]\n";
+	}
+	const terrain::terrain_table t = terrain::build_terrain_table(convert_node(read_wml2(wml.str())->root()));
+	CHECK_EQ(t.codes.size(), 303);
+
+	const terrain::terrain_table back = terrain::table_from_variant(terrain::table_to_variant(t));
+	for(const auto* table : { &t, &back }) {
+		for(size_t n = 0; n != table->codes.size(); ++n) {
+			CHECK_EQ(table->find(table->codes[n]), static_cast<int>(n));
+		}
+		const int gg = table->find(terrain::read_terrain_code("Gg"));
+		CHECK_GE(gg, 0);
+		CHECK_EQ(table->ids[gg], "grassland");
+		const auto aliases = table->get_aliases(gg);
+		CHECK(aliases.second - aliases.first == 1 && *aliases.first == terrain::read_terrain_code("Gt"), "Gg should be an alias of Gt");
+		CHECK_EQ(table->ids[table->find(terrain::read_terrain_code("^Vh"))], "village");
+		CHECK_EQ(table->ids[table->find(terrain::read_terrain_code("Gg^Efm"))], "flowers");
+		// combined codes are only found if listed, Gg^Vh is looked up as Gg and ^Vh.
+		CHECK_EQ(table->find(terrain::read_terrain_code("Gg^Vh")), -1);
+		CHECK_EQ(table->find(terrain::read_terrain_code("Gs")), -1);
+	}
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "terrain_pattern.hpp"
+#include "variant.hpp"
+
+// Every terrain type in terrain.cfg keyed by its packed code, with a perfect hash so
+// a code can be resolved to its entry with two hashes and one compare.
+namespace terrain
+{
+	// Hash of a packed code, the same for every reader of the table:
+	//   x = (base << 32 | overlay) ^ (seed * 0x9e3779b97f4a7c15)
+	//   x = (x ^ (x >> 33)) * 0xff51afd7ed558ccd
+	//   x = (x ^ (x >> 33)) * 0xc4ceb9fe1a85ec53
+	//   return x ^ (x >> 33)
+	uint64_t hash_code(const terrain_code& c, uint32_t seed);
+
+	struct terrain_table
+	{
+		terrain_table() : codes(), ids(), default_base(), alias_offsets(1, 0), aliases(), mvt_alias_offsets(1, 0), mvt_aliases(), displacements(), slots() {}
+
+		// Index of c in codes, or -1 if it isn't a terrain type. Overlays are listed on
+		// their own with an empty base ("^Vh"), so Gg^Vh is resolved as Gg and ^Vh.
+		int find(const terrain_code& c) const;
+		// The aliasof and mvt_alias codes of entry n, '+', '-' and "_bas" included.
+		std::pair<const terrain_code*, const terrain_code*> get_aliases(int n) const;
+		std::pair<const terrain_code*, const terrain_code*> get_mvt_aliases(int n) const;
+
+		// Sorted, ids and default_base are in the same order. No default base is the empty code.
+		std::vector<terrain_code> codes;
+		std::vector<std::string> ids;
+		std::vector<terrain_code> default_base;
+		// Compressed rows, as terrain::rule_index.
+		std::vector<uint32_t> alias_offsets;
+		std::vector<terrain_code> aliases;
+		std::vector<uint32_t> mvt_alias_offsets;
+		std::vector<terrain_code> mvt_aliases;
+
+		// Hash and displace: code c is in slot
+		//   hash_code(c, displacements[hash_code(c, 0) % displacements.size()]) % slots.size()
+		// which holds its index in codes. Unused slots hold -1.
+		std::vector<uint32_t> displacements;
+		std::vector<int> slots;
+	};
+
+	// From the converted terrain.cfg.
+	terrain_table build_terrain_table(const variant& terrain_types);
+
+	// The table as written by --terrain-table, codes as [base, overlay, ...]:
+	//   {"codes": [...], "ids": [...], "default_base": [...], "alias_offsets": [...],
+	//    "aliases": [...], "mvt_alias_offsets": [...], "mvt_aliases": [...],
+	//    "displacements": [...], "slots": [...]}
+	variant table_to_variant(const terrain_table& t);
+	terrain_table table_from_variant(const variant& v);
+}
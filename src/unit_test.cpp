@@ -14,12 +14,26 @@
    limitations under the License.
 */
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
 #include <chrono>
+#include <cstring>
 #include <iostream>
 #include <map>
+#include <thread>
+
+#ifndef _MSC_VER
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 #include "asserts.hpp"
+#include "filesystem.hpp"
+#include "json.hpp"
+#include "terrain_parser.hpp"
 #include "unit_test.hpp"
+#include "variant_utils.hpp"
 
 namespace test {
 
@@ -31,6 +45,159 @@ namespace test {
 			static test_map map;
 			return map;
 		}
+
+		allocation_counter alloc_counter = nullptr;
+
+		// What running a test found. Plain data, so an isolated test can send it back
+		// through a pipe.
+		struct outcome
+		{
+			outcome() : passed(false), ms(0), allocations(0) {}
+			bool passed;
+			double ms;
+			uint64_t allocations;
+		};
+
+		struct test_result
+		{
+			test_result() : name(), result(), message(), baseline_ms(-1), regressed(false) {}
+			std::string name;
+			outcome result;
+			std::string message;
+			// -1 if the test isn't in the baseline.
+			double baseline_ms;
+			bool regressed;
+		};
+
+		outcome run_one(const std::string& name, std::string& message)
+		{
+			outcome res;
+			const auto it = get_test_map().find(name);
+			if(it == get_test_map().end()) {
+				message = "no such test";
+				return res;
+			}
+			const uint64_t allocs_start = alloc_counter ? alloc_counter() : 0;
+			const auto start = std::chrono::steady_clock::now();
+			try {
+				it->second();
+				res.passed = true;
+			} catch(failure_exception&) {
+				message = "check failed";
+			} catch(std::exception& e) {
+				message = std::string("exception: ") + e.what();
+			}
+			res.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			res.allocations = alloc_counter ? alloc_counter() - allocs_start : 0;
+			return res;
+		}
+
+#ifndef _MSC_VER
+		// Runs the test in a child process, which writes its outcome to a pipe before
+		// exiting. A child that dies first is reported with how it ended.
+		outcome run_isolated(const std::string& name, std::string& message)
+		{
+			int fds[2];
+			ASSERT_LOG(pipe(fds) == 0, "Couldn't create a pipe for test " << name << ": " << std::strerror(errno));
+			const pid_t pid = fork();
+			ASSERT_LOG(pid >= 0, "Couldn't fork for test " << name << ": " << std::strerror(errno));
+			if(pid == 0) {
+				close(fds[0]);
+				std::string child_message;
+				const outcome res = run_one(name, child_message);
+				const ssize_t written = write(fds[1], &res, sizeof(res));
+				_exit(written == static_cast<ssize_t>(sizeof(res)) ? 0 : 1);
+			}
+			close(fds[1]);
+			outcome res;
+			size_t got = 0;
+			char* buf = reinterpret_cast<char*>(&res);
+			while(got != sizeof(res)) {
+				const ssize_t n = read(fds[0], buf + got, sizeof(res) - got);
+				if(n < 0 && errno == EINTR) {
+					continue;
+				} else if(n <= 0) {
+					break;
+				}
+				got += static_cast<size_t>(n);
+			}
+			close(fds[0]);
+			int status = 0;
+			while(waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+			}
+			if(got != sizeof(res)) {
+				res = outcome();
+				if(WIFSIGNALED(status)) {
+					message = "killed by signal " + std::to_string(WTERMSIG(status));
+				} else {
+					message = "exited with status " + std::to_string(WEXITSTATUS(status));
+				}
+			} else if(!res.passed) {
+				message = "check failed";
+			}
+			return res;
+		}
+#endif
+
+		bool is_selected(const std::string& name, const std::vector<std::string>& filters)
+		{
+			bool has_includes = false, included = false;
+			for(const auto& f : filters) {
+				if(!f.empty() && f[0] == '-') {
+					if(name.find(f.substr(1)) != std::string::npos) {
+						return false;
+					}
+				} else {
+					has_includes = true;
+					included = included || name.find(f) != std::string::npos;
+				}
+			}
+			return !has_includes || included;
+		}
+
+		std::map<std::string, double> read_baseline(const std::string& filename)
+		{
+			std::map<std::string, double> res;
+			const variant doc = json::parse_from_file(filename);
+			for(const auto& t : doc["tests"].as_list()) {
+				res[t["name"].as_string()] = t["ms"].as_float();
+			}
+			return res;
+		}
+
+		void write_results(const std::string& filename, const std::vector<test_result>& results, double total_ms)
+		{
+			std::vector<variant> tests;
+			int nfail = 0, nregressed = 0;
+			for(const auto& r : results) {
+				variant_builder vb;
+				vb.add("name", r.name);
+				vb.add("passed", variant::from_bool(r.result.passed));
+				vb.add("ms", r.result.ms);
+				if(alloc_counter) {
+					vb.add("allocations", static_cast<int64_t>(r.result.allocations));
+				}
+				if(!r.message.empty()) {
+					vb.add("message", r.message);
+				}
+				if(r.baseline_ms >= 0) {
+					vb.add("baseline_ms", r.baseline_ms);
+					vb.add("regressed", variant::from_bool(r.regressed));
+				}
+				tests.emplace_back(vb.build());
+				nfail += r.result.passed ? 0 : 1;
+				nregressed += r.regressed ? 1 : 0;
+			}
+			variant_builder vb;
+			vb.add("passed", static_cast<int>(results.size()) - nfail);
+			vb.add("failed", nfail);
+			vb.add("regressed", nregressed);
+			vb.add("ms", total_ms);
+			vb.add("tests", variant(&tests));
+			sys::file_sink sink(filename);
+			vb.build().write_json(sink.stream(), true, 4);
+			sink.commit();
+		}
 	}
 
 	int register_test(const std::string& name, unit_test test)
@@ -39,27 +206,28 @@ namespace test {
 		return 0;
 	}
 
-	bool run_tests(const std::vector<std::string>* tests)
+	void set_allocation_counter(allocation_counter fn)
 	{
-		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		alloc_counter = fn;
+	}
 
-		std::vector<std::string> all_tests;
+	bool run_tests(const std::vector<std::string>* tests)
+	{
 		if(!tests) {
-			for(test_map::const_iterator i = get_test_map().begin(); i != get_test_map().end(); ++i) {
-				all_tests.push_back(i->first);
-			}
-
-			tests = &all_tests;
+			run_options opts;
+			opts.threads = 1;
+			return run_tests(opts);
 		}
 
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
 		int npass = 0, nfail = 0;
 		for(const auto& test : *tests) {
-			try {
-				get_test_map()[test]();
+			std::string message;
+			if(run_one(test, message).passed) {
 				LOG_INFO("TEST " << test << " PASSED");
 				++npass;
-			} catch(failure_exception&) {
-				LOG_ERROR("TEST " << test << " FAILED!!");
+			} else {
+				LOG_ERROR("TEST " << test << " FAILED!! " << message);
 				++nfail;
 			}
 		}
@@ -74,4 +242,101 @@ namespace test {
 			return true;
 		}
 	}
+
+	bool run_tests(const run_options& opts)
+	{
+		const auto start = std::chrono::steady_clock::now();
+
+		std::vector<test_result> results;
+		for(const auto& p : get_test_map()) {
+			if(is_selected(p.first, opts.filters)) {
+				results.emplace_back();
+				results.back().name = p.first;
+			}
+		}
+		bool isolate = opts.isolate;
+#ifdef _MSC_VER
+		if(isolate) {
+			LOG_WARN("Tests can't be isolated on Windows, running them in process.");
+			isolate = false;
+		}
+#endif
+
+		// a child forked while other threads run can inherit a lock one of them held, the
+		// profiler's or the iostreams', and deadlock on it. Isolated tests are forked from
+		// this thread alone, one at a time.
+		int threads = isolate ? 1 : opts.threads;
+		if(threads <= 0) {
+			threads = std::max<int>(1, std::thread::hardware_concurrency());
+		}
+		const size_t nthreads = std::max<size_t>(1, std::min<size_t>(threads, results.size()));
+		// tests are handed out one at a time, so a slow one doesn't hold up a whole share.
+		std::atomic<size_t> next(0);
+		auto worker = [&results, &next, isolate]() {
+			for(size_t n = next++; n < results.size(); n = next++) {
+				auto& r = results[n];
+#ifndef _MSC_VER
+				r.result = isolate ? run_isolated(r.name, r.message) : run_one(r.name, r.message);
+#else
+				r.result = run_one(r.name, r.message);
+#endif
+			}
+		};
+		std::vector<std::thread> pool;
+		for(size_t t = 1; t < nthreads; ++t) {
+			pool.emplace_back(worker);
+		}
+		worker();
+		for(auto& t : pool) {
+			t.join();
+		}
+
+		std::map<std::string, double> baseline;
+		if(!opts.baseline_file.empty()) {
+			baseline = read_baseline(opts.baseline_file);
+		}
+		int npass = 0, nfail = 0, nregressed = 0;
+		for(auto& r : results) {
+			const auto it = baseline.find(r.name);
+			if(it != baseline.end()) {
+				r.baseline_ms = it->second;
+				r.regressed = r.result.passed && r.result.ms > r.baseline_ms * opts.slowdown && r.result.ms - r.baseline_ms >= opts.min_regression_ms;
+			}
+			if(!r.result.passed) {
+				LOG_ERROR("TEST " << r.name << " FAILED!! " << r.message);
+				++nfail;
+			} else if(r.regressed) {
+				LOG_WARN("TEST " << r.name << " REGRESSED: " << r.result.ms << "ms, was " << r.baseline_ms << "ms");
+				++nregressed;
+				++npass;
+			} else {
+				LOG_INFO("TEST " << r.name << " PASSED IN " << r.result.ms << "ms" << (alloc_counter ? " WITH " + std::to_string(r.result.allocations) + " ALLOCATIONS" : std::string()));
+				++npass;
+			}
+		}
+
+		const double total_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		if(!opts.output_file.empty()) {
+			write_results(opts.output_file, results, total_ms);
+		}
+		if(nfail || nregressed) {
+			LOG_ERROR(npass << " TESTS PASSED, " << nfail << " TESTS FAILED, " << nregressed << " REGRESSED");
+			return false;
+		}
+		LOG_INFO("ALL " << npass << " TESTS PASSED IN " << static_cast<int>(total_ms) << "ms");
+		return true;
+	}
+}
+
+UNIT_TEST(test_filter_selection)
+{
+	// as --test-filter=A,-B is split.
+	const auto filters = [](const std::string& s) { return split(s, ",", SplitFlags::NONE); };
+	CHECK(is_selected("json_write", std::vector<std::string>()), "no filters selects everything");
+	CHECK(is_selected("json_write", filters("json")), "");
+	CHECK(!is_selected("file_sink", filters("json")), "");
+	CHECK(is_selected("file_sink", filters("json,sink")), "any include selects");
+	CHECK(!is_selected("json_write", filters("json,-write")), "an exclude wins over an include");
+	CHECK(is_selected("file_sink", filters("-json")), "only excludes selects the rest");
+	CHECK(!is_selected("json_write", filters("-json")), "");
 }
@@ -16,6 +16,7 @@
 
 #pragma once
 
+#include <cstdint>
 #include <functional>
 
 #include <iostream>
@@ -33,6 +34,37 @@ namespace test
 	int register_test(const std::string& name, unit_test test);
 	
 	bool run_tests(const std::vector<std::string>* tests=NULL);
+
+	// Returns the number of allocations made so far by the calling thread. Whatever
+	// replaces the global allocation functions can install one, otherwise the results
+	// have no allocation counts.
+	typedef uint64_t (*allocation_counter)();
+	void set_allocation_counter(allocation_counter fn);
+
+	struct run_options
+	{
+		run_options() : filters(), threads(0), isolate(false), baseline_file(), slowdown(1.5), min_regression_ms(5.0), output_file() {}
+		// run the tests whose names contain one of these, or all of them if there are none.
+		// A filter starting with '-' leaves out the tests it matches instead.
+		std::vector<std::string> filters;
+		// tests run at once, 0 for std::thread::hardware_concurrency().
+		int threads;
+		// run each test in a process of its own, so one that crashes or fails an ASSERT_LOG
+		// is reported as failed rather than ending the run. The tests then run one at a
+		// time whatever threads is. Ignored on Windows.
+		bool isolate;
+		// JSON results of an earlier run. A test that takes more than slowdown times as
+		// long as it did there, and at least min_regression_ms longer, has regressed.
+		std::string baseline_file;
+		double slowdown;
+		double min_regression_ms;
+		// where to write the results as JSON, which can be the baseline of a later run.
+		std::string output_file;
+	};
+
+	// Runs the tests chosen by opts and logs the time each took. Returns true if they all
+	// passed and none regressed.
+	bool run_tests(const run_options& opts);
 }
 
 #define CHECK(cond, msg) if(!(cond)) { std::cerr << __FILE__ << ":" << __LINE__ << ": TEST CHECK FAILED: " << #cond << ": " << msg << "\n"; throw test::failure_exception(); }
@@ -0,0 +1,1238 @@
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <sstream>
+#include <stack>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/regex.hpp>
+
+#include "anim_range.hpp"
+#include "asserts.hpp"
+#include "attribute_schema.hpp"
+#include "builder_map.hpp"
+#include "filesystem.hpp"
+#include "image_path.hpp"
+#include "json.hpp"
+#include "profiler.hpp"
+#include "terrain_parser.hpp"
+#include "terrain_pattern.hpp"
+#include "unit_test.hpp"
+#include "variant.hpp"
+#include "variant_utils.hpp"
+
+namespace
+{
+	boost::regex re_open_tag("\\[([^\\/][A-Za-z0-9_]+)\\]");
+	boost::regex re_close_tag("\\[\\/([A-Za-z0-9_]+)\\]");
+	boost::regex re_num_match("\\d+(\\.\\d*)?");
+	boost::regex re_macro_match("\\{(.*?)\\}");
+	boost::regex re_whitespace_match("\\s+");
+	boost::regex re_parens_match("\\((.*?)\\)");
+	boost::regex re_quote_match("\"(.*?)\"");
+}
+
+std::vector<std::string> split(const std::string& str, const std::string& delimiters, SplitFlags flags)
+{
+	std::vector<std::string> res;
+	boost::split(res, str, boost::is_any_of(delimiters), boost::token_compress_on);
+	if(flags == SplitFlags::NONE) {
+		res.erase(std::remove(res.begin(), res.end(), ""), res.end());
+	}
+	return res;
+}
+
+std::vector<std::string> split(const char* begin, const char* end, const std::string& delimiters, SplitFlags flags)
+{
+	std::vector<std::string> res;
+	boost::split(res, boost::make_iterator_range(begin, end), boost::is_any_of(delimiters), boost::token_compress_on);
+	if(flags == SplitFlags::NONE) {
+		res.erase(std::remove(res.begin(), res.end(), ""), res.end());
+	}
+	return res;
+}
+
+class WmlReader
+{
+public:
+	explicit WmlReader(const std::string& filename, const std::string& contents)
+		: file_name_(filename),
+		  contents_(contents),
+		  line_count_(1)
+	{
+	}
+private:
+	std::string file_name_;
+	std::string contents_;
+	int line_count_;
+};
+
+macro_cache_type& get_macro_cache()
+{
+	static macro_cache_type res;
+	return res;
+}
+
+struct TagHelper
+{
+	TagHelper() : name(), vb(nullptr) {}
+	std::string name;
+	std::shared_ptr<variant_builder> vb;
+};
+
+
+variant read_wml(const std::string& filename, const std::string& contents, int line_offset)
+{
+	PROFILE_ZONE("read_wml");
+	auto lines = split(contents, "\n", SplitFlags::NONE);
+	int line_count = 1 + line_offset;
+	std::stack<TagHelper> tag_stack;
+	tag_stack.emplace();
+	tag_stack.top().vb = std::make_shared<variant_builder>();
+
+	bool in_multi_line_string = false;
+	bool is_translateable_ml_string = false;
+	std::string ml_string;
+	std::string attribute;
+	std::map<std::string, std::shared_ptr<variant_builder>> last_vb;
+	int expect_merge = 0;
+
+	auto vb = tag_stack.top().vb;
+	for(auto& line : lines) {
+		boost::trim(line);
+		// search for any inline comments to remove or pre-processor directives to action.
+		auto comment_pos = line.find('#');
+		if(comment_pos != std::string::npos) {
+			std::string pre_processor_stmt = line.substr(comment_pos + 1);
+			line = boost::trim_copy(line.substr(0, comment_pos));
+			if(line.empty() && pre_processor_stmt.empty()) {
+				// skip blank lines
+				++line_count;
+				continue;
+			}
+			if((pre_processor_stmt[0] == ' ' || pre_processor_stmt[0] == '#') && line.empty()) {
+				// skip comments.
+				++line_count;
+				continue;
+			}
+		}
+
+		if(line.empty()) {
+			// skip blank lines
+			++line_count;
+			continue;
+		}
+
+		// line should be valid at this point
+		boost::cmatch what;
+		if(in_multi_line_string) {
+			auto quote_pos = line.find('"');
+			ml_string += "\n" + line.substr(0, quote_pos);
+			if(quote_pos != std::string::npos) {
+				in_multi_line_string = false;
+				if(expect_merge) {
+					vb->set(attribute, (is_translateable_ml_string ? "~" : "") + ml_string + (is_translateable_ml_string ? "~" : ""));
+				} else {
+					vb->add(attribute, (is_translateable_ml_string ? "~" : "") + ml_string + (is_translateable_ml_string ? "~" : ""));
+				}
+				is_translateable_ml_string = false;
+			}
+		} else if(boost::regex_match(line.c_str(), what, re_open_tag)) {
+			// Opening tag
+			std::string tag_name(what[1].first, what[1].second);
+			if(tag_name[0] == '+') {
+				auto it = last_vb.find(tag_name.substr(1));
+				ASSERT_LOG(it != last_vb.end(), "Error finding last tag: " << tag_name);				
+				//if(tag_name == "+image") {
+				//	DebuggerBreak();
+				//}
+				vb = it->second;
+				++expect_merge;
+			} else {
+				tag_stack.emplace();
+				tag_stack.top().name = tag_name;
+				vb = tag_stack.top().vb = std::make_shared<variant_builder>();
+				last_vb[tag_name] = tag_stack.top().vb;
+			}
+		} else if(boost::regex_match(line.c_str(), what, re_close_tag)) {
+			// Closing tag
+			std::string this_tag(what[1].first, what[1].second);
+			if(expect_merge != 0) {
+				--expect_merge;
+				continue;
+			}
+			ASSERT_LOG(this_tag == tag_stack.top().name, "tag name mismatch error: " << this_tag << " != " << tag_stack.top().name << "; line: " << line_count);
+			auto old_vb = tag_stack.top().vb;
+			tag_stack.pop();
+			ASSERT_LOG(!tag_stack.empty(), "vtags stack was empty.");
+			// BUG because we build old_vb here, vb doesn't points to the unbuilt data. Which isn't helpful.
+			tag_stack.top().vb->add(this_tag, old_vb->build());
+			vb = tag_stack.top().vb;
+		} else if(boost::regex_match(line.c_str(), what, re_macro_match)) {
+			ASSERT_LOG(false, "Found an unexpanded macro definition." << line_count << ": " << line << "file: " << filename);
+		} else {
+			std::string value;
+			auto pos = line.find_first_of('=');
+			ASSERT_LOG(pos != std::string::npos, "error no '=' on line " << line_count << ": " << line << "file: " << filename);
+			attribute = boost::trim_copy(line.substr(0, pos));			
+			value = line.substr(pos + 1);
+			boost::trim(value);
+			if(std::count(value.cbegin(), value.cend(), '"') == 1) {
+				in_multi_line_string = true;
+				is_translateable_ml_string = value[0] == '_' && (value[1] == ' ' || value[1] == '"');
+				auto quote_pos = value.find('"');
+				ASSERT_LOG(quote_pos != std::string::npos, "Missing quotation mark on line " << line_count << ": " << value);
+				ml_string = value.substr(quote_pos+1);
+			} else if(boost::regex_match(value.c_str(), what, re_num_match)) {
+				std::string frac(what[1].first, what[1].second);
+				if(frac.empty()) {
+					// integer
+					try {
+						int num = boost::lexical_cast<int>(value);
+						if(expect_merge) {
+							vb->set(attribute, num);
+						} else {
+							vb->add(attribute, num);
+						}
+					} catch(boost::bad_lexical_cast&) {
+						ASSERT_LOG(false, "Unable to convert value '" << value << "' to integer.");
+					}
+				} else {
+					// float
+					try {
+						double num = boost::lexical_cast<double>(value);
+						if(expect_merge) {
+							vb->set(attribute, num);
+						} else {
+							vb->add(attribute, num);
+						}
+					} catch(boost::bad_lexical_cast&) {
+						ASSERT_LOG(false, "Unable to convert value '" << value << "' to double.");
+					}
+				}
+			} else if(value == "yes" || value == "no" || value == "true" || value == "false") {
+				if(value == "yes" || value == "true") {
+					vb->add(attribute, variant::from_bool(true));
+				} else {
+					vb->add(attribute, variant::from_bool(false));
+				}
+			} else {
+				bool is_translateable = false;
+				if(value[0] == '_' && (value[1] == ' ' || value[1] == '"')) {
+					// mark as translatable string
+					is_translateable = true;
+				}
+				// add as string
+				auto quote_pos_start = value.find_first_of('"');
+				auto quote_pos_end = value.find_last_of('"');
+				if(quote_pos_start != std::string::npos && quote_pos_end != std::string::npos) {
+					value = value.substr(quote_pos_start+1, quote_pos_end - (quote_pos_start + 1));
+				}
+				//if(value == "frozen/ice2@V.png") {
+				//	DebuggerBreak();
+				//}
+				if(expect_merge) {
+					vb->set(attribute, (is_translateable ? "~" : "") + value + (is_translateable ? "~" : ""));
+				} else {
+					vb->add(attribute, (is_translateable ? "~" : "") + value + (is_translateable ? "~" : ""));
+				}
+			}
+		}
+
+		++line_count;
+	}
+	ASSERT_LOG(!tag_stack.empty(), "tag_stack was empty.");
+	return tag_stack.top().vb->build();
+}
+
+// suck out macro definitions.
+void pre_process_wml(const std::string& filename, const std::string& contents)
+{
+	pre_process_wml(filename, contents.data(), contents.data() + contents.size());
+}
+
+void pre_process_wml(const std::string& filename, const char* begin, const char* end)
+{
+	PROFILE_ZONE("pre_process_wml");
+	PROFILE_COUNTER("bytes", end - begin);
+	auto lines = split(begin, end, "\n", SplitFlags::NONE);
+	MacroPtr current_macro = nullptr;
+	std::string macro_name;
+	bool in_macro = false;
+	std::string macro_lines;
+	int line_count = 1;
+	for(auto& line : lines) {
+		boost::trim(line);
+		// search for any inline comments to remove or pre-processor directives to action.
+		auto comment_pos = line.find('#');
+		if(comment_pos != std::string::npos) {
+			std::string pre_processor_stmt = line.substr(comment_pos + 1);
+			line = boost::trim_copy(line.substr(0, comment_pos));
+			if(line.empty() && pre_processor_stmt.empty()) {
+				// skip blank lines
+				++line_count;
+				continue;
+			}
+			if((pre_processor_stmt[0] == ' ' || pre_processor_stmt[0] == '#') && line.empty()) {
+				// skip comments.
+				++line_count;
+				continue;
+			}
+			// we read in the next symbol to see what action we need to take.
+			auto space_pos = pre_processor_stmt.find(' ');
+			std::string directive = pre_processor_stmt;
+			if(space_pos != std::string::npos) {
+				directive = pre_processor_stmt.substr(0, space_pos);
+			}
+			if(directive == "define") {
+				ASSERT_LOG(current_macro == nullptr, "Found #define inside a macro. line: " << line_count << "; " << filename);
+				auto macro_line = boost::regex_replace(pre_processor_stmt.substr(space_pos + 1), re_whitespace_match, " ");
+				auto params = split(macro_line, " ", SplitFlags::NONE);
+				// first parameter is the name of the macro.
+				macro_name = params[0];
+				ASSERT_LOG(get_macro_cache().find(macro_name) == get_macro_cache().end(), "Detected duplicate macro name: " << params[0] << "; line: " << line_count << "; " << filename) ;
+				current_macro = std::make_shared<Macro>(params[0], std::vector<std::string>(params.cbegin() + 1, params.cend()));
+				++line_count;
+				current_macro->setFileDetails(filename, line_count);
+				in_macro = true;
+				continue;
+			} else if (directive == "enddef") {
+				ASSERT_LOG(current_macro != nullptr, "Found #enddef and not in a macro definition. line: " << line_count << "; " << filename);
+				if(!line.empty()) {
+					macro_lines += line + '\n';
+				}
+				//variant macro_def = read_wml(filename, macro_lines, line_count);
+				current_macro->setDefinition(macro_lines);
+				// clear the current macro data.
+				in_macro = false;
+				macro_lines.clear();
+				++line_count;
+				get_macro_cache()[macro_name] = current_macro;
+				current_macro.reset();
+				macro_name.clear();
+				continue;
+			} else {
+				//LOG_WARN("Unrecognised pre-processor directive: " << directive << "; line: " << line_count << "; " << filename);
+			}
+		}
+
+		// just collect the lines for parsing while in a macro.
+		if(in_macro) {
+			macro_lines += line + '\n';
+			++line_count;
+			continue;
+		}
+	}
+}
+
+std::string macro_substitute(const std::string& contents);
+
+// Expands macros one line at a time, writing each expanded line to the stream as soon as
+// it is done so callers can send the output straight to a file_sink.
+void macro_substitute(const std::string& contents, std::ostream& os)
+{
+	PROFILE_ZONE("macro_substitute");
+	PROFILE_COUNTER("bytes", contents.size());
+	auto lines = split(contents, "\n", SplitFlags::NONE);
+	std::string output_str;
+	for(const auto& line : lines) {
+		output_str.clear();
+		bool in_macro = false;
+		std::string macro_line;
+		
+		auto comment_pos = line.find('#');
+		std::string line_to_process = line;
+		if(comment_pos != std::string::npos) {
+			line_to_process = boost::trim_copy(line.substr(0, comment_pos));
+			if(line_to_process.empty()) {
+				continue;
+			}
+		}
+
+		for(auto c : line_to_process) {
+			if(c == '{') {
+				ASSERT_LOG(in_macro == false, "Already in macro");
+				// start of macro definition.
+				in_macro = true;
+			} else if( c == '}') {
+				ASSERT_LOG(in_macro == true, "Not in macro");
+				in_macro = false;
+
+				macro_line = boost::regex_replace(macro_line, re_whitespace_match, " ");
+				auto strs = split(macro_line, " ", SplitFlags::NONE);
+				PROFILE_ZONE_CAT("macro", profile::intern(strs.front()));
+
+				auto it = get_macro_cache().find(strs.front());
+				if(it == get_macro_cache().end()) {
+					LOG_ERROR("No macro definition for: " << strs.front());
+					continue;
+				}
+				const auto& params = it->second->getParams();
+				ASSERT_LOG(params.size() == (strs.size() - 1), "macro: " << strs.front() << " given the wrong number of arguments. Expected " << params.size() << " given " << (strs.size() - 1));
+				auto sit = strs.begin() + 1;
+				std::string def = it->second->getDefinition();
+				for(auto& p : params) {				
+					std::string str = *sit;
+					boost::cmatch what;
+					if(boost::regex_match(sit->c_str(), what, re_parens_match)) {
+						str = std::string(what[1].first, what[1].second);
+						if(str.empty()) {
+							str = "()";
+						}
+					}
+					if(boost::regex_match(sit->c_str(), what, re_quote_match)) {
+						str = std::string(what[1].first, what[1].second);
+					}
+					boost::replace_all(def, '{' + p + '}', str);
+					++sit;
+				}
+				if(def.find('{') != std::string::npos) {
+					def = macro_substitute(def);
+				}
+				output_str += def;
+				macro_line.clear();
+			} else if(in_macro) {
+				macro_line += c;
+			} else {
+				output_str += c;
+			}
+		}
+		output_str += '\n';
+		boost::replace_all(output_str, "()", "");
+		os << output_str;
+	}
+}
+
+std::string macro_substitute(const std::string& contents)
+{
+	std::ostringstream ss;
+	macro_substitute(contents, ss);
+	return ss.str();
+}
+
+node node::add_child(const std::string& name) const
+{
+	auto& nodes = tree_->nodes_;
+	const uint32_t child = static_cast<uint32_t>(nodes.size());
+	ASSERT_LOG(child != node_tree::npos, "Too many nodes in the tree.");
+	nodes.emplace_back(name, index_);
+	// nodes may have moved.
+	auto& e = nodes[index_];
+	if(e.last_child == node_tree::npos) {
+		e.first_child = child;
+	} else {
+		nodes[e.last_child].next_sibling = child;
+	}
+	e.last_child = child;
+	return node(tree_, child);
+}
+
+void node::add_attr(const std::string& a, const std::string& v) const
+{
+	tree_->nodes_[index_].attr.set(tree_->intern(a), v);
+}
+
+const std::string* attribute_list::find(const std::string* key) const
+{
+	for(const auto& a : *this) {
+		if(a.key == key) {
+			return &a.value;
+		}
+	}
+	return nullptr;
+}
+
+void attribute_list::set(const std::string* key, const std::string& value)
+{
+	node_attribute* attrs = size_ <= inline_size ? inline_.data() : more_.data();
+	size_t pos = 0;
+	for(; pos != size_; ++pos) {
+		if(attrs[pos].key == key) {
+			attrs[pos].value = value;
+			return;
+		}
+	}
+	for(pos = 0; pos != size_ && *attrs[pos].key < *key; ++pos) {
+	}
+	node_attribute a;
+	a.key = key;
+	a.value = value;
+	if(size_ < inline_size) {
+		for(size_t n = size_; n != pos; --n) {
+			inline_[n] = std::move(inline_[n - 1]);
+		}
+		inline_[pos] = std::move(a);
+	} else {
+		if(size_ == inline_size) {
+			more_.reserve(inline_size * 2);
+			for(auto& ia : inline_) {
+				more_.emplace_back(std::move(ia));
+			}
+			inline_ = std::array<node_attribute, inline_size>();
+		}
+		more_.insert(more_.begin() + pos, std::move(a));
+	}
+	++size_;
+}
+
+const uint32_t node_tree::npos;
+
+node_tree::node_tree(const std::string& root_name, size_t capacity)
+	: nodes_()
+{
+	nodes_.reserve(std::max<size_t>(1, capacity));
+	nodes_.emplace_back(root_name, npos);
+}
+
+wml_parser::wml_parser()
+	: tree_(std::make_shared<node_tree>("")),
+	  current_(),
+	  in_multi_line_string_(false),
+	  is_translateable_ml_string_(false),
+	  ml_string_(),
+	  attribute_(),
+	  expect_merge_(0),
+	  last_node_(),
+	  child_fn_(),
+	  pending_child_(),
+	  child_count_(0),
+	  needs_reparse_(false)
+{
+	current_.emplace(tree_->root());
+}
+
+void wml_parser::set_child_callback(child_fn fn)
+{
+	child_fn_ = fn;
+}
+
+void wml_parser::reserve(size_t n)
+{
+	tree_->reserve(n + 1);
+}
+
+void wml_parser::emit_pending_child()
+{
+	if(pending_child_ && child_fn_) {
+		child_fn_(pending_child_);
+	}
+	pending_child_.reset();
+}
+
+void wml_parser::feed(const std::string& contents)
+{
+	PROFILE_ZONE("wml_parser::feed");
+	PROFILE_COUNTER("bytes", contents.size());
+	auto lines = split(contents, "\n", SplitFlags::NONE);
+	for(auto& line : lines) {
+		if(needs_reparse_) {
+			return;
+		}
+		parse_line(line);
+	}
+}
+
+void wml_parser::parse_line(std::string& line)
+{
+	boost::trim(line);
+	// search for any inline comments to remove or pre-processor directives to action.
+	auto comment_pos = line.find('#');
+	if(comment_pos != std::string::npos) {
+		std::string pre_processor_stmt = line.substr(comment_pos + 1);
+		line = boost::trim_copy(line.substr(0, comment_pos));
+		if(line.empty() && pre_processor_stmt.empty()) {
+			// skip blank lines
+			return;
+		}
+		if((pre_processor_stmt[0] == ' ' || pre_processor_stmt[0] == '#') && line.empty()) {
+			// skip comments.
+			return;
+		}
+	}
+
+	// line should be valid at this point
+	boost::cmatch what;
+	if(in_multi_line_string_) {
+		// XXX
+		auto quote_pos = line.find('"');
+		ml_string_ += "\n" + line.substr(0, quote_pos);
+		if(quote_pos != std::string::npos) {
+			in_multi_line_string_ = false;
+			current_.top().add_attr(attribute_, (is_translateable_ml_string_ ? "~" : "") + ml_string_ + (is_translateable_ml_string_ ? "~" : ""));
+			is_translateable_ml_string_ = false;
+			ml_string_.clear();
+		}
+	} else if(boost::regex_match(line.c_str(), what, re_open_tag)) {
+		// Opening tag
+		std::string tag_name(what[1].first, what[1].second);
+		if(tag_name[0] == '+') {
+			++expect_merge_;
+			auto it = last_node_.find(tag_name.substr(1));
+			ASSERT_LOG(it != last_node_.end(), "Unable to find merge to node for " << tag_name);
+			if(child_fn_ && it->second.second != child_count_) {
+				// the tag it merges into is already with the callback.
+				needs_reparse_ = true;
+				pending_child_.reset();
+				return;
+			}
+			current_.emplace(it->second.first);
+		} else {
+			if(current_.size() == 1) {
+				// a new top-level tag means the previous one can't be merged into any more.
+				emit_pending_child();
+				++child_count_;
+			}
+			if(current_.size() == 1 && child_fn_) {
+				pending_child_ = std::make_shared<node_tree>(tag_name);
+				current_.emplace(pending_child_->root());
+			} else {
+				current_.emplace(current_.top().add_child(tag_name));
+			}
+			last_node_[tag_name] = std::make_pair(current_.top(), child_count_);
+		}
+	} else if(boost::regex_match(line.c_str(), what, re_close_tag)) {
+		// Closing tag
+		std::string this_tag(what[1].first, what[1].second);
+		if(expect_merge_ != 0) {
+			--expect_merge_;
+			current_.pop();
+			return;
+		}
+		ASSERT_LOG(this_tag == current_.top().name(), "tag name mismatch error: " << this_tag << " != " << current_.top().name());
+		current_.pop();
+	} else if(boost::regex_match(line.c_str(), what, re_macro_match)) {
+		ASSERT_LOG(false, "Found an unexpanded macro definition.");
+	} else {
+		std::string value;
+		auto pos = line.find_first_of('=');
+		ASSERT_LOG(pos != std::string::npos, "error no '=' " << line);
+		attribute_ = line.substr(0, pos);
+		value = line.substr(pos + 1);
+		boost::trim(value);
+		if(std::count(value.cbegin(), value.cend(), '"') == 1) {
+			in_multi_line_string_ = true;
+			is_translateable_ml_string_ = value[0] == '_' && (value[1] == ' ' || value[1] == '"');
+			auto quote_pos = value.find('"');
+			ASSERT_LOG(quote_pos != std::string::npos, "Missing quotation mark on line " << line);
+			ml_string_ = value.substr(quote_pos+1);
+		} else {
+			bool is_translateable = false;
+			if(value[0] == '_' && (value[1] == ' ' || value[1] == '"')) {
+				// mark as translatable string
+				is_translateable = true;
+			}
+			// add as string
+			auto quote_pos_start = value.find_first_of('"');
+			auto quote_pos_end = value.find_last_of('"');
+			if(quote_pos_start != std::string::npos && quote_pos_end != std::string::npos) {
+				value = value.substr(quote_pos_start+1, quote_pos_end - (quote_pos_start + 1));
+			}
+			current_.top().add_attr(attribute_, (is_translateable ? "~" : "") + value + (is_translateable ? "~" : ""));
+		}
+	}
+}
+
+node_tree_ptr wml_parser::finish()
+{
+	emit_pending_child();
+	return tree_;
+}
+
+node_tree_ptr read_wml2(const std::string& contents) 
+{
+	// one node per opening tag, so the tree is a single allocation. Merges ([+tag]) and
+	// tags inside multi-line strings are counted too, which only over-reserves.
+	size_t ntags = 0;
+	bool line_start = true;
+	for(auto c : contents) {
+		if(c == '\n') {
+			line_start = true;
+		} else if(line_start && c != ' ' && c != '\t' && c != '\r') {
+			ntags += c == '[' ? 1 : 0;
+			line_start = false;
+		}
+	}
+	wml_parser parser;
+	parser.reserve(ntags);
+	parser.feed(contents);
+	return parser.finish();
+}
+
+variant to_int(const std::string& s)
+{
+	boost::cmatch what;
+	if(boost::regex_match(s.c_str(), what, re_macro_match)) {
+		return variant(s);
+	}
+	// integer
+	try {
+		int num = boost::lexical_cast<int>(s);
+		return variant(num);
+	} catch(boost::bad_lexical_cast&) {
+		ASSERT_LOG(false, "Unable to convert value '" << s << "' to integer.");
+	}
+	return variant();
+}
+
+variant to_list_int(const std::string& s, const std::string& sep)
+{
+	std::vector<variant> list;
+	const auto strs = split(s, sep, SplitFlags::NONE);
+	for(const auto& str : strs) {
+		boost::cmatch what;
+		if(boost::regex_match(str.c_str(), what, re_num_match)) {
+			const std::string frac(what[1].first, what[1].second);
+			if(frac.empty()) {
+				// integer
+				try {
+					int num = boost::lexical_cast<int>(str);
+					list.emplace_back(variant(num));
+				} catch(boost::bad_lexical_cast&) {
+					ASSERT_LOG(false, "Unable to convert value '" << str << "' to integer.");
+				}
+			} else {
+				try {
+					double num = boost::lexical_cast<double>(str);
+					list.emplace_back(variant(num));
+				} catch(boost::bad_lexical_cast&) {
+					ASSERT_LOG(false, "Unable to convert value '" << str << "' to double.");
+				}
+			}
+		} else {
+			ASSERT_LOG(false, "Wasn't numeric value: " << str);
+		}
+	}
+	return variant(&list);
+}
+
+variant to_list_string(const std::string& s, const std::string& sep, SplitFlags flags)
+{
+	std::vector<variant> res;
+	const auto strs = split(s, sep, flags);
+	for(const auto& str : strs) {
+		res.emplace_back(variant(str));
+	}
+	return variant(&res);
+}
+
+variant to_list_string_flags(const std::string& s, const std::string& sep, SplitFlags flags)
+{
+	std::string symbol;
+	std::string start_range;
+	bool is_range = false;
+	std::vector<variant> res;
+	std::string base_str;
+	bool in_anim = false;
+
+	for(auto c : s) {
+		if(c == '~' && in_anim) {
+			start_range = symbol;
+			is_range = true;
+			symbol.clear();
+		} else if(c == '[') {
+			in_anim = true;
+			base_str = symbol;
+			symbol.clear();
+		} else if(c == ',' || c == ']') {
+			if(!symbol.empty()) {
+				if(is_range) {
+					const anim_range range(base_str, start_range + "~" + symbol);
+					is_range = false;
+					if(expand_ranges()) {
+						// flags have always been expanded without the zero padding, keep that
+						// so --expand-ranges output doesn't change.
+						for(int n = 0; n != range.size(); ++n) {
+							res.emplace_back(range.base + boost::lexical_cast<std::string>(range.number(n)));
+						}
+					} else {
+						res.emplace_back(range_to_variant(range));
+					}
+				} else if(in_anim) {
+					res.emplace_back(base_str + symbol);
+				} else {
+					res.emplace_back(symbol);
+				}
+			}
+			symbol.clear();
+		} else {
+			symbol += c;
+		}
+		if(c == ']') {
+			ASSERT_LOG(in_anim, "Not in animation definition already: " << s);
+			in_anim = false;
+		}
+	}
+	if(!symbol.empty()) {
+		res.emplace_back(symbol);
+	}
+
+	return variant(&res);
+}
+
+std::map<variant, variant> process_name_string(const std::string& s)
+{
+	return *ipf::decode_name(s);
+}
+
+void convert_attributes(const node& n, variant_builder& vb)
+{
+	for(const auto& a : n.attributes()) {
+		const std::string& key = *a.key;
+		const std::string& value = a.value;
+		switch(get_attribute_kind(key)) {
+		case attribute_kind::integer:
+			vb.add(key, to_int(value));
+			break;
+		case attribute_kind::int_list:
+			vb.add(key, to_list_int(value));
+			break;
+		case attribute_kind::string_list:
+			vb.add(key, to_list_string(value));
+			break;
+		case attribute_kind::flag_list:
+			if(!value.empty()) {
+				vb.add(key, to_list_string_flags(value, ",", SplitFlags::NONE));
+			}
+			break;
+		case attribute_kind::variations: {
+			auto vars = to_list_string(value, ";", SplitFlags::ALLOW_EMPTY_STRINGS);
+			if(!vars.is_null() && !(vars.num_elements() == 1 && vars[0].as_string().empty())) {
+				vb.add(key, vars);
+			}
+			break;
+		}
+		case attribute_kind::point: {
+			auto v = to_list_int(value);
+			vb.add("x", v[0]);
+			vb.add("y", v[1]);
+			break;
+		}
+		case attribute_kind::map_grid:
+			vb.add(key, to_list_string(value, "\n"));
+			vb.add("map_grid", terrain::builder_map_to_variant(terrain::read_builder_map(value)));
+			break;
+		case attribute_kind::terrain_types:
+			vb.add(key, to_list_string(value));
+			if(n.name() == "tile") {
+				vb.add("type_match", terrain::pattern_to_variant(terrain::compile_pattern(value)));
+			}
+			break;
+		case attribute_kind::image_name: {
+			const auto name_map = ipf::decode_name(value);
+			for(const auto& nm : *name_map) {
+				vb.add(nm.first.as_string(), nm.second);
+			}
+			break;
+		}
+		case attribute_kind::string:
+			vb.add(key, value);
+			break;
+		}
+	}
+}
+
+variant convert_node(const node& n)
+{
+	PROFILE_ZONE("convert_node");
+	std::stack<variant_builder> tags;
+	tags.emplace();
+	n.post_order_traversal<std::stack<variant_builder>>([](const node& n, std::stack<variant_builder>& tags) {
+		tags.emplace();
+	}, [](const node& n, std::stack<variant_builder>& tags) {
+		convert_attributes(n, tags.top());
+		auto old_vb = tags.top();
+		tags.pop();
+		tags.top().add(n.name(), old_vb.build());
+	}, tags);
+	return tags.top().build()[n.name()];
+}
+
+variant convert_tree(const node& n, int threads)
+{
+	PROFILE_ZONE("convert_tree");
+	if(threads <= 0) {
+		threads = std::max<int>(1, std::thread::hardware_concurrency());
+	}
+	std::vector<node> children;
+	for(node c = n.first_child(); c; c = c.next_sibling()) {
+		children.emplace_back(c);
+	}
+	// children are handed out one at a time since their sizes vary a lot.
+	std::vector<variant> values(children.size());
+	std::atomic<size_t> next_child(0);
+	auto worker = [&children, &values, &next_child]() {
+		for(size_t c = next_child++; c < children.size(); c = next_child++) {
+			values[c] = convert_node(children[c]);
+		}
+	};
+	const size_t nthreads = std::max<size_t>(1, std::min<size_t>(threads, children.size()));
+	std::vector<std::thread> pool;
+	for(size_t t = 1; t < nthreads; ++t) {
+		pool.emplace_back([&worker]() {
+			PROFILE_THREAD_NAME("convert");
+			worker();
+		});
+	}
+	worker();
+	for(auto& t : pool) {
+		t.join();
+	}
+
+	// as the post-order walk in convert_node: the children in order, then the attributes.
+	variant_builder vb;
+	for(size_t c = 0; c != children.size(); ++c) {
+		vb.add(children[c].name(), values[c]);
+	}
+	convert_attributes(n, vb);
+	return vb.build();
+}
+
+namespace
+{
+	// Top-level tags rendered at once by write_node_json(), per thread.
+	const size_t tags_per_thread_window = 32;
+
+	// A child tag of the top-level node along with the text written before it.
+	struct deferred_tag
+	{
+		deferred_tag(const std::string& b, const node& t, int i) : before(b), tag(t), indent(i), json() {}
+		std::string before;
+		node tag;
+		int indent;
+		std::string json;
+	};
+
+	void write_tag_json(std::ostream& os, const node& n, bool pretty, int indent);
+
+	// Writes n as convert_node(n).write_json(os, pretty, indent) would, with extra merged in
+	// as if they were attributes of n. The attributes of a tag are converted into a small
+	// builder, then written in key order along with its child tags, which are written by
+	// calling write_child(os, child, indent).
+	template<typename Fn>
+	void write_tag_json(std::ostream& os, const node& n, bool pretty, int indent, const std::map<variant, variant>& extra, Fn write_child)
+	{
+		variant_builder vb;
+		convert_attributes(n, vb);
+		for(const auto& p : extra) {
+			vb.add(p.first.as_string(), p.second);
+		}
+		const variant attrs = vb.build();
+		const auto& attr_map = attrs.as_map();
+
+		std::vector<node> children;
+		for(node c = n.first_child(); c; c = c.next_sibling()) {
+			children.emplace_back(c);
+		}
+		std::stable_sort(children.begin(), children.end(), [](const node& a, const node& b) { return a.name() < b.name(); });
+		for(const auto& c : children) {
+			if(attr_map.count(variant(c.name()))) {
+				// a tag and an attribute with the same name are built into one list, children
+				// first. Rare enough to leave to the builder.
+				variant_builder all;
+				for(node c = n.first_child(); c; c = c.next_sibling()) {
+					all.add(c.name(), convert_node(c));
+				}
+				convert_attributes(n, all);
+				for(const auto& p : extra) {
+					all.add(p.first.as_string(), p.second);
+				}
+				all.build().write_json(os, pretty, indent);
+				return;
+			}
+		}
+
+		const std::string sep = pretty ? ",\n" + std::string(indent, ' ') : ",";
+		const std::string list_sep = pretty ? ",\n" + std::string(indent + 4, ' ') : ",";
+		bool first = true;
+		auto write_key = [&](const variant& key) {
+			if(!first) {
+				os << sep;
+			}
+			first = false;
+			key.write_json(os, pretty, indent + 4);
+			os << (pretty ? ": " : ":");
+		};
+		os << (pretty ? ("{\n" + std::string(indent, ' ')) : "{");
+		auto attr = attr_map.cbegin();
+		for(auto c = children.cbegin(); c != children.cend() || attr != attr_map.cend(); ) {
+			if(c == children.cend() || (attr != attr_map.cend() && attr->first.as_string() < c->name())) {
+				write_key(attr->first);
+				attr->second.write_json(os, pretty, indent + 4);
+				++attr;
+				continue;
+			}
+			auto last = c + 1;
+			while(last != children.cend() && last->name() == c->name()) {
+				++last;
+			}
+			write_key(variant(c->name()));
+			if(last - c == 1) {
+				write_child(os, *c, indent + 4);
+			} else {
+				os << (pretty ? ("[\n" + std::string(indent + 4, ' ')) : "[");
+				for(auto it = c; it != last; ++it) {
+					if(it != c) {
+						os << list_sep;
+					}
+					write_child(os, *it, indent + 8);
+				}
+				os << (pretty ? ("\n" + std::string(indent, ' ') + "]") : "]");
+			}
+			c = last;
+		}
+		os << (pretty ? ("\n" + std::string(indent - 4, ' ') + "}") : "}");
+	}
+
+	void write_tag_json(std::ostream& os, const node& n, bool pretty, int indent)
+	{
+		static const std::map<variant, variant> no_extra;
+		write_tag_json(os, n, pretty, indent, no_extra, [pretty](std::ostream& os, const node& c, int indent) {
+			write_tag_json(os, c, pretty, indent);
+		});
+	}
+}
+
+void write_node_json(std::ostream& os, const node& n, bool pretty, int indent, int threads, const std::map<variant, variant>& extra)
+{
+	PROFILE_ZONE("write_node_json");
+	if(threads <= 0) {
+		threads = std::max<int>(1, std::thread::hardware_concurrency());
+	}
+	if(threads == 1) {
+		write_tag_json(os, n, pretty, indent, extra, [pretty](std::ostream& os, const node& c, int indent) {
+			write_tag_json(os, c, pretty, indent);
+		});
+		return;
+	}
+
+	// The children of n are rendered on the threads a window at a time and written in
+	// order, with the text between them, so only a window of them is held as text.
+	std::vector<deferred_tag> tags;
+	std::ostringstream text;
+	write_tag_json(text, n, pretty, indent, extra, [&tags, &text](std::ostream& os, const node& c, int indent) {
+		tags.emplace_back(text.str(), c, indent);
+		text.str("");
+	});
+	const size_t window = threads * tags_per_thread_window;
+	for(size_t first = 0; first < tags.size(); first += window) {
+		const size_t last = std::min(tags.size(), first + window);
+		std::atomic<size_t> next_tag(first);
+		auto worker = [&tags, &next_tag, last, pretty]() {
+			for(size_t t = next_tag++; t < last; t = next_tag++) {
+				std::ostringstream ss;
+				write_tag_json(ss, tags[t].tag, pretty, tags[t].indent);
+				tags[t].json = ss.str();
+			}
+		};
+		std::vector<std::thread> pool;
+		for(size_t t = 1; t < std::min<size_t>(threads, last - first); ++t) {
+			pool.emplace_back([&worker]() {
+				PROFILE_THREAD_NAME("write json");
+				worker();
+			});
+		}
+		worker();
+		for(auto& t : pool) {
+			t.join();
+		}
+		for(size_t t = first; t != last; ++t) {
+			os << tags[t].before << tags[t].json;
+			std::string().swap(tags[t].before);
+			std::string().swap(tags[t].json);
+		}
+	}
+	os << text.str();
+}
+
+UNIT_TEST(merge_into_earlier_top_level_tag)
+{
+	const std::string wml = "[tile]\nalpha=1\n[/tile]\n[image]\nbeta=2\n[/image]\n[+tile]\ngamma=3\n[/tile]\n";
+	const variant v = convert_node(read_wml2(wml)->root());
+	CHECK(v["tile"]["gamma"] == variant("3") && v["image"]["beta"] == variant("2"), "the merge wasn't applied: " << v.write_json(false));
+	CHECK_EQ(v["tile"].num_elements(), 2);
+
+	// with a callback the merged-into tag has already gone, so the parser gives up.
+	std::vector<node_tree_ptr> tags;
+	wml_parser parser;
+	parser.set_child_callback([&tags](const node_tree_ptr& n) { tags.emplace_back(n); });
+	parser.feed(wml);
+	parser.finish();
+	CHECK(parser.needs_reparse(), "a merge into a handed on tag wasn't reported");
+
+	// but a merge into the tag still being built is fine.
+	tags.clear();
+	wml_parser adjacent;
+	adjacent.set_child_callback([&tags](const node_tree_ptr& n) { tags.emplace_back(n); });
+	adjacent.feed("[tile]\nalpha=1\n[/tile]\n[+tile]\ngamma=3\n[/tile]\n[image]\nbeta=2\n[/image]\n");
+	adjacent.finish();
+	CHECK(!adjacent.needs_reparse(), "an adjacent merge needed a reparse");
+	CHECK_EQ(tags.size(), 2);
+	CHECK_EQ(tags[0]->root().attributes().size(), 2);
+}
+
+UNIT_TEST(node_tree_links)
+{
+	node_tree tree("root");
+	const node root = tree.root();
+	const node a = root.add_child("a");
+	const node b = root.add_child("b");
+	const node b1 = b.add_child("b1");
+	// a child added after its parent's siblings still links up.
+	const node c = root.add_child("c");
+	const node b2 = b.add_child("b2");
+	CHECK_EQ(tree.size(), 6);
+	CHECK(root.name() == "root" && !root.parent(), "");
+	CHECK(root.first_child() == a && a.next_sibling() == b && b.next_sibling() == c && !c.next_sibling(), "");
+	CHECK(b.first_child() == b1 && b1.next_sibling() == b2 && !b2.next_sibling(), "");
+	CHECK(b2.parent() == b && b.parent() == root && c.parent() == root, "");
+	CHECK(!a.first_child() && b2.name() == "b2", "");
+	CHECK(a != b && a == root.first_child(), "");
+
+	// read_wml2 gives one node per tag, in the order they open, under an unnamed root.
+	const auto parsed = read_wml2("[one]\n[two]\n[three]\n[/three]\n[/two]\n[four]\n[/four]\n[/one]\n[five]\n[/five]\n");
+	CHECK_EQ(parsed->size(), 6);
+	std::vector<std::string> names;
+	parsed->root().pre_order_traversal<std::vector<std::string>>([](const node& n, std::vector<std::string>& names) {
+		names.emplace_back(n.name());
+		return true;
+	}, names);
+	CHECK(names == std::vector<std::string>({ "", "one", "two", "three", "four", "five" }), boost::join(names, ","));
+}
+
+UNIT_TEST(attribute_list_set_and_find)
+{
+	node_tree tree("root");
+	const node n = tree.root();
+	// more than fit inline, added out of order.
+	const std::vector<std::string> keys = { "layer", "name", "base", "x", "center", "variations", "alpha" };
+	for(const auto& k : keys) {
+		n.add_attr(k, k + "-value");
+	}
+	// overwriting keeps one entry with the latest value, inline or not.
+	n.add_attr("name", "first");
+	n.add_attr("name", "second");
+	n.add_attr("alpha", "replaced");
+	const attribute_list& attrs = n.attributes();
+	CHECK_EQ(attrs.size(), keys.size());
+	CHECK(*attrs.find(tree.intern("name")) == "second" && *attrs.find(tree.intern("alpha")) == "replaced", "");
+	CHECK(*attrs.find(tree.intern("center")) == "center-value", "");
+	CHECK(attrs.find(tree.intern("missing")) == nullptr, "");
+	std::vector<std::string> order;
+	for(const auto& a : attrs) {
+		order.emplace_back(*a.key);
+	}
+	CHECK(std::is_sorted(order.begin(), order.end()), "attributes should be in key order: " << boost::join(order, ","));
+
+	// and the same below the inline size.
+	const node small = n.add_child("small");
+	small.add_attr("b", "1");
+	small.add_attr("a", "2");
+	small.add_attr("b", "3");
+	CHECK_EQ(small.attributes().size(), 2);
+	CHECK(*small.attributes().begin()->key == "a" && *small.attributes().find(tree.intern("b")) == "3", "");
+	CHECK(node_tree("other").root().attributes().empty(), "");
+
+	// a key given twice in WML keeps the last value.
+	const auto parsed = read_wml2("[tag]\nkey=1\nkey=2\n[/tag]\n");
+	const node tag = parsed->root().first_child();
+	CHECK(tag.attributes().size() == 1 && *tag.attributes().find(parsed->intern("key")) == "2", "");
+}
+
+UNIT_TEST(node_traversal_order_and_depth)
+{
+	// tag names are at least two characters, the second one is enough here.
+	const auto tree = read_wml2("[ta]\n[tb]\n[tc]\n[/tc]\n[td]\n[/td]\n[/tb]\n[te]\n[/te]\n[/ta]\n[tf]\n[/tf]\n");
+	const node a = tree->root().first_child();
+	std::string pre, post;
+	a.pre_order_traversal<std::string>([](const node& n, std::string& s) {
+		s += n.name()[1];
+		return true;
+	}, pre);
+	CHECK_EQ(pre, "abcde");
+	a.post_order_traversal<std::string>([](const node& n, std::string& s) {
+		s += "(" + n.name().substr(1);
+	}, [](const node&, std::string& s) {
+		s += ")";
+	}, post);
+	// only the subtree, not the sibling after it.
+	CHECK_EQ(post, "(a(b(c)(d))(e))");
+
+	// returning false stops the walk.
+	std::string partial;
+	const bool finished = a.pre_order_traversal<std::string>([](const node& n, std::string& s) {
+		s += n.name()[1];
+		return n.name() != "tc";
+	}, partial);
+	CHECK(!finished && partial == "abc", partial);
+
+	// deep enough to overflow the stack if the walk recursed.
+	const int depth = 200000;
+	node_tree deep("root");
+	node n = deep.root();
+	for(int d = 0; d != depth; ++d) {
+		n = n.add_child("t");
+	}
+	std::pair<int, int> entered_left(0, 0);
+	deep.root().post_order_traversal<std::pair<int, int>>([](const node&, std::pair<int, int>& p) { ++p.first; }, [](const node&, std::pair<int, int>& p) { ++p.second; }, entered_left);
+	const int entered = entered_left.first, left = entered_left.second;
+	CHECK(entered == depth + 1 && left == depth + 1, entered << " " << left);
+}
+
+UNIT_TEST(convert_tree_matches_convert_node)
+{
+	// repeated tags become lists in source order, a tag seen once stays a map.
+	std::ostringstream wml;
+	for(int n = 0; n != 100; ++n) {
+		wml << "[terrain_graphics]\n\tprobability=" << n << "\n\trotations=n,ne,se,s,sw,nw\n"
+			<< "\t[tile]\n\t\tx,y=0," << n % 4 << "\n\t\ttype=Gg^Vh,Ww\n\t[/tile]\n"
+			<< "\t[image]\n\t\tname=tiles/t" << n << ".png:" << n * 10 << "\n\t\tlayer=" << -n << "\n\t[/image]\n"
+			<< "[/terrain_graphics]\n";
+		if(n % 10 == 0) {
+			wml << "[terrain_type]\n\tstring=G" << n << "\n[/terrain_type]\n";
+		}
+	}
+	wml << "[only_once]\n\tcenter=1,2\n[/only_once]\n";
+	const auto tree = read_wml2(wml.str());
+	// convert_node() of the root gives what the root holds, as convert_tree() does.
+	const variant expected = convert_node(tree->root());
+	for(int threads : { 1, 3, 8 }) {
+		const variant v = convert_tree(tree->root(), threads);
+		CHECK(v == expected, "convert_tree() differs with " << threads << " threads");
+	}
+	const variant v = convert_tree(tree->root(), 4);
+	CHECK_EQ(v["terrain_graphics"].num_elements(), 100);
+	CHECK(v["terrain_graphics"][37]["probability"] == variant(37), "");
+	CHECK(v["only_once"].is_map(), "");
+	CHECK(convert_tree(node_tree("empty").root(), 4) == convert_node(node_tree("empty").root()), "");
+}
+
+UNIT_TEST(write_node_json_matches_write_json)
+{
+	std::ostringstream wml;
+	for(int n = 0; n != 150; ++n) {
+		wml << "[terrain_graphics]\n"
+			<< "\tmap=\", 1\n2, 3\"\n"
+			<< "\tprobability=" << n % 100 << "\n"
+			<< "\trotations=n,ne,se,s,sw,nw\n"
+			<< "\t[tile]\n\t\tpos=1\n\t\ttype=Gg,!,Ww^*\n\t\tset_no_flag=base[1~3],edge-@R0\n\t[/tile]\n"
+			<< "\t[tile]\n\t\tx,y=0," << n % 3 << "\n\t\ttype=*\n"
+			<< "\t\t[image]\n\t\t\tname=water/ocean-A[01~17].png~CROP(0,0,72,72):100\n\t\t\tvariations=;2;3\n\t\t\tlayer=-" << n << "\n\t\t[/image]\n"
+			<< "\t[/tile]\n"
+			<< "\tdescription=_ \"rule " << n << "\"\n"
+			<< "[/terrain_graphics]\n";
+	}
+	wml << "[terrain_type]\nstring=Gg\n[/terrain_type]\n";
+	const auto tree = read_wml2(wml.str());
+	for(bool pretty : { true, false }) {
+		const std::string expected = convert_node(tree->root()).write_json(pretty, 4);
+		for(int threads : { 1, 4 }) {
+			std::ostringstream os;
+			write_node_json(os, tree->root(), pretty, 4, threads);
+			CHECK(os.str() == expected, "pretty " << pretty << " with " << threads << " threads");
+		}
+	}
+}